@@ -24,6 +24,8 @@
 #include <sys/endian.h>
 #include <sys/errno.h>
 #include <sys/kernel.h>
+#include <sys/lock.h>
+#include <sys/mutex.h>
 #include <sys/rman.h>
 
 #include <net/ethernet.h>
@@ -365,7 +367,7 @@ alx_reset_phy(struct alx_hw *hw, bool hib_en)
 	}
 
 	/* EEE advertisement */
-	if (ALX_CAP(hw, AZ)) {
+	if (ALX_PM_CAP(hw, AZ)) {
 		alx_write_phy_ext(hw, ALX_MIIEXT_ANEG,
 			ALX_MIIEXT_LOCAL_EEEADV,
 			ALX_CAP(hw, GIGA) ?
@@ -471,7 +473,7 @@ void alx_reset_pcie(struct alx_hw *hw)
 	}
 
 	/* ASPM setting */
-	alx_enable_aspm(hw, ALX_CAP(hw, L0S), ALX_CAP(hw, L1));
+	alx_enable_aspm(hw, ALX_PM_CAP(hw, L0S), ALX_PM_CAP(hw, L1));
 
 	udelay(10);
 }
@@ -607,7 +609,7 @@ u32 ethadv_to_hw_cfg(struct alx_hw *hw, u32 ethadv_cfg)
 			cfg |= ADVERTISE_PAUSE_CAP;
 		if (ethadv_cfg & ADVERTISED_Asym_Pause)
 			cfg |= ADVERTISE_PAUSE_ASYM;
-		if (ALX_CAP(hw, AZ))
+		if (ALX_PM_CAP(hw, AZ))
 			cfg |= ALX_DRV_PHY_EEE;
 	} else {
 		switch (ethadv_cfg) {
@@ -1251,10 +1253,11 @@ void alx_configure_basic(struct alx_hw *hw)
 	alx_set_macaddr(hw, hw->mac_addr);
 
 	/* clk gating */
-	ALX_MEM_W32(hw, ALX_CLK_GATE, ALX_CLK_GATE_ALL_A0);
+	ALX_MEM_W32(hw, ALX_CLK_GATE,
+		hw->low_latency ? 0 : ALX_CLK_GATE_ALL_A0);
 
 	/* idle timeout to switch clk_125M */
-	if (chip_rev >= ALX_REV_B0) {
+	if (chip_rev >= ALX_REV_B0 && !hw->low_latency) {
 		ALX_MEM_W32(hw, ALX_IDLE_DECISN_TIMER,
 			ALX_IDLE_DECISN_TIMER_DEF);
 	}
@@ -1501,3 +1504,135 @@ bool alx_get_phy_info(struct alx_hw *hw)
 
 	return true;
 }
+
+/* Registers for each TX queue's TPD ring. */
+const struct alx_txq_reg alx_txq_regs[ALX_MAX_TX_QUEUES] = {
+	{ ALX_TPD_PRI0_ADDR_LO, ALX_TPD_PRI0_PIDX, ALX_TPD_PRI0_CIDX },
+	{ ALX_TPD_PRI1_ADDR_LO, ALX_TPD_PRI1_PIDX, ALX_TPD_PRI1_CIDX },
+	{ ALX_TPD_PRI2_ADDR_LO, ALX_TPD_PRI2_PIDX, ALX_TPD_PRI2_CIDX },
+	{ ALX_TPD_PRI3_ADDR_LO, ALX_TPD_PRI3_PIDX, ALX_TPD_PRI3_CIDX },
+};
+
+/* Interrupt status bits for each TX queue. */
+const u32 alx_txq_isr[ALX_MAX_TX_QUEUES] = {
+	ALX_ISR_TX_Q0, ALX_ISR_TX_Q1, ALX_ISR_TX_Q2, ALX_ISR_TX_Q3,
+};
+
+/* Interrupt status bits for each RX queue. */
+const u32 alx_rxq_isr[ALX_MAX_RX_QUEUES] = {
+	ALX_ISR_RX_Q0, ALX_ISR_RX_Q1, ALX_ISR_RX_Q2, ALX_ISR_RX_Q3,
+	ALX_ISR_RX_Q4, ALX_ISR_RX_Q5, ALX_ISR_RX_Q6, ALX_ISR_RX_Q7,
+};
+
+/*
+ * Location of each queue's vector number in the MSI map tables: pairs of
+ * (table index, shift).
+ */
+const int alx_txq_vec_map[ALX_MAX_TX_QUEUES][2] = {
+	{ 0, ALX_MSI_MAP_TBL1_TXQ0_SHIFT }, { 0, ALX_MSI_MAP_TBL1_TXQ1_SHIFT },
+	{ 1, ALX_MSI_MAP_TBL2_TXQ2_SHIFT }, { 1, ALX_MSI_MAP_TBL2_TXQ3_SHIFT },
+};
+
+const int alx_rxq_vec_map[ALX_MAX_RX_QUEUES][2] = {
+	{ 0, ALX_MSI_MAP_TBL1_RXQ0_SHIFT }, { 0, ALX_MSI_MAP_TBL1_RXQ1_SHIFT },
+	{ 0, ALX_MSI_MAP_TBL1_RXQ2_SHIFT }, { 0, ALX_MSI_MAP_TBL1_RXQ3_SHIFT },
+	{ 1, ALX_MSI_MAP_TBL2_RXQ4_SHIFT }, { 1, ALX_MSI_MAP_TBL2_RXQ5_SHIFT },
+	{ 1, ALX_MSI_MAP_TBL2_RXQ6_SHIFT }, { 1, ALX_MSI_MAP_TBL2_RXQ7_SHIFT },
+};
+
+static const u8 def_rss_key[40] = {
+	0xE2, 0x91, 0xD7, 0x3D, 0x18, 0x05, 0xEC, 0x6C,
+	0x2A, 0x94, 0xB3, 0x0D, 0xA5, 0x4F, 0x2B, 0xEC,
+	0xEA, 0x49, 0xAF, 0x7C, 0xE2, 0x14, 0xAD, 0x3D,
+	0xB8, 0x55, 0xAA, 0xBE, 0x6A, 0x3E, 0x67, 0xEA,
+	0x14, 0x36, 0x4D, 0x17, 0x3B, 0xED, 0x20, 0x0D,
+};
+
+static int
+alx_identify_hw(struct alx_hw *hw)
+{
+	int rev;
+
+	hw->device_id = pci_get_device(hw->dev);
+	hw->subdev_id = pci_get_subdevice(hw->dev);
+	hw->subven_id = pci_get_subvendor(hw->dev);
+	hw->revision = pci_get_revid(hw->dev);
+	rev = ALX_REVID(hw);
+
+	switch (ALX_DID(hw)) {
+	case ALX_DEV_ID_AR8161:
+	case ALX_DEV_ID_AR8162:
+	case ALX_DEV_ID_AR8171:
+	case ALX_DEV_ID_AR8172:
+	case ALX_DEV_ID_KI2201:
+		if (rev > ALX_REV_C0)
+			break;
+		ALX_CAP_SET(hw, L0S);
+		ALX_CAP_SET(hw, L1);
+		ALX_CAP_SET(hw, MTQ);
+		ALX_CAP_SET(hw, RSS);
+		ALX_CAP_SET(hw, MSIX);
+		ALX_CAP_SET(hw, SWOI);
+		hw->max_dma_chnl = rev >= ALX_REV_B0 ? 4 : 2;
+		if (rev < ALX_REV_C0) {
+			hw->ptrn_ofs = 0x600;
+			hw->max_ptrns = 8;
+		} else {
+			hw->ptrn_ofs = 0x14000;
+			hw->max_ptrns = 16;
+		}
+		break;
+	default:
+		return (EINVAL);
+	}
+
+	if (ALX_DID(hw) & 1)
+		ALX_CAP_SET(hw, GIGA);
+
+	return (0);
+}
+
+/*
+ * Identify the chip behind hw->dev and fill in the defaults both front ends
+ * share. Interrupt moderation and the ring-dependent settings, such as
+ * hw->ith_tpd, are the caller's.
+ */
+int
+alx_init_hw_sw(struct alx_hw *hw)
+{
+	int i, error;
+
+	error = alx_identify_hw(hw);
+	if (error != 0)
+		return (error);
+
+	/* assign patch flag for specific platforms */
+	alx_patch_assign(hw);
+
+	memcpy(hw->rss_key, def_rss_key, sizeof(def_rss_key));
+	hw->rss_idt_size = 128;
+	hw->rss_hash_type = ALX_RSS_HASH_TYPE_ALL;
+	hw->smb_timer = 400;
+	hw->low_latency = false;
+	hw->sleep_ctrl = ALX_SLEEP_WOL_MAGIC | ALX_SLEEP_WOL_PHY;
+	hw->imask = ALX_ISR_MISC;
+	hw->dma_chnl = hw->max_dma_chnl;
+	hw->link_up = false;
+	hw->link_duplex = 0;
+	hw->link_speed = 0;
+	hw->adv_cfg = ADVERTISED_Autoneg | ADVERTISED_10baseT_Half |
+	    ADVERTISED_10baseT_Full | ADVERTISED_100baseT_Full |
+	    ADVERTISED_100baseT_Half | ADVERTISED_1000baseT_Full;
+	hw->flowctrl = ALX_FC_ANEG | ALX_FC_RX | ALX_FC_TX;
+	hw->wrr_ctrl = ALX_WRR_PRI_RESTRICT_NONE;
+	for (i = 0; i < ARRAY_SIZE(hw->wrr); i++)
+		hw->wrr[i] = 4;
+
+	hw->rx_ctrl = ALX_MAC_CTRL_WOLSPED_SWEN | ALX_MAC_CTRL_MHASH_ALG_HI5B |
+	    ALX_MAC_CTRL_BRD_EN | ALX_MAC_CTRL_PCRCE | ALX_MAC_CTRL_CRCE |
+	    ALX_MAC_CTRL_RXFC_EN | ALX_MAC_CTRL_TXFC_EN |
+	    FIELDX(ALX_MAC_CTRL_PRMBLEN, 7);
+	hw->is_fpga = false;
+
+	return (0);
+}
@@ -528,7 +528,11 @@ struct alx_hw {
 	spinlock_t		mdio_lock;
 	struct mdio_if_info	mdio;
 #endif
-        int                     mdio_lock;
+	/*
+	 * Serializes PHY register access. It may be taken with alx_mtx held,
+	 * so that the link task can talk to the PHY without alx_mtx.
+	 */
+	struct mtx		mdio_lock;
 	u16			phy_id[2];
 
 	struct alx_hw_stats	stats;
@@ -538,6 +542,8 @@ struct alx_hw {
 	bool			hib_patch;
 	/* FPGA or ASIC */
 	bool			is_fpga;
+	/* keep ASPM, EEE and clock gating off to cut wake-up latency */
+	bool			low_latency;
 };
 
 #define ALX_DID(_hw)		((_hw)->device_id)
@@ -566,6 +572,9 @@ enum ALX_CAPS {
 	set_bit(ALX_CAP_##_cap, &(_hw)->capability))
 #define ALX_CAP_CLEAR(_hw, _cap) (\
 	clear_bit(ALX_CAP_##_cap, &(_hw)->capability))
+/* a power saving capability that is also allowed by the current profile */
+#define ALX_PM_CAP(_hw, _cap) (\
+	!(_hw)->low_latency && ALX_CAP(_hw, _cap))
 
 /* write to 8bit register via pci memory space */
 #define ALX_MEM_W8(s, reg, val) (bus_write_1((s)->hw_addr, (reg), (val)))
@@ -654,5 +663,19 @@ struct alx_platform_patch {
 
 void alx_patch_assign(struct alx_hw *hw);
 bool alx_get_phy_info(struct alx_hw *hw);
+int alx_init_hw_sw(struct alx_hw *hw);
+
+/* Per-queue registers and interrupt bits, shared by both front ends. */
+struct alx_txq_reg {
+	u16	addr_lo;
+	u16	pidx;
+	u16	cidx;
+};
+
+extern const struct alx_txq_reg alx_txq_regs[ALX_MAX_TX_QUEUES];
+extern const u32 alx_txq_isr[ALX_MAX_TX_QUEUES];
+extern const u32 alx_rxq_isr[ALX_MAX_RX_QUEUES];
+extern const int alx_txq_vec_map[ALX_MAX_TX_QUEUES][2];
+extern const int alx_rxq_vec_map[ALX_MAX_RX_QUEUES][2];
 
 #endif
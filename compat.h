@@ -43,6 +43,7 @@ typedef vm_paddr_t dma_addr_t;
 
 #define set_bit(bit, name)	bit_set((bitstr_t *)name, bit)
 #define test_bit(bit, name)	bit_test((bitstr_t *)name, bit)
+#define clear_bit(bit, name)	bit_clear((bitstr_t *)name, bit)
 
 #define SPEED_10	10
 #define SPEED_100	100
@@ -93,9 +94,9 @@ typedef vm_paddr_t dma_addr_t;
 
 #define unlikely(x)	x
 
-/* XXX */
-#define spin_lock(x)
-#define spin_unlock(x)
+/* Only hw->mdio_lock is taken through these. */
+#define spin_lock(x)	mtx_lock(x)
+#define spin_unlock(x)	mtx_unlock(x)
 
 #define ARRAY_SIZE(x)   (sizeof(x) / sizeof(x[0]))
 
@@ -17,18 +17,30 @@
 
 #include <sys/cdefs.h>
 
+#ifdef HAVE_KERNEL_OPTION_HEADERS
+#include "opt_device_polling.h"
+#endif
+
 #include <sys/param.h>
 #include <sys/systm.h>
 #include <sys/bitstring.h>
+#include <sys/buf_ring.h>
 #include <sys/bus.h>
+#include <sys/counter.h>
+#include <sys/cpuset.h>
 #include <sys/endian.h>
 #include <sys/kernel.h>
 #include <sys/lock.h>
+#include <sys/malloc.h>
 #include <sys/mbuf.h>
 #include <sys/module.h>
 #include <sys/mutex.h>
+#include <sys/proc.h>
 #include <sys/queue.h>
 #include <sys/rman.h>
+#include <sys/sbuf.h>
+#include <sys/sdt.h>
+#include <sys/smp.h>
 #include <sys/socket.h>
 #include <sys/sockio.h>
 #include <sys/sysctl.h>
@@ -44,6 +56,11 @@
 #include <net/if_vlan_var.h>
 
 #include <netinet/in.h>
+#include <netinet/in_systm.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp.h>
+#include <netinet/tcp_lro.h>
 
 #include <dev/pci/pcireg.h>
 #include <dev/pci/pcivar.h>
@@ -89,33 +106,99 @@ static void	alx_init(void *);
 static void	alx_init_locked(struct alx_softc *);
 static int	alx_media_change(struct ifnet *);
 static void	alx_media_status(struct ifnet *, struct ifmediareq *);
-static void	alx_start(struct ifnet *);
-static void	alx_start_locked(struct ifnet *);
+static void	alx_qflush(struct ifnet *);
+static void	alx_rxvlan(struct alx_softc *);
+static void	alx_rxfilter(struct alx_softc *);
+static void	alx_start_locked(struct ifnet *, struct alx_tx_queue *);
+static int	alx_transmit(struct ifnet *, struct mbuf *);
+static void	alx_txq_task(void *, int);
 
 static int	alx_alloc_intr(struct alx_softc *);
 static void	alx_free_intr(struct alx_softc *);
 static void	alx_link_task(void *, int);
 static void	alx_int_task(void *, int);
+static void	alx_imod_apply(struct alx_softc *);
+static void	alx_imod_set(struct alx_softc *, int, int);
+static void	alx_imod_update(struct alx_softc *);
 static void	alx_intr_disable(struct alx_softc *);
 static void	alx_intr_enable(struct alx_softc *);
 static int	alx_intr_legacy(void *);
+#ifdef DEVICE_POLLING
+static poll_handler_t alx_poll;
+#endif
 static int	alx_intr_msi(void *);
-
+static void	alx_intr_ack(struct alx_softc *, uint32_t);
+static int	alx_intr_msix_misc(void *);
+static int	alx_intr_msix_ring(void *);
+static int	alx_alloc_msix(struct alx_softc *);
+static void	alx_map_msix(struct alx_softc *);
+static void	alx_msix_task(void *, int);
+
+static void	alx_init_rss(struct alx_softc *);
 static void	alx_reset(struct alx_softc *sc);
+static void	alx_add_sysctls(struct alx_softc *);
+static int	alx_sysctl_process_limit(SYSCTL_HANDLER_ARGS);
+static int	alx_sysctl_copybreak(SYSCTL_HANDLER_ARGS);
+static int	alx_sysctl_tx_bounce(SYSCTL_HANDLER_ARGS);
+static int	alx_sysctl_ring_size(SYSCTL_HANDLER_ARGS);
+static int	alx_sysctl_imod_profile(SYSCTL_HANDLER_ARGS);
+static int	alx_sysctl_imod_timer(SYSCTL_HANDLER_ARGS);
+static int	alx_sysctl_pm_profile(SYSCTL_HANDLER_ARGS);
+static int	alx_sysctl_hist_enable(SYSCTL_HANDLER_ARGS);
+static int	alx_sysctl_hist(SYSCTL_HANDLER_ARGS);
+static void	alx_hist_add(struct alx_hist *, uint64_t);
+static void	alx_intr_delay(struct alx_softc *, struct alx_vec *);
+static int	alx_sysctl_bench_run(SYSCTL_HANDLER_ARGS);
+static int	alx_sysctl_bench_results(SYSCTL_HANDLER_ARGS);
+static int	alx_bench_sizes(struct alx_softc *, int *, int *);
+static struct mbuf *alx_bench_frame(struct alx_softc *, int, int, u_int);
+static int	alx_bench_queue(struct alx_softc *, struct alx_tx_queue *, int,
+		    uint32_t *, struct alx_bench_result *);
+static void	alx_bench_input(struct alx_softc *, struct mbuf *);
+static int	alx_bench_cmp(const void *, const void *);
 static void	alx_update_link(struct alx_softc *);
+static void	alx_imr_write(struct alx_softc *);
+static void	alx_link_kick(struct alx_softc *);
+static void	alx_watchdog(struct alx_softc *);
+static void	alx_recover(struct alx_softc *);
+static void	alx_reset_task(void *, int);
+static void	alx_task_fence(struct taskqueue *, struct task *);
+static void	alx_tasks_fence(struct alx_softc *, bool);
+static bool	alx_tasks_halted(struct alx_softc *);
 
 static int	alx_dma_alloc(struct alx_softc *);
-#if 0
 static void	alx_dma_free(struct alx_softc *);
-#endif
+static int	alx_rings_alloc(struct alx_softc *, struct alx_rings *);
+static void	alx_rings_free(struct alx_softc *, struct alx_rings *);
+static void	alx_rings_swap(struct alx_softc *, struct alx_rings *);
 static void	alx_dmamap_cb(void *, bus_dma_segment_t *, int, int);
 
 static void	alx_init_rx_ring(struct alx_softc *);
 static void	alx_init_tx_ring(struct alx_softc *);
-static int	alx_newbuf(struct alx_softc *, int);
-static void	alx_rxintr(struct alx_softc *);
-static void	alx_txintr(struct alx_softc *);
-static int	alx_xmit(struct alx_softc *, struct mbuf **);
+static int	alx_newbuf(struct alx_softc *, struct alx_rx_queue *, int);
+static void	alx_set_rxbuf_size(struct alx_softc *);
+static int	alx_rx_hash(struct alx_softc *, struct rrd_desc *,
+		    struct mbuf *);
+static int	alx_rx_refill(struct alx_softc *, struct alx_rx_queue *);
+static void	alx_rx_input(struct alx_rx_queue *, struct mbuf *, bool);
+static int	alx_rxintr(struct alx_softc *, struct alx_rx_queue *, int);
+static void	alx_swq_task(void *, int);
+static bool	alx_txeof(struct alx_softc *, struct alx_tx_queue *, int);
+static bool	alx_txintr(struct alx_softc *, struct alx_tx_queue *, int);
+static int	alx_xmit(struct alx_softc *, struct alx_tx_queue *,
+		    struct mbuf **, bool *);
+static int	alx_tx_bounce(struct alx_softc *, struct alx_tx_queue *,
+		    struct mbuf *, uint32_t, uint32_t);
+static void	alx_tx_doorbell(struct alx_softc *, struct alx_tx_queue *);
+static void	alx_tick(void *);
+static uint64_t	alx_get_counter(struct ifnet *, ift_counter);
+static void	alx_counters_alloc(struct alx_softc *);
+static void	alx_counters_free(struct alx_softc *);
+static void	alx_add_stats_sysctls(struct alx_softc *);
+
+#ifdef DEV_NETMAP
+#include "if_alx_netmap.h"
+#endif
 
 static device_method_t alx_methods[] = {
 	DEVMETHOD(device_probe,		alx_probe),
@@ -140,7 +223,7 @@ DRIVER_MODULE(alx, pci, alx_driver, alx_devclass, 0, 0);
 
 static SYSCTL_NODE(_hw, OID_AUTO, alx, CTLFLAG_RD, 0, "alx driver settings");
 
-static int alx_enable_msix = 0;
+static int alx_enable_msix = 1;
 TUNABLE_INT("hw.alx.enable_msix", &alx_enable_msix);
 SYSCTL_INT(_hw_alx, OID_AUTO, enable_msix, CTLFLAG_RDTUN, &alx_enable_msix,
     0, "Enable MSI-X interrupts");
@@ -150,6 +233,53 @@ TUNABLE_INT("hw.alx.enable_msi", &alx_enable_msi);
 SYSCTL_INT(_hw_alx, OID_AUTO, enable_msi, CTLFLAG_RDTUN, &alx_enable_msi,
     0, "Enable MSI interrupts");
 
+static int alx_rx_queues = 0;
+TUNABLE_INT("hw.alx.rx_queues", &alx_rx_queues);
+SYSCTL_INT(_hw_alx, OID_AUTO, rx_queues, CTLFLAG_RDTUN, &alx_rx_queues,
+    0, "Number of RSS receive queues (0 means one per CPU)");
+
+static int alx_tx_queues = 0;
+TUNABLE_INT("hw.alx.tx_queues", &alx_tx_queues);
+SYSCTL_INT(_hw_alx, OID_AUTO, tx_queues, CTLFLAG_RDTUN, &alx_tx_queues,
+    0, "Number of transmit queues (0 means one per CPU)");
+
+static int alx_rx_copybreak = ALX_RX_COPYBREAK_DEF;
+TUNABLE_INT("hw.alx.rx_copybreak", &alx_rx_copybreak);
+SYSCTL_INT(_hw_alx, OID_AUTO, rx_copybreak, CTLFLAG_RDTUN, &alx_rx_copybreak,
+    0, "Copy received frames up to this size into a new mbuf");
+
+static int alx_tx_bounce_thresh = ALX_TX_BOUNCE_DEF;
+TUNABLE_INT("hw.alx.tx_bounce", &alx_tx_bounce_thresh);
+SYSCTL_INT(_hw_alx, OID_AUTO, tx_bounce, CTLFLAG_RDTUN, &alx_tx_bounce_thresh,
+    0, "Copy transmitted frames up to this size into a pre-mapped buffer");
+
+static int alx_tx_ring_size = ALX_TX_RING_DEF;
+TUNABLE_INT("hw.alx.tx_ring_size", &alx_tx_ring_size);
+SYSCTL_INT(_hw_alx, OID_AUTO, tx_ring_size, CTLFLAG_RDTUN, &alx_tx_ring_size,
+    0, "Number of descriptors in each TX ring");
+
+static int alx_rx_ring_size = ALX_RX_RING_DEF;
+TUNABLE_INT("hw.alx.rx_ring_size", &alx_rx_ring_size);
+SYSCTL_INT(_hw_alx, OID_AUTO, rx_ring_size, CTLFLAG_RDTUN, &alx_rx_ring_size,
+    0, "Number of descriptors in the RX ring");
+
+SDT_PROVIDER_DEFINE(alx);
+/* interrupt filters: the status bits being handled */
+SDT_PROBE_DEFINE2(alx, , , intr__filter, "struct alx_softc *", "uint32_t");
+/* interrupt tasks: the vector, and on return whether work is left */
+SDT_PROBE_DEFINE2(alx, , , task__start, "struct alx_softc *", "int");
+SDT_PROBE_DEFINE3(alx, , , task__done, "struct alx_softc *", "int", "bool");
+SDT_PROBE_DEFINE2(alx, , , rx__deliver, "struct alx_rx_queue *",
+    "struct mbuf *");
+/* a frame queued in the TPD ring, with the number of descriptors used */
+SDT_PROBE_DEFINE3(alx, , , tx__enqueue, "struct alx_tx_queue *",
+    "struct mbuf *", "int");
+/* a producer index write, with the number of descriptors it posts */
+SDT_PROBE_DEFINE3(alx, , , tx__doorbell, "struct alx_tx_queue *", "int",
+    "int");
+SDT_PROBE_DEFINE2(alx, , , tx__complete, "struct alx_tx_queue *",
+    "struct mbuf *");
+
 static void
 alx_dmamap_cb(void *arg, bus_dma_segment_t *segs, int nseg, int error)
 {
@@ -160,201 +290,345 @@ alx_dmamap_cb(void *arg, bus_dma_segment_t *segs, int nseg, int error)
 }
 
 /*
- * XXX:
- * - multiple queues
- * - does the chipset's DMA engine support more than one segment?
+ * Allocate a set of rings of r->tx_ringsz and r->rx_ringsz descriptors, with
+ * their buffer arrays and DMA maps. All descriptor rings live in a single
+ * allocation below 4GB. This keeps them in one 4GB block, as required by the
+ * shared TX and RX ADDR_HI registers, and gives each ring a cache line
+ * aligned start. On failure the caller releases r with alx_rings_free().
  */
 static int
-alx_dma_alloc(struct alx_softc *sc)
+alx_rings_alloc(struct alx_softc *sc, struct alx_rings *r)
 {
 	device_t dev;
-	struct alx_hw *hw;
+	struct alx_ring_header *rh;
 	struct alx_buffer *buf;
-	int error, i;
+	bus_size_t tpd_sz, rfd_sz, rrd_sz;
+	int error, i, q;
 
 	dev = sc->alx_dev;
-	hw = &sc->hw;
-
-	/* Create parent tag. */
-	error = bus_dma_tag_create(
-	    bus_get_dma_tag(sc->alx_dev),	/* parent */
-	    1, 0,				/* alignment, boundary */
-	    BUS_SPACE_MAXADDR,			/* lowaddr */
-	    BUS_SPACE_MAXADDR,			/* highaddr */
-	    NULL, NULL,				/* filter, filterarg */
-	    BUS_SPACE_MAXSIZE_32BIT,		/* maxsize */
-	    1,					/* nsegments */
-	    BUS_SPACE_MAXSIZE_32BIT,		/* maxsegsize */
-	    0,					/* flags */
-	    NULL, NULL,				/* lockfunc, lockfuncarg */
-	    &sc->alx_parent_tag);
-	if (error != 0) {
-		device_printf(dev, "could not create parent DMA tag\n");
-		return (error);
-	}
+	rh = &r->rh;
 
-	/* Create the DMA tag for the transmit packet descriptor ring. */
-	/* XXX assuming 1 queue at the moment. */
+	/*
+	 * Lay out the arena: the TPD rings of every TX queue, then the RFD and
+	 * RRD rings of every hardware RX queue.
+	 */
+	tpd_sz = roundup2(r->tx_ringsz * sizeof(struct tpd_desc),
+	    ALX_RING_ALIGN);
+	rfd_sz = roundup2(r->rx_ringsz * sizeof(struct rfd_desc),
+	    ALX_RING_ALIGN);
+	rrd_sz = roundup2(r->rx_ringsz * sizeof(struct rrd_desc),
+	    ALX_RING_ALIGN);
+	rh->size = sc->nr_txq * tpd_sz + sc->nr_hwrxq * (rfd_sz + rrd_sz);
+
+	/* Create the DMA tag for the descriptor rings. */
 	error = bus_dma_tag_create(
 	    sc->alx_parent_tag,			/* parent */
-	    8, 0,				/* alignment, boundary */
-	    BUS_SPACE_MAXADDR,			/* lowaddr */
+	    ALX_RING_ALIGN, 0,			/* alignment, boundary */
+	    BUS_SPACE_MAXADDR_32BIT,		/* lowaddr */
 	    BUS_SPACE_MAXADDR,			/* highaddr */
 	    NULL, NULL,				/* filter, filterarg */
-	    sc->tx_ringsz * sizeof(struct tpd_desc), /* maxsize */
+	    rh->size,				/* maxsize */
 	    1,					/* nsegments */
-	    sc->tx_ringsz * sizeof(struct tpd_desc), /* maxsegsize */
+	    rh->size,				/* maxsegsize */
 	    0,					/* flags */
 	    NULL, NULL,				/* lockfunc, lockfuncarg */
-	    &sc->alx_tx_tag);
+	    &rh->tag);
 	if (error != 0) {
-		device_printf(dev, "could not create TX descriptor ring tag\n");
+		device_printf(dev, "could not create descriptor ring tag\n");
 		return (error);
 	}
 
-	/* Allocate DMA memory for the transmit packet descriptor ring. */
-	error = bus_dmamem_alloc(sc->alx_tx_tag,
-	    (void **)&sc->alx_tx_queue.tpd_hdr,
-	    BUS_DMA_WAITOK | BUS_DMA_ZERO | BUS_DMA_COHERENT,
-	    &sc->alx_tx_dmamap);
+	/* Allocate DMA memory for the descriptor rings. */
+	error = bus_dmamem_alloc(rh->tag, &rh->desc,
+	    BUS_DMA_WAITOK | BUS_DMA_ZERO | BUS_DMA_COHERENT, &rh->map);
 	if (error != 0) {
 		device_printf(dev,
-		    "could not allocate DMA'able memory for TX ring\n");
-		/* XXX cleanup */
+		    "could not allocate DMA'able memory for the rings\n");
 		return (error);
 	}
 
-	/* Do the actual DMA mapping of the transmit packet descriptor ring. */
-	error = bus_dmamap_load(sc->alx_tx_tag, sc->alx_tx_dmamap,
-	    sc->alx_tx_queue.tpd_hdr, sc->tx_ringsz * sizeof(struct tpd_desc),
-	    alx_dmamap_cb, &sc->alx_tx_queue.tpd_dma, 0);
-	if (error != 0) {
-		device_printf(dev, "could not load DMA map for TX ring\n");
-		/* XXX cleanup */
-		return (error);
+	/* Do the actual DMA mapping of the descriptor rings. */
+	error = bus_dmamap_load(rh->tag, rh->map, rh->desc, rh->size,
+	    alx_dmamap_cb, &rh->dma, 0);
+	if (error != 0 || rh->dma == 0) {
+		device_printf(dev, "could not load DMA map for descriptor "
+		    "rings\n");
+		return (error != 0 ? error : ENOMEM);
 	}
 
-	/* Create the DMA tag for the receive ready descriptor ring. */
-	/* XXX assuming 1 queue at the moment. */
-	error = bus_dma_tag_create(
-	    sc->alx_parent_tag,			/* parent */
-	    8, 0,				/* alignment, boundary */
-	    BUS_SPACE_MAXADDR,			/* lowaddr */
-	    BUS_SPACE_MAXADDR,			/* highaddr */
-	    NULL, NULL,				/* filter, filterarg */
-	    sc->rx_ringsz * sizeof(struct rrd_desc), /* maxsize */
-	    1,					/* nsegments */
-	    sc->rx_ringsz * sizeof(struct rrd_desc), /* maxsegsize */
-	    0,					/* flags */
-	    NULL, NULL,				/* lockfunc, lockfuncarg */
-	    &sc->alx_rr_tag);
-	if (error != 0) {
-		device_printf(dev, "could not create RX descriptor ring tag\n");
-		return (error);
+	for (q = 0; q < sc->nr_txq; q++) {
+		/* Allocate space for the TX buffer ring. */
+		r->tx_bf[q] = malloc(
+		    r->tx_ringsz * sizeof(struct alx_buffer), M_DEVBUF,
+		    M_NOWAIT | M_ZERO);
+		if (r->tx_bf[q] == NULL) {
+			device_printf(dev,
+			    "could not allocate memory for TX buffer ring\n");
+			return (ENOMEM);
+		}
+
+		/* Create DMA maps for the TX buffers. */
+		buf = r->tx_bf[q];
+		for (i = 0; i < r->tx_ringsz; i++, buf++) {
+			error = bus_dmamap_create(sc->alx_tx_buf_tag, 0,
+			    &buf->dmamap);
+			if (error != 0) {
+				device_printf(dev,
+				    "could not create TX DMA map\n");
+				return (error);
+			}
+		}
 	}
 
-	error = bus_dmamem_alloc(sc->alx_rr_tag,
-	    (void **)&sc->alx_rx_queue.rrd_hdr,
-	    BUS_DMA_WAITOK | BUS_DMA_ZERO | BUS_DMA_COHERENT,
-	    &sc->alx_rr_dmamap);
-	if (error != 0) {
-		device_printf(dev,
-		    "could not allocate DMA'able memory for RX ring\n");
-		/* XXX cleanup */
-		return (error);
+	for (q = 0; q < sc->nr_hwrxq; q++) {
+		/* Allocate space for the RX buffer ring. */
+		r->rx_bf[q] = malloc(
+		    r->rx_ringsz * sizeof(struct alx_buffer), M_DEVBUF,
+		    M_NOWAIT | M_ZERO);
+		if (r->rx_bf[q] == NULL) {
+			device_printf(dev,
+			    "could not allocate memory for RX buffer ring\n");
+			return (ENOMEM);
+		}
+
+		/* Create DMA maps for the RX buffers. */
+		buf = r->rx_bf[q];
+		for (i = 0; i < r->rx_ringsz; i++, buf++) {
+			error = bus_dmamap_create(sc->alx_rx_buf_tag, 0,
+			    &buf->dmamap);
+			if (error != 0) {
+				device_printf(dev,
+				    "could not create RX DMA map\n");
+				return (error);
+			}
+		}
 	}
 
-	error = bus_dmamap_load(sc->alx_rr_tag, sc->alx_rr_dmamap,
-	    sc->alx_rx_queue.rrd_hdr, sc->rx_ringsz * sizeof(struct rrd_desc),
-	    alx_dmamap_cb, &sc->alx_rx_queue.rrd_dma, 0);
-	if (error != 0) {
-		device_printf(dev,
-		    "could not load DMA map for RX ready ring\n");
-		/* XXX cleanup */
-		return (error);
+	return (0);
+}
+
+/*
+ * Undo alx_rings_alloc(), which may have given up half way. No buffers may be
+ * loaded.
+ */
+static void
+alx_rings_free(struct alx_softc *sc, struct alx_rings *r)
+{
+	struct alx_ring_header *rh;
+	struct alx_buffer *buf;
+	int i, q;
+
+	for (q = 0; q < ALX_MAX_TX_QUEUES; q++) {
+		if (r->tx_bf[q] == NULL)
+			continue;
+		buf = r->tx_bf[q];
+		for (i = 0; i < r->tx_ringsz; i++, buf++) {
+			if (buf->dmamap != NULL)
+				bus_dmamap_destroy(sc->alx_tx_buf_tag,
+				    buf->dmamap);
+		}
+		free(r->tx_bf[q], M_DEVBUF);
+		r->tx_bf[q] = NULL;
+	}
+
+	for (q = 0; q < ALX_MAX_RX_QUEUES; q++) {
+		if (r->rx_bf[q] == NULL)
+			continue;
+		buf = r->rx_bf[q];
+		for (i = 0; i < r->rx_ringsz; i++, buf++) {
+			if (buf->dmamap != NULL)
+				bus_dmamap_destroy(sc->alx_rx_buf_tag,
+				    buf->dmamap);
+		}
+		free(r->rx_bf[q], M_DEVBUF);
+		r->rx_bf[q] = NULL;
+	}
+
+	rh = &r->rh;
+	if (rh->dma != 0) {
+		bus_dmamap_unload(rh->tag, rh->map);
+		rh->dma = 0;
+	}
+	if (rh->desc != NULL) {
+		bus_dmamem_free(rh->tag, rh->desc, rh->map);
+		rh->desc = NULL;
+	}
+	if (rh->tag != NULL) {
+		bus_dma_tag_destroy(rh->tag);
+		rh->tag = NULL;
+	}
+}
+
+/*
+ * Exchange the rings in use with those in r and carve out each queue's share
+ * of the new arena. The interface must be stopped and the caller holds every
+ * queue lock, or is attaching or detaching.
+ */
+static void
+alx_rings_swap(struct alx_softc *sc, struct alx_rings *r)
+{
+	struct alx_rings old;
+	struct alx_rx_queue *rxq;
+	struct alx_tx_queue *txq;
+	bus_size_t off, tpd_sz, rfd_sz, rrd_sz;
+	int q;
+
+	old.rh = sc->ring_header;
+	old.tx_ringsz = sc->tx_ringsz;
+	old.rx_ringsz = sc->rx_ringsz;
+	for (q = 0; q < ALX_MAX_TX_QUEUES; q++)
+		old.tx_bf[q] = sc->alx_tx_queue[q].bf_info;
+	for (q = 0; q < ALX_MAX_RX_QUEUES; q++)
+		old.rx_bf[q] = sc->alx_rx_queue[q].bf_info;
+
+	sc->ring_header = r->rh;
+	sc->tx_ringsz = r->tx_ringsz;
+	sc->rx_ringsz = r->rx_ringsz;
+
+	tpd_sz = roundup2(sc->tx_ringsz * sizeof(struct tpd_desc),
+	    ALX_RING_ALIGN);
+	rfd_sz = roundup2(sc->rx_ringsz * sizeof(struct rfd_desc),
+	    ALX_RING_ALIGN);
+	rrd_sz = roundup2(sc->rx_ringsz * sizeof(struct rrd_desc),
+	    ALX_RING_ALIGN);
+	off = 0;
+	for (q = 0; q < ALX_MAX_TX_QUEUES; q++) {
+		txq = &sc->alx_tx_queue[q];
+		txq->bf_info = r->tx_bf[q];
+		if (sc->ring_header.desc == NULL || q >= sc->nr_txq) {
+			txq->tpd_hdr = NULL;
+			txq->tpd_dma = 0;
+			continue;
+		}
+		txq->tpd_hdr = (struct tpd_desc *)
+		    ((char *)sc->ring_header.desc + off);
+		txq->tpd_dma = sc->ring_header.dma + off;
+		off += tpd_sz;
+		/* Nothing of the old ring carries over. */
+		txq->pidx = 0;
+		txq->cidx = 0;
+		txq->count = sc->tx_ringsz;
+		txq->avail = sc->tx_ringsz - 1;
+		txq->pending = 0;
+		txq->watchdog = 0;
+		txq->bounce_next = 0;
+		txq->bounce_used = 0;
 	}
+	for (q = 0; q < ALX_MAX_RX_QUEUES; q++) {
+		rxq = &sc->alx_rx_queue[q];
+		rxq->bf_info = r->rx_bf[q];
+		if (sc->ring_header.desc == NULL || q >= sc->nr_hwrxq) {
+			rxq->rfd_hdr = NULL;
+			rxq->rfd_dma = 0;
+			rxq->rrd_hdr = NULL;
+			rxq->rrd_dma = 0;
+			continue;
+		}
+		rxq->rfd_hdr = (struct rfd_desc *)
+		    ((char *)sc->ring_header.desc + off);
+		rxq->rfd_dma = sc->ring_header.dma + off;
+		off += rfd_sz;
+		rxq->rrd_hdr = (struct rrd_desc *)
+		    ((char *)sc->ring_header.desc + off);
+		rxq->rrd_dma = sc->ring_header.dma + off;
+		off += rrd_sz;
+		rxq->pidx = 0;
+		rxq->cidx = 0;
+		rxq->rrd_cidx = 0;
+		rxq->count = sc->rx_ringsz;
+	}
+
+	*r = old;
+}
+
+static int
+alx_dma_alloc(struct alx_softc *sc)
+{
+	device_t dev;
+	struct alx_rings r;
+	struct alx_rx_queue *rxq;
+	struct alx_tx_queue *txq;
+	int error, q;
+
+	dev = sc->alx_dev;
 
-	/* Create the DMA tag for the receive free descriptor ring. */
-	/* XXX assuming 1 queue at the moment. */
+	/* Create parent tag. */
 	error = bus_dma_tag_create(
-	    sc->alx_parent_tag,			/* parent */
-	    8, 0,				/* alignment, boundary */
+	    bus_get_dma_tag(sc->alx_dev),	/* parent */
+	    1, 0,				/* alignment, boundary */
 	    BUS_SPACE_MAXADDR,			/* lowaddr */
 	    BUS_SPACE_MAXADDR,			/* highaddr */
 	    NULL, NULL,				/* filter, filterarg */
-	    sc->rx_ringsz * sizeof(struct rfd_desc), /* maxsize */
+	    BUS_SPACE_MAXSIZE_32BIT,		/* maxsize */
 	    1,					/* nsegments */
-	    sc->rx_ringsz * sizeof(struct rfd_desc), /* maxsegsize */
+	    BUS_SPACE_MAXSIZE_32BIT,		/* maxsegsize */
 	    0,					/* flags */
 	    NULL, NULL,				/* lockfunc, lockfuncarg */
-	    &sc->alx_rx_tag);
-	if (error != 0) {
-		device_printf(dev,
-		    "could not create RX descriptor ring DMA tag\n");
-		/* XXX cleanup */
-		return (error);
-	}
-
-	error = bus_dmamem_alloc(sc->alx_rx_tag,
-	    (void **)&sc->alx_rx_queue.rfd_hdr,
-	    BUS_DMA_WAITOK | BUS_DMA_ZERO | BUS_DMA_COHERENT,
-	    &sc->alx_rx_dmamap);
-	if (error != 0) {
-		device_printf(dev,
-		    "could not allocate DMA'able memory for RX ring\n");
-		/* XXX cleanup */
-		return (error);
-	}
-
-	error = bus_dmamap_load(sc->alx_rx_tag, sc->alx_rx_dmamap,
-	    sc->alx_rx_queue.rfd_hdr, sc->rx_ringsz * sizeof(struct rfd_desc),
-	    alx_dmamap_cb, &sc->alx_rx_queue.rfd_dma, 0);
+	    &sc->alx_parent_tag);
 	if (error != 0) {
-		device_printf(dev, "could not load DMA map for RX free ring\n");
-		/* XXX cleanup */
+		device_printf(dev, "could not create parent DMA tag\n");
 		return (error);
 	}
 
-	/* Create the DMA tag for the transmit buffers. */
-	/* XXX where do maxsize, nsegments, maxsegsize come from? */
+	/* Create the DMA tag for the transmit buffers, big enough for TSO. */
 	error = bus_dma_tag_create(
 	    sc->alx_parent_tag,			/* parent */
-	    8, 0,				/* alignment, boundary */
+	    1, 0,				/* alignment, boundary */
 	    BUS_SPACE_MAXADDR,			/* lowaddr */
 	    BUS_SPACE_MAXADDR,			/* highaddr */
 	    NULL, NULL,				/* filter, filterarg */
-	    PAGE_SIZE,				/* maxsize XXX */
-	    32,					/* nsegments XXX */
-	    PAGE_SIZE,				/* maxsegsize */
+	    ALX_TSO_MAXSIZE,			/* maxsize */
+	    ALX_MAXTXSEGS,			/* nsegments */
+	    ALX_TSO_MAXSEGSIZE,			/* maxsegsize */
 	    0,					/* flags */
 	    NULL, NULL,				/* lockfunc, lockarg */
 	    &sc->alx_tx_buf_tag);
 	if (error != 0) {
 		device_printf(dev, "could not create TX buffer DMA tag\n");
-		/* XXX cleanup */
 		return (error);
 	}
 
-	/* Allocate space for the TX buffer ring. */
-	sc->alx_tx_queue.bf_info = malloc(
-	    sc->tx_ringsz * sizeof(struct alx_buffer), M_DEVBUF,
-	    M_NOWAIT | M_ZERO);
-	if (sc->alx_tx_queue.bf_info == NULL) {
-		device_printf(dev,
-		    "could not allocate memory for TX buffer ring\n");
-		/* XXX cleanup */
+	/* Create the DMA tag for the TX bounce pools, one block per queue. */
+	error = bus_dma_tag_create(
+	    sc->alx_parent_tag,			/* parent */
+	    ALX_RING_ALIGN, 0,			/* alignment, boundary */
+	    BUS_SPACE_MAXADDR,			/* lowaddr */
+	    BUS_SPACE_MAXADDR,			/* highaddr */
+	    NULL, NULL,				/* filter, filterarg */
+	    ALX_TX_BOUNCE_SLOTS * ALX_TX_BOUNCE_SIZE, /* maxsize */
+	    1,					/* nsegments */
+	    ALX_TX_BOUNCE_SLOTS * ALX_TX_BOUNCE_SIZE, /* maxsegsize */
+	    0,					/* flags */
+	    NULL, NULL,				/* lockfunc, lockarg */
+	    &sc->alx_tx_bounce_tag);
+	if (error != 0) {
+		device_printf(dev, "could not create TX bounce DMA tag\n");
 		return (error);
 	}
 
-	/* Create DMA maps for the TX buffers. */
-	buf = sc->alx_tx_queue.bf_info;
-	for (i = 0; i < sc->tx_ringsz; i++, buf++) {
-		error = bus_dmamap_create(sc->alx_tx_buf_tag, 0, &buf->dmamap);
+	for (q = 0; q < sc->nr_txq; q++) {
+		txq = &sc->alx_tx_queue[q];
+
+		/* The bounce pool stays loaded for the life of the queue. */
+		error = bus_dmamem_alloc(sc->alx_tx_bounce_tag,
+		    (void **)&txq->bounce, BUS_DMA_WAITOK | BUS_DMA_COHERENT,
+		    &txq->bounce_map);
 		if (error != 0) {
-			device_printf(dev, "could not create TX DMA map\n");
-			/* XXX cleanup */
+			device_printf(dev,
+			    "could not allocate TX bounce buffers\n");
 			return (error);
 		}
+		error = bus_dmamap_load(sc->alx_tx_bounce_tag, txq->bounce_map,
+		    txq->bounce, ALX_TX_BOUNCE_SLOTS * ALX_TX_BOUNCE_SIZE,
+		    alx_dmamap_cb, &txq->bounce_dma, 0);
+		if (error != 0 || txq->bounce_dma == 0) {
+			device_printf(dev,
+			    "could not load DMA map for TX bounce buffers\n");
+			return (error != 0 ? error : ENOMEM);
+		}
+
+		txq->br = buf_ring_alloc(ALX_TX_BUFRING_SIZE, M_DEVBUF,
+		    M_WAITOK, &txq->tx_mtx);
 	}
 
 	/* Create the DMA tag for the receive buffers. */
@@ -364,143 +638,165 @@ alx_dma_alloc(struct alx_softc *sc)
 	    BUS_SPACE_MAXADDR,			/* lowaddr */
 	    BUS_SPACE_MAXADDR,			/* highaddr */
 	    NULL, NULL,				/* filter, filterarg */
-	    MCLBYTES,				/* maxsize */
+	    MJUM9BYTES,				/* maxsize */
 	    1,					/* nsegments */
-	    MCLBYTES,				/* maxsegsize */
+	    MJUM9BYTES,				/* maxsegsize */
 	    0,					/* flags */
 	    NULL, NULL,				/* lockfunc, lockarg */
 	    &sc->alx_rx_buf_tag);
 	if (error != 0) {
 		device_printf(dev, "could not create RX buffer DMA tag\n");
-		/* XXX cleanup */
 		return (error);
 	}
 
-	/* Allocate space for the RX buffer ring. */
-	sc->alx_rx_queue.bf_info = malloc(
-	    sc->rx_ringsz * sizeof(struct alx_buffer), M_DEVBUF,
-	    M_NOWAIT | M_ZERO);
-	if (sc->alx_rx_queue.bf_info == NULL) {
-		device_printf(dev,
-		    "could not allocate memory for RX buffer ring\n");
-		/* XXX cleanup */
-		return (error);
-	}
-
-	/* Create DMA maps for the RX buffers. */
-	buf = sc->alx_rx_queue.bf_info;
-	for (i = 0; i < sc->rx_ringsz; i++, buf++) {
-		error = bus_dmamap_create(sc->alx_rx_buf_tag, 0, &buf->dmamap);
+	for (q = 0; q < sc->nr_hwrxq; q++) {
+		rxq = &sc->alx_rx_queue[q];
+		error = bus_dmamap_create(sc->alx_rx_buf_tag, 0,
+		    &rxq->spare_map);
 		if (error != 0) {
-			device_printf(dev, "could not create RX DMA map\n");
-			/* XXX cleanup */
+			device_printf(dev,
+			    "could not create spare RX DMA map\n");
 			return (error);
 		}
 	}
 
-	return (error);
+	bzero(&r, sizeof(r));
+	r.tx_ringsz = sc->tx_ringsz;
+	r.rx_ringsz = sc->rx_ringsz;
+	error = alx_rings_alloc(sc, &r);
+	if (error != 0) {
+		alx_rings_free(sc, &r);
+		return (error);
+	}
+	alx_rings_swap(sc, &r);
+
+	return (0);
 }
 
-#if 0
-static void __unused
+/*
+ * Undo alx_dma_alloc(), which may have given up half way. The interface must
+ * be stopped, so no buffers are loaded.
+ */
+static void
 alx_dma_free(struct alx_softc *sc)
 {
+	struct alx_rings r;
+	struct alx_rx_queue *rxq;
+	struct alx_tx_queue *txq;
+	int q;
+
+	bzero(&r, sizeof(r));
+	r.tx_ringsz = sc->tx_ringsz;
+	r.rx_ringsz = sc->rx_ringsz;
+	alx_rings_swap(sc, &r);
+	alx_rings_free(sc, &r);
+
+	for (q = 0; q < ALX_MAX_TX_QUEUES; q++) {
+		txq = &sc->alx_tx_queue[q];
+		if (txq->br != NULL) {
+			buf_ring_free(txq->br, M_DEVBUF);
+			txq->br = NULL;
+		}
+		if (txq->bounce_dma != 0) {
+			bus_dmamap_unload(sc->alx_tx_bounce_tag,
+			    txq->bounce_map);
+			txq->bounce_dma = 0;
+		}
+		if (txq->bounce != NULL) {
+			bus_dmamem_free(sc->alx_tx_bounce_tag, txq->bounce,
+			    txq->bounce_map);
+			txq->bounce = NULL;
+		}
+	}
+	if (sc->alx_tx_buf_tag != NULL) {
+		bus_dma_tag_destroy(sc->alx_tx_buf_tag);
+		sc->alx_tx_buf_tag = NULL;
+	}
+	if (sc->alx_tx_bounce_tag != NULL) {
+		bus_dma_tag_destroy(sc->alx_tx_bounce_tag);
+		sc->alx_tx_bounce_tag = NULL;
+	}
+
+	for (q = 0; q < ALX_MAX_RX_QUEUES; q++) {
+		rxq = &sc->alx_rx_queue[q];
+		if (rxq->spare_map != NULL) {
+			bus_dmamap_destroy(sc->alx_rx_buf_tag, rxq->spare_map);
+			rxq->spare_map = NULL;
+		}
+	}
+	if (sc->alx_rx_buf_tag != NULL) {
+		bus_dma_tag_destroy(sc->alx_rx_buf_tag);
+		sc->alx_rx_buf_tag = NULL;
+	}
+
+	if (sc->alx_parent_tag != NULL) {
+		bus_dma_tag_destroy(sc->alx_parent_tag);
+		sc->alx_parent_tag = NULL;
+	}
+}
+
+/*
+ * Write hw->imask to IMR, leaving the queue bits masked while alx_int_task()
+ * owns them.
+ */
+static void
+alx_imr_write(struct alx_softc *sc)
+{
+	uint32_t imask;
+
+	mtx_assert(&sc->alx_imr_mtx, MA_OWNED);
 
+	imask = sc->hw.imask;
+	if (sc->alx_int_masked)
+		imask &= ~ALX_ISR_ALL_QUEUES;
+	ALX_MEM_W32(&sc->hw, ALX_IMR, imask);
 }
-#endif
 
 static void
 alx_intr_enable(struct alx_softc *sc)
 {
 	struct alx_hw *hw;
+	int i;
 
 	hw = &sc->hw;
 
+#ifdef DEVICE_POLLING
+	/* The poll handler does the work while polling is on. */
+	if (sc->alx_ifp->if_capenable & IFCAP_POLLING)
+		return;
+#endif
+
 	/* level-1 interrupt switch */
+	ALX_IMR_LOCK(sc);
+	sc->alx_int_masked = false;
 	ALX_MEM_W32(hw, ALX_ISR, 0);
-	ALX_MEM_W32(hw, ALX_IMR, hw->imask);
+	alx_imr_write(sc);
 	ALX_MEM_FLUSH(hw);
+	ALX_IMR_UNLOCK(sc);
 
-#ifdef __notyet
-	int i;
 	/* enable all individual MSIX IRQs */
 	if (ALX_FLAG(sc, USING_MSIX))
-		for (i = 0; i < adpt->nr_vec; i++)
+		for (i = 0; i < sc->nr_vec; i++)
 			alx_mask_msix(hw, i, false);
-#endif
 }
 
 static void
 alx_intr_disable(struct alx_softc *sc)
 {
 	struct alx_hw *hw = &sc->hw;
+	int i;
 
+	ALX_IMR_LOCK(sc);
 	ALX_MEM_W32(hw, ALX_ISR, ALX_ISR_DIS);
 	ALX_MEM_W32(hw, ALX_IMR, 0);
 	ALX_MEM_FLUSH(hw);
+	ALX_IMR_UNLOCK(sc);
 
-#ifdef __notyet
-	int i;
 	if (ALX_FLAG(sc, USING_MSIX))
 		for (i = 0; i < sc->nr_vec; i++)
 			alx_mask_msix(hw, i, true);
-#endif
-}
-
-static int
-alx_identify_hw(struct alx_softc *sc)
-{
-	device_t dev = sc->alx_dev;
-	struct alx_hw *hw = &sc->hw;
-	int rev;
-
-	hw->device_id = pci_get_device(dev);
-	hw->subdev_id = pci_get_subdevice(dev);
-	hw->subven_id = pci_get_subvendor(dev);
-	hw->revision = pci_get_revid(dev);
-	rev = ALX_REVID(hw);
-
-	switch (ALX_DID(hw)) {
-	case ALX_DEV_ID_AR8161:
-	case ALX_DEV_ID_AR8162:
-	case ALX_DEV_ID_AR8171:
-	case ALX_DEV_ID_AR8172:
-	case ALX_DEV_ID_KI2201:
-		if (rev > ALX_REV_C0)
-			break;
-		ALX_CAP_SET(hw, L0S);
-		ALX_CAP_SET(hw, L1);
-		ALX_CAP_SET(hw, MTQ);
-		ALX_CAP_SET(hw, RSS);
-		ALX_CAP_SET(hw, MSIX);
-		ALX_CAP_SET(hw, SWOI);
-		hw->max_dma_chnl = rev >= ALX_REV_B0 ? 4 : 2;
-		if (rev < ALX_REV_C0) {
-			hw->ptrn_ofs = 0x600;
-			hw->max_ptrns = 8;
-		} else {
-			hw->ptrn_ofs = 0x14000;
-			hw->max_ptrns = 16;
-		}
-		break;
-	default:
-		return (EINVAL);
-	}
-
-	if (ALX_DID(hw) & 1)
-		ALX_CAP_SET(hw, GIGA);
-
-	return (0);
 }
 
-static const u8 def_rss_key[40] = {
-	0xE2, 0x91, 0xD7, 0x3D, 0x18, 0x05, 0xEC, 0x6C,
-	0x2A, 0x94, 0xB3, 0x0D, 0xA5, 0x4F, 0x2B, 0xEC,
-	0xEA, 0x49, 0xAF, 0x7C, 0xE2, 0x14, 0xAD, 0x3D,
-	0xB8, 0x55, 0xAA, 0xBE, 0x6A, 0x3E, 0x67, 0xEA,
-	0x14, 0x36, 0x4D, 0x17, 0x3B, 0xED, 0x20, 0x0D,
-};
-
 /* alx_init_adapter -
  *    initialize general software structure (struct alx_adapter).
  *    fields are inited based on PCI device information.
@@ -510,44 +806,40 @@ alx_init_sw(struct alx_softc *sc)
 {
 	device_t dev = sc->alx_dev;
 	struct alx_hw *hw = &sc->hw;
-	int i, err;
+	int err;
 
-	err = alx_identify_hw(sc);
+	err = alx_init_hw_sw(hw);
 	if (err) {
 		device_printf(dev, "unrecognized chip, aborting\n");
 		return (err);
 	}
 
-	/* assign patch flag for specific platforms */
-	alx_patch_assign(hw);
-
-	memcpy(hw->rss_key, def_rss_key, sizeof(def_rss_key));
-	hw->rss_idt_size = 128;
-	hw->rss_hash_type = ALX_RSS_HASH_TYPE_ALL;
-	hw->smb_timer = 400;
-	sc->tx_ringsz = 256;
-	sc->rx_ringsz = 512;
-	hw->sleep_ctrl = ALX_SLEEP_WOL_MAGIC | ALX_SLEEP_WOL_PHY;
-	hw->imt = 200;
-	hw->imask = ALX_ISR_MISC;
-	hw->dma_chnl = hw->max_dma_chnl;
+	sc->tx_ringsz = alx_tx_ring_size;
+	if (sc->tx_ringsz < ALX_RING_MIN || sc->tx_ringsz > ALX_TX_RING_MAX) {
+		device_printf(dev, "invalid TX ring size %d, using %d\n",
+		    sc->tx_ringsz, ALX_TX_RING_DEF);
+		sc->tx_ringsz = ALX_TX_RING_DEF;
+	}
+	sc->rx_ringsz = alx_rx_ring_size;
+	if (sc->rx_ringsz < ALX_RING_MIN || sc->rx_ringsz > ALX_RX_RING_MAX) {
+		device_printf(dev, "invalid RX ring size %d, using %d\n",
+		    sc->rx_ringsz, ALX_RX_RING_DEF);
+		sc->rx_ringsz = ALX_RX_RING_DEF;
+	}
+	sc->alx_rx_process_limit = ALX_DEFAULT_RX_WORK;
+	sc->alx_tx_process_limit = ALX_DEFAULT_TX_WORK;
+	sc->alx_tx_doorbell_thresh = ALX_DEFAULT_TX_DOORBELL;
+	sc->alx_imod_profile = ALX_IMOD_ADAPTIVE;
+	sc->alx_rx_copybreak = min(alx_rx_copybreak, ALX_RX_COPYBREAK_MAX);
+	sc->alx_tx_bounce = min(alx_tx_bounce_thresh, ALX_TX_BOUNCE_SIZE);
+	sc->alx_imod_fixed = ALX_IMT_BULK;
+	sc->alx_pm_profile = ALX_PM_POWERSAVE;
+	sc->alx_bench.frames = ALX_BENCH_FRAMES_DEF;
+	strlcpy(sc->alx_bench.sizes, ALX_BENCH_SIZES_DEF,
+	    sizeof(sc->alx_bench.sizes));
+	sc->alx_bench.txq = -1;
+	hw->imt = ALX_IMT_BULK;
 	hw->ith_tpd = sc->tx_ringsz / 3;
-	hw->link_up = false;
-	hw->link_duplex = 0;
-	hw->link_speed = 0;
-	hw->adv_cfg = ADVERTISED_Autoneg | ADVERTISED_10baseT_Half |
-	    ADVERTISED_10baseT_Full | ADVERTISED_100baseT_Full |
-	    ADVERTISED_100baseT_Half | ADVERTISED_1000baseT_Full;
-	hw->flowctrl = ALX_FC_ANEG | ALX_FC_RX | ALX_FC_TX;
-	hw->wrr_ctrl = ALX_WRR_PRI_RESTRICT_NONE;
-	for (i = 0; i < ARRAY_SIZE(hw->wrr); i++)
-		hw->wrr[i] = 4;
-
-	hw->rx_ctrl = ALX_MAC_CTRL_WOLSPED_SWEN | ALX_MAC_CTRL_MHASH_ALG_HI5B |
-	    ALX_MAC_CTRL_BRD_EN | ALX_MAC_CTRL_PCRCE | ALX_MAC_CTRL_CRCE |
-	    ALX_MAC_CTRL_RXFC_EN | ALX_MAC_CTRL_TXFC_EN |
-	    FIELDX(ALX_MAC_CTRL_PRMBLEN, 7);
-	hw->is_fpga = false;
 
 	sc->irq_sem = 0;
 
@@ -558,139 +850,405 @@ static void
 alx_init_rx_ring(struct alx_softc *sc)
 {
 	struct alx_hw *hw;
-	int i, error;
+	struct alx_rx_queue *rxq;
+	int i;
 
 	ALX_LOCK_ASSERT(sc);
 
 	hw = &sc->hw;
 
-	sc->alx_rx_queue.pidx = 0;
-	sc->alx_rx_queue.p_reg = ALX_RFD_PIDX;
-	sc->alx_rx_queue.cidx = 0;
-	sc->alx_rx_queue.rrd_cidx = 0;
-	sc->alx_rx_queue.c_reg = ALX_RFD_CIDX;
-	sc->alx_rx_queue.qidx = 0;
-	sc->alx_rx_queue.count = sc->rx_ringsz;
+	for (i = 0; i < sc->nr_rxq; i++) {
+		rxq = &sc->alx_rx_queue[i];
+		ALX_RX_LOCK(rxq);
+		rxq->pidx = 0;
+		rxq->cidx = 0;
+		rxq->rrd_cidx = 0;
+		rxq->qidx = i;
+		rxq->count = sc->rx_ringsz;
+		rxq->flag = i < sc->nr_hwrxq ? ALX_RQ_USING : 0;
+		ALX_RX_UNLOCK(rxq);
+		hw->imask |= alx_rxq_isr[i];
+	}
 
-	hw->imask |= ALX_ISR_RX_Q0;
+	rxq = &sc->alx_rx_queue[0];
+	ALX_RX_LOCK(rxq);
+	rxq->p_reg = ALX_RFD_PIDX;
+	rxq->c_reg = ALX_RFD_CIDX;
 
-	/* XXX the rings are all supposed to come from the same 4GB block. */
-	ALX_MEM_W32(hw, ALX_RX_BASE_ADDR_HI, sc->alx_rx_queue.rfd_dma >> 32);
-	ALX_MEM_W32(hw, ALX_RRD_ADDR_LO, sc->alx_rx_queue.rrd_dma);
-	ALX_MEM_W32(hw, ALX_RFD_ADDR_LO, sc->alx_rx_queue.rfd_dma);
+	/* alx_dma_alloc() keeps all of the rings in one 4GB block. */
+	ALX_MEM_W32(hw, ALX_RX_BASE_ADDR_HI, rxq->rfd_dma >> 32);
+	ALX_MEM_W32(hw, ALX_RRD_ADDR_LO, rxq->rrd_dma);
+	ALX_MEM_W32(hw, ALX_RFD_ADDR_LO, rxq->rfd_dma);
 	ALX_MEM_W32(hw, ALX_RRD_RING_SZ, sc->rx_ringsz);
 	ALX_MEM_W32(hw, ALX_RFD_RING_SZ, sc->rx_ringsz);
 	ALX_MEM_W32(hw, ALX_RFD_BUF_SZ, sc->rxbuf_size);
 
-	/* XXX multiple queues. */
-	for (i = 0; i < sc->rx_ringsz; i++) {
-		error = alx_newbuf(sc, i);
-		if (error != 0) {
-			/* XXX this needs to be handled better. */
-			device_printf(sc->alx_dev, "failed to refresh mbufs\n");
-			break;
-		}
+#ifdef DEV_NETMAP
+	if (alx_netmap_init_rx(sc, rxq)) {
+		ALX_RX_UNLOCK(rxq);
+		return;
 	}
-
-	ALX_MEM_W16(hw, ALX_RFD_PIDX, sc->rx_ringsz - 1);
-
-	bus_dmamap_sync(sc->alx_rx_tag, sc->alx_rx_dmamap,
-	    BUS_DMASYNC_PREWRITE);
+#endif
+	if (alx_rx_refill(sc, rxq) != sc->rx_ringsz - 1)
+		/* XXX this needs to be handled better. */
+		device_printf(sc->alx_dev, "failed to refresh mbufs\n");
+	ALX_RX_UNLOCK(rxq);
 }
 
 static void
 alx_init_tx_ring(struct alx_softc *sc)
 {
 	struct alx_hw *hw;
+	struct alx_tx_queue *txq;
 	struct alx_buffer *tx_buf;
-	int i;
+	int i, q;
 
 	ALX_LOCK_ASSERT(sc);
 
 	hw = &sc->hw;
 
-	sc->alx_tx_queue.pidx = 0;
-	sc->alx_tx_queue.p_reg = ALX_TPD_PRI0_PIDX;
-	sc->alx_tx_queue.cidx = 0;
-	sc->alx_tx_queue.c_reg = ALX_TPD_PRI0_CIDX;
-	sc->alx_tx_queue.qidx = 0;
-	sc->alx_tx_queue.count = sc->tx_ringsz;
+	for (q = 0; q < sc->nr_txq; q++) {
+		txq = &sc->alx_tx_queue[q];
+
+		ALX_TX_LOCK(txq);
+		txq->pidx = 0;
+		txq->p_reg = alx_txq_regs[q].pidx;
+		txq->cidx = 0;
+		txq->c_reg = alx_txq_regs[q].cidx;
+		txq->qidx = q;
+		txq->count = sc->tx_ringsz;
+		/* Keep a slot free so that a full ring isn't mistaken for empty. */
+		txq->avail = sc->tx_ringsz - 1;
+		txq->pending = 0;
+		txq->oactive = false;
+		txq->watchdog = 0;
+		txq->bounce_next = 0;
+		txq->bounce_used = 0;
+#ifdef DEV_NETMAP
+		alx_netmap_init_tx(sc, txq);
+#endif
 
-	hw->imask |= ALX_ISR_TX_Q0;
+		hw->imask |= alx_txq_isr[q];
 
-	for (i = 0; i < sc->tx_ringsz; i++) {
-		tx_buf = &sc->alx_tx_queue.bf_info[i];
-		tx_buf->m = NULL;
+		for (i = 0; i < sc->tx_ringsz; i++) {
+			tx_buf = &txq->bf_info[i];
+			tx_buf->m = NULL;
+			tx_buf->flags = 0;
+		}
+
+		ALX_MEM_W32(hw, alx_txq_regs[q].addr_lo, txq->tpd_dma);
+		ALX_TX_UNLOCK(txq);
 	}
 
-	/* XXX multiple queues */
-	ALX_MEM_W32(hw, ALX_TX_BASE_ADDR_HI, sc->alx_tx_queue.tpd_dma >> 32);
-	ALX_MEM_W32(hw, ALX_TPD_PRI0_ADDR_LO, sc->alx_tx_queue.tpd_dma);
+	/* The rings are carved out of one allocation, so they share ADDR_HI. */
+	ALX_MEM_W32(hw, ALX_TX_BASE_ADDR_HI,
+	    sc->alx_tx_queue[0].tpd_dma >> 32);
 	ALX_MEM_W32(hw, ALX_TPD_RING_SZ, sc->tx_ringsz);
 }
 
-static void
-alx_rxintr(struct alx_softc *sc)
+/*
+ * Record the hash computed by the MAC and return the index of the queue that
+ * the RSS indirection table selected for the frame.
+ */
+static int
+alx_rx_hash(struct alx_softc *sc, struct rrd_desc *rrd, struct mbuf *m)
 {
-	struct mbuf *m;
-	struct ifnet *ifp;
-	struct alx_buffer *rx_buf;
-	struct rrd_desc *rrd;
-	int rrd_cidx, rfd_cidx, rrd_pidx, count;
+	uint32_t word2;
+	int alg, qidx;
+
+	word2 = le32toh(rrd->word2);
+	qidx = FIELD_GETX(word2, RRD_RSSQ);
+	if (qidx >= sc->nr_rxq)
+		qidx = 0;
+
+	alg = FIELD_GETX(word2, RRD_RSSALG);
+	m->m_pkthdr.flowid = le32toh(rrd->rss_hash);
+	if (alg & RRD_RSSALG_TCPV4)
+		M_HASHTYPE_SET(m, M_HASHTYPE_RSS_TCP_IPV4);
+	else if (alg & RRD_RSSALG_IPV4)
+		M_HASHTYPE_SET(m, M_HASHTYPE_RSS_IPV4);
+	else if (alg & RRD_RSSALG_TCPV6)
+		M_HASHTYPE_SET(m, M_HASHTYPE_RSS_TCP_IPV6);
+	else if (alg & RRD_RSSALG_IPV6)
+		M_HASHTYPE_SET(m, M_HASHTYPE_RSS_IPV6);
+	else {
+		/* The frame wasn't hashed; fall back to the queue index. */
+		m->m_pkthdr.flowid = qidx;
+		M_HASHTYPE_SET(m, M_HASHTYPE_OPAQUE);
+	}
 
-	ALX_LOCK_ASSERT(sc);
+	return (qidx);
+}
 
-	bus_dmamap_sync(sc->alx_rr_tag, sc->alx_rr_dmamap,
-	    BUS_DMASYNC_POSTREAD | BUS_DMASYNC_POSTWRITE);
-	bus_dmamap_sync(sc->alx_rx_tag, sc->alx_rx_dmamap,
-	    BUS_DMASYNC_POSTREAD | BUS_DMASYNC_POSTWRITE);
+/*
+ * Replenish empty RFDs starting at the producer index and hand them to the
+ * chip with a single producer index update. The slot before the consumer
+ * index is always left empty so that a full ring can be told apart from an
+ * empty one.
+ */
+static int
+alx_rx_refill(struct alx_softc *sc, struct alx_rx_queue *rxq)
+{
+	int count, cur, next;
 
-	ifp = sc->alx_ifp;
+	ALX_RX_LOCK_ASSERT(rxq);
 
 	count = 0;
-	rrd_cidx = sc->alx_rx_queue.cidx;
+	cur = rxq->pidx;
+	next = cur + 1 == sc->rx_ringsz ? 0 : cur + 1;
+	while (next != rxq->cidx) {
+		/* Consumed slots normally still hold a buffer. */
+		if (rxq->bf_info[cur].m == NULL) {
 #if 0
-	printf("consuming packets starting at %d\n", rrd_cidx);
+			printf("refreshing mbuf at %d\n", cur);
 #endif
-	while (1) {
-		rrd = &sc->alx_rx_queue.rrd_hdr[rrd_cidx];
-		if ((rrd->word3 & (1 << RRD_UPDATED_SHIFT)) == 0)
-			break;
-		rrd->word3 &= ~(1 << RRD_UPDATED_SHIFT);
+			if (alx_newbuf(sc, rxq, cur) != 0)
+				break;
+		}
+		cur = next;
+		if (++next == sc->rx_ringsz)
+			next = 0;
+		count++;
+	}
 
-		/* Get the index of the corresponding RFD. */
-		rfd_cidx = FIELD_GETX(rrd->word0, RRD_SI);
-		if (rfd_cidx != rrd_cidx ||
-		    FIELD_GETX(rrd->word0, RRD_NOR) != 1) {
-			device_printf(sc->alx_dev,
-			    "RX consumer index mismatch: %d vs. %d, and %d\n",
+	if (count > 0) {
+		bus_dmamap_sync(sc->ring_header.tag, sc->ring_header.map,
+		    BUS_DMASYNC_PREREAD | BUS_DMASYNC_PREWRITE);
+		rxq->pidx = cur;
+		ALX_MEM_W16(&sc->hw, rxq->p_reg, cur);
+	}
+
+	return (count);
+}
+
+/*
+ * Pass a chain of received frames up the stack.
+ */
+static void
+alx_rx_input(struct alx_rx_queue *rxq, struct mbuf *m, bool lro)
+{
+	struct ifnet *ifp;
+	struct mbuf *next;
+	uint64_t bytes, packets;
+
+	ifp = rxq->sc->alx_ifp;
+	bytes = packets = 0;
+	for (; m != NULL; m = next) {
+		next = m->m_nextpkt;
+		m->m_nextpkt = NULL;
+		packets++;
+		bytes += m->m_pkthdr.len;
+		SDT_PROBE2(alx, , , rx__deliver, rxq, m);
+		/* Nothing goes up the stack while the benchmark runs. */
+		if (ALX_FLAG(rxq->sc, TESTING)) {
+			alx_bench_input(rxq->sc, m);
+			continue;
+		}
+		/*
+		 * Only frames whose checksum the hardware verified are worth
+		 * offering to LRO. The queued frames are sorted by flow ID
+		 * when they're flushed.
+		 */
+		if (lro && (m->m_pkthdr.csum_flags &
+		    (CSUM_DATA_VALID | CSUM_PSEUDO_HDR)) ==
+		    (CSUM_DATA_VALID | CSUM_PSEUDO_HDR)) {
+			tcp_lro_queue_mbuf(&rxq->lro, m);
+			continue;
+		}
+		(*ifp->if_input)(ifp, m);
+	}
+	if (lro)
+		tcp_lro_flush_all(&rxq->lro);
+
+	counter_u64_add(rxq->rx_packets, packets);
+	counter_u64_add(rxq->rx_bytes, bytes);
+}
+
+/*
+ * Translate the checksum status reported in an RRD into mbuf flags. The
+ * hardware only verifies the L4 checksum of TCP and UDP frames.
+ */
+static void
+alx_rx_csum(struct rrd_desc *rrd, struct mbuf *m)
+{
+	uint32_t word3;
+
+	word3 = le32toh(rrd->word3);
+	switch (FIELD_GETX(le32toh(rrd->word2), RRD_PID)) {
+	case RRD_PID_IPV4TCP:
+	case RRD_PID_IPV4UDP:
+		m->m_pkthdr.csum_flags |= CSUM_IP_CHECKED;
+		if ((word3 & (1 << RRD_ERR_IPV4_SHIFT)) != 0)
+			break;
+		m->m_pkthdr.csum_flags |= CSUM_IP_VALID;
+		/* FALLTHROUGH */
+	case RRD_PID_IPV6TCP:
+	case RRD_PID_IPV6UDP:
+		if ((word3 & (1 << RRD_ERR_L4_SHIFT)) == 0) {
+			m->m_pkthdr.csum_flags |= CSUM_DATA_VALID |
+			    CSUM_PSEUDO_HDR;
+			m->m_pkthdr.csum_data = 0xffff;
+		}
+		break;
+	case RRD_PID_IPV4:
+		m->m_pkthdr.csum_flags |= CSUM_IP_CHECKED;
+		if ((word3 & (1 << RRD_ERR_IPV4_SHIFT)) == 0)
+			m->m_pkthdr.csum_flags |= CSUM_IP_VALID;
+		break;
+	}
+}
+
+/*
+ * Process up to "limit" received frames and return the number processed. If
+ * the limit was hit there may be more frames waiting in the ring.
+ */
+static int
+alx_rxintr(struct alx_softc *sc, struct alx_rx_queue *rxq, int limit)
+{
+	struct mbuf *m;
+	struct mbuf *swq_head[ALX_MAX_RX_QUEUES], *swq_tail[ALX_MAX_RX_QUEUES];
+	struct ifnet *ifp;
+	struct alx_buffer *rx_buf;
+	struct alx_rx_queue *swq;
+	struct rrd_desc *rrd;
+	struct timespec ts;
+	uint64_t tstmp;
+	uint32_t pending;
+	u_int bytes;
+	int rrd_cidx, rfd_cidx, count, len, qidx;
+
+	ALX_RX_LOCK_ASSERT(rxq);
+
+	ifp = sc->alx_ifp;
+	if ((ifp->if_drv_flags & IFF_DRV_RUNNING) == 0)
+		return (0);
+
+#ifdef DEV_NETMAP
+	if (netmap_rx_irq(ifp, rxq->qidx, &pending))
+		return (0);
+#endif
+
+	bus_dmamap_sync(sc->ring_header.tag, sc->ring_header.map,
+	    BUS_DMASYNC_POSTREAD | BUS_DMASYNC_POSTWRITE);
+
+	count = 0;
+	bytes = 0;
+	pending = 0;
+	tstmp = 0;
+	rrd_cidx = rxq->cidx;
+#if 0
+	printf("consuming packets starting at %d\n", rrd_cidx);
+#endif
+	while (count < limit) {
+		rrd = &rxq->rrd_hdr[rrd_cidx];
+		if ((rrd->word3 & (1 << RRD_UPDATED_SHIFT)) == 0)
+			break;
+		rrd->word3 &= ~(1 << RRD_UPDATED_SHIFT);
+
+		/* Get the index of the corresponding RFD. */
+		rfd_cidx = FIELD_GETX(rrd->word0, RRD_SI);
+		if (rfd_cidx != rrd_cidx ||
+		    FIELD_GETX(rrd->word0, RRD_NOR) != 1) {
+			device_printf(sc->alx_dev,
+			    "RX consumer index mismatch: %d vs. %d, and %d\n",
 			    rrd_cidx, rfd_cidx,
 			    FIELD_GETX(rrd->word0, RRD_NOR));
-			/* XXX reset the chip? */
-			return;
+			/* The ring can't be trusted any more; rebuild it. */
+			counter_u64_add(rxq->rx_desync, 1);
+			taskqueue_enqueue(sc->alx_tq, &sc->alx_reset_task);
+			break;
 		}
 
-		rx_buf = &sc->alx_rx_queue.bf_info[rfd_cidx];
-		m = rx_buf->m;
-		rx_buf->m = NULL;
+		rx_buf = &rxq->bf_info[rfd_cidx];
+		len = FIELD_GETX(rrd->word3, RRD_PKTLEN) - ETHER_CRC_LEN;
+		bus_dmamap_sync(sc->alx_rx_buf_tag, rx_buf->dmamap,
+		    BUS_DMASYNC_POSTREAD);
+
+		/*
+		 * Leave the buffer in its slot for frames we drop, and for
+		 * small frames, which are copied out instead. The MAC counts
+		 * the errors; see alx_get_counter().
+		 */
+		if ((rrd->word3 & ((1 << RRD_ERR_RES_SHIFT) |
+		    (1 << RRD_ERR_LEN_SHIFT))) != 0) {
+			bus_dmamap_sync(sc->alx_rx_buf_tag, rx_buf->dmamap,
+			    BUS_DMASYNC_PREREAD);
+			goto next;
+		}
+		m = NULL;
+		if (len <= sc->alx_rx_copybreak) {
+			m = m_gethdr(M_NOWAIT, MT_DATA);
+			if (m != NULL) {
+				m->m_data += ETHER_ALIGN;
+				bcopy(mtod(rx_buf->m, void *), mtod(m, void *),
+				    len);
+				bus_dmamap_sync(sc->alx_rx_buf_tag,
+				    rx_buf->dmamap, BUS_DMASYNC_PREREAD);
+			}
+		}
+		if (m == NULL) {
+			m = rx_buf->m;
+			if (alx_newbuf(sc, rxq, rfd_cidx) != 0) {
+				counter_u64_add(rxq->rx_mbuf_fail, 1);
+				bus_dmamap_sync(sc->alx_rx_buf_tag,
+				    rx_buf->dmamap, BUS_DMASYNC_PREREAD);
+				goto next;
+			}
+		}
 
 		m->m_flags |= M_PKTHDR;
-		m->m_len = FIELD_GETX(rrd->word3, RRD_PKTLEN) - ETHER_CRC_LEN;
+		m->m_len = len;
 		m->m_pkthdr.len = m->m_len;
 		m->m_pkthdr.rcvif = ifp;
+		bytes += m->m_len;
+		if ((ifp->if_capenable & IFCAP_RXCSUM) != 0)
+			alx_rx_csum(rrd, m);
+		if ((ifp->if_capenable & IFCAP_VLAN_HWTAGGING) != 0 &&
+		    (le32toh(rrd->word3) & (1 << RRD_VLTAGGED_SHIFT)) != 0) {
+			m->m_pkthdr.ether_vtag = ALX_TAG_TO_VLAN(
+			    FIELD_GETX(le32toh(rrd->word2), RRD_VLTAG));
+			m->m_flags |= M_VLANTAG;
+		}
+		/*
+		 * These are software stamps taken here in the driver, not
+		 * hardware timestamps: the 1588 unit behind ALX_CAP_PTP isn't
+		 * documented, so there is no NIC clock and TX completions
+		 * aren't stamped at all. On request, every frame of a pass
+		 * gets the time the first of them was taken off the ring, so
+		 * one clock read covers the whole pass.
+		 */
+		if (sc->alx_rx_sw_tstmp != 0) {
+			if (tstmp == 0) {
+				nanotime(&ts);
+				tstmp = (uint64_t)ts.tv_sec * 1000000000 +
+				    ts.tv_nsec;
+			}
+			m->m_pkthdr.rcv_tstmp = tstmp;
+			m->m_flags |= M_TSTMP;
+		}
 
 #if 0
 		printf("read a %d-byte packet\n", m->m_len);
 #endif
 
-		/* Pass the packet up the stack. */
-		ALX_UNLOCK(sc);
-		(*ifp->if_input)(ifp, m);
-		ALX_LOCK(sc);
+		/* Chain the frame onto the queue RSS picked. */
+		qidx = alx_rx_hash(sc, rrd, m);
+		if ((pending & (1 << qidx)) == 0) {
+			swq_head[qidx] = m;
+			pending |= 1 << qidx;
+		} else
+			swq_tail[qidx]->m_nextpkt = m;
+		swq_tail[qidx] = m;
 
-		count++;
+next:
 		if (++rrd_cidx == sc->rx_ringsz)
 			rrd_cidx = 0;
+
+		/* Keep the chip supplied with buffers during long bursts. */
+		if (++count % ALX_RX_ALLOC_THRESH == 0) {
+			rxq->cidx = rrd_cidx;
+			alx_rx_refill(sc, rxq);
+		}
 	}
 
 #if 0
@@ -698,135 +1256,476 @@ alx_rxintr(struct alx_softc *sc)
 #endif
 
 	if (count > 0) {
-		sc->alx_rx_queue.cidx = rrd_cidx;
+		rxq->cidx = rrd_cidx;
+		alx_rx_refill(sc, rxq);
 
-		/* Refresh mbufs. */
-		rrd_pidx = sc->alx_rx_queue.pidx;
-		while (rrd_pidx != rrd_cidx) {
-#if 0
-			printf("refreshing mbuf at %d\n", rrd_pidx);
-#endif
-			if (alx_newbuf(sc, rrd_pidx) != 0)
-				break;
-			if (++rrd_pidx == sc->rx_ringsz)
-				rrd_pidx = 0;
+		if (sc->alx_imod_profile == ALX_IMOD_ADAPTIVE) {
+			atomic_add_int(&sc->alx_imod_pkts, count);
+			atomic_add_int(&sc->alx_imod_bytes, bytes);
 		}
-		sc->alx_rx_queue.pidx = rrd_pidx;
-		ALX_MEM_W16(&sc->hw, ALX_RFD_PIDX, rrd_pidx);
 
 		/* Sync receive descriptors. */
-		bus_dmamap_sync(sc->alx_rr_tag, sc->alx_rr_dmamap,
-		    BUS_DMASYNC_PREREAD | BUS_DMASYNC_PREWRITE);
-		bus_dmamap_sync(sc->alx_rx_tag, sc->alx_rx_dmamap,
+		bus_dmamap_sync(sc->ring_header.tag, sc->ring_header.map,
 		    BUS_DMASYNC_PREREAD | BUS_DMASYNC_PREWRITE);
 	}
+	if (sc->alx_hist_enable)
+		alx_hist_add(&rxq->rx_poll_pkts, count);
+
+	/* Hand steered frames to their queues. */
+	for (qidx = 0; qidx < sc->nr_rxq; qidx++) {
+		if ((pending & (1 << qidx)) == 0 || qidx == rxq->qidx)
+			continue;
+
+		swq = &sc->alx_rx_queue[qidx];
+		ALX_RX_LOCK(swq);
+		if (swq->swq_tail == NULL)
+			swq->swq_head = swq_head[qidx];
+		else
+			swq->swq_tail->m_nextpkt = swq_head[qidx];
+		swq->swq_tail = swq_tail[qidx];
+		ALX_RX_UNLOCK(swq);
+		taskqueue_enqueue(swq->swq_tq, &swq->swq_task);
+	}
+
+	/*
+	 * Pass this queue's frames up the stack in one go, without the queue
+	 * lock. Only one context services the ring, its task or alx_poll()
+	 * once SIOCSIFCAP has fenced the tasks off, so the LRO state needs no
+	 * lock of its own.
+	 */
+	if ((pending & (1 << rxq->qidx)) != 0) {
+		ALX_RX_UNLOCK(rxq);
+		alx_rx_input(rxq, swq_head[rxq->qidx],
+		    (ifp->if_capenable & IFCAP_LRO) != 0);
+		ALX_RX_LOCK(rxq);
+	}
+
+	return (count);
 }
 
+/*
+ * Deliver the frames that alx_rxintr() steered to a non-hardware RX queue.
+ */
 static void
-alx_txintr(struct alx_softc *sc)
+alx_swq_task(void *arg, int pending __unused)
+{
+	struct alx_rx_queue *rxq;
+	struct mbuf *m;
+
+	rxq = arg;
+
+	ALX_RX_LOCK(rxq);
+	m = rxq->swq_head;
+	rxq->swq_head = rxq->swq_tail = NULL;
+	ALX_RX_UNLOCK(rxq);
+
+	alx_rx_input(rxq, m,
+	    (rxq->sc->alx_ifp->if_capenable & IFCAP_LRO) != 0);
+}
+
+/*
+ * Reclaim up to "limit" transmitted frames. Returns true if the limit was hit
+ * before catching up with the hardware.
+ */
+static bool
+alx_txeof(struct alx_softc *sc, struct alx_tx_queue *txq, int limit)
 {
-	struct ifnet *ifp;
 	struct alx_buffer *tx_buf;
-	int tpd_cidx, tpd_hw_cidx;
+	sbintime_t now;
+	int tpd_cidx, tpd_hw_cidx, work;
 
-	ALX_LOCK_ASSERT(sc);
+	ALX_TX_LOCK_ASSERT(txq);
 
-	ifp = sc->alx_ifp;
+	/* The ring may not even be the one the indexes were set up for. */
+	if ((sc->alx_ifp->if_drv_flags & IFF_DRV_RUNNING) == 0)
+		return (false);
+
+#ifdef DEV_NETMAP
+	if (netmap_tx_irq(sc->alx_ifp, txq->qidx))
+		return (false);
+#endif
 
-	tpd_cidx = sc->alx_tx_queue.cidx;
-	ALX_MEM_R16(&sc->hw, ALX_TPD_PRI0_CIDX, &tpd_hw_cidx);
+	tpd_cidx = txq->cidx;
+	ALX_MEM_R16(&sc->hw, txq->c_reg, &tpd_hw_cidx);
 
 #if 0
-	printf("in txintr cidx is %d, hw_cidx is %d\n", tpd_cidx, tpd_hw_cidx);
+	printf("in txeof cidx is %d, hw_cidx is %d\n", tpd_cidx, tpd_hw_cidx);
 #endif
 
-	while (tpd_cidx != tpd_hw_cidx) {
-		tx_buf = &sc->alx_tx_queue.bf_info[tpd_cidx];
-		if (tx_buf->m == NULL) {
-			if (++tpd_cidx == sc->tx_ringsz)
-				tpd_cidx = 0;
+	/*
+	 * The mbuf hangs off the last descriptor of its frame, so it's only
+	 * freed once the hardware has moved past the whole frame.
+	 */
+	work = 0;
+	now = 0;
+	while (tpd_cidx != tpd_hw_cidx && work < limit) {
+		tx_buf = &txq->bf_info[tpd_cidx];
+		txq->avail++;
+		if (++tpd_cidx == sc->tx_ringsz)
+			tpd_cidx = 0;
+		if (tx_buf->tstamp != 0) {
+			/* All of this pass's completions share one stamp. */
+			if (now == 0)
+				now = sbinuptime();
+			alx_hist_add(&txq->tx_compl_lat,
+			    sbttous(now - tx_buf->tstamp));
+			tx_buf->tstamp = 0;
+		}
+		if ((tx_buf->flags & ALX_BUF_TX_BOUNCE) != 0) {
+			/* The mbuf went as soon as it was copied. */
+			tx_buf->flags &= ~ALX_BUF_TX_BOUNCE;
+			txq->bounce_used--;
+			work++;
 			continue;
 		}
-
-		ifp->if_drv_flags &= ~IFF_DRV_OACTIVE;
+		if (tx_buf->m == NULL)
+			continue;
 
 		/* Tear down the DMA mapping for the used mbuf. */
 		bus_dmamap_sync(sc->alx_tx_buf_tag, tx_buf->dmamap,
 		    BUS_DMASYNC_POSTWRITE);
 		bus_dmamap_unload(sc->alx_tx_buf_tag, tx_buf->dmamap);
 
+		SDT_PROBE2(alx, , , tx__complete, txq, tx_buf->m);
 		m_freem(tx_buf->m);
 		tx_buf->m = NULL;
-
-		if (++tpd_cidx == sc->tx_ringsz)
-			tpd_cidx = 0;
+		work++;
 	}
 
-	sc->alx_tx_queue.cidx = tpd_cidx;
+	/* Any progress buys the hardware more time. */
+	if (tpd_cidx != txq->cidx)
+		txq->watchdog = txq->avail == sc->tx_ringsz - 1 ? 0 :
+		    ALX_WATCHDOG_TIME;
+	txq->cidx = tpd_cidx;
+
+	return (tpd_cidx != tpd_hw_cidx);
+}
+
+/*
+ * Handle a TX completion interrupt: reclaim descriptors and restart the queue
+ * once enough of the ring has drained.
+ */
+static bool
+alx_txintr(struct alx_softc *sc, struct alx_tx_queue *txq, int limit)
+{
+	struct ifnet *ifp;
+	bool more;
+
+	ALX_TX_LOCK_ASSERT(txq);
+
+	ifp = sc->alx_ifp;
+
+	more = alx_txeof(sc, txq, limit);
+
+	if (txq->oactive && txq->avail >= ALX_TX_WAKEUP_THRESH(txq))
+		txq->oactive = false;
+
+	/* Push out anything that queued up while the ring was busy. */
+	if (!txq->oactive && !drbr_empty(ifp, txq->br))
+		alx_start_locked(ifp, txq);
+
+	return (more);
+}
+
+/*
+ * Size the RX buffers for the current MTU, using the smallest mbuf cluster
+ * that holds a whole frame.
+ */
+static void
+alx_set_rxbuf_size(struct alx_softc *sc)
+{
+	struct alx_hw *hw;
+
+	hw = &sc->hw;
+	hw->mtu = sc->alx_ifp->if_mtu;
+	sc->rxbuf_size = ALIGN(ALX_RAW_MTU(hw->mtu));
+	if (sc->rxbuf_size <= MCLBYTES)
+		sc->rxbuf_clsize = MCLBYTES;
+	else if (sc->rxbuf_size <= MJUMPAGESIZE)
+		sc->rxbuf_clsize = MJUMPAGESIZE;
+	else
+		sc->rxbuf_clsize = MJUM9BYTES;
 }
 
 static int
-alx_newbuf(struct alx_softc *sc, int index)
+alx_newbuf(struct alx_softc *sc, struct alx_rx_queue *rxq, int index)
 {
 	struct mbuf *m;
 	bus_dma_segment_t seg;
+	bus_dmamap_t map;
 	struct alx_buffer *rx_buf;
 	struct rfd_desc *rfd;
 	int nsegs;
 
-	m = m_getcl(M_NOWAIT, MT_DATA, M_PKTHDR);
+	m = m_getjcl(M_NOWAIT, MT_DATA, M_PKTHDR, sc->rxbuf_clsize);
 	if (m == NULL)
 		return (ENOBUFS);
-	m->m_len = m->m_pkthdr.len = MCLBYTES;
+	m->m_len = m->m_pkthdr.len = sc->rxbuf_clsize;
 
-	rx_buf = &sc->alx_rx_queue.bf_info[index];
-	if (bus_dmamap_load_mbuf_sg(sc->alx_rx_buf_tag, rx_buf->dmamap, m, &seg,
-	    &nsegs, 0) != 0) {
+	/*
+	 * Load the new buffer into the spare map first so that on failure the
+	 * slot keeps its old buffer.
+	 */
+	if (bus_dmamap_load_mbuf_sg(sc->alx_rx_buf_tag, rxq->spare_map, m,
+	    &seg, &nsegs, 0) != 0) {
 		m_freem(m);
 		return (ENOBUFS);
 	}
+
+	rx_buf = &rxq->bf_info[index];
+	if (rx_buf->m != NULL)
+		bus_dmamap_unload(sc->alx_rx_buf_tag, rx_buf->dmamap);
+	map = rx_buf->dmamap;
+	rx_buf->dmamap = rxq->spare_map;
+	rxq->spare_map = map;
 	rx_buf->m = m;
 	bus_dmamap_sync(sc->alx_rx_buf_tag, rx_buf->dmamap,
 	    BUS_DMASYNC_PREREAD);
 
-	rfd = &sc->alx_rx_queue.rfd_hdr[index];
+	rfd = &rxq->rfd_hdr[index];
 	rfd->addr = htole64(seg.ds_addr);
 
 	return (0);
 }
 
+/*
+ * Work out the TPD offload flags for an outgoing frame. The Ethernet, IP and,
+ * for TSO, TCP headers are made contiguous first. On failure the frame has
+ * been freed.
+ */
+static int
+alx_tx_offload(struct mbuf **m_head, uint32_t *cflagsp)
+{
+	struct ether_header *eh;
+	struct ip *ip;
+	struct tcphdr *tcp;
+	struct mbuf *m;
+	uint32_t cflags;
+	int ip_off, poff;
+	uint16_t etype;
+
+	m = *m_head;
+	*cflagsp = 0;
+	if ((m->m_pkthdr.csum_flags & (ALX_CSUM_FEATURES | CSUM_TSO)) == 0)
+		return (0);
+
+	if ((m->m_pkthdr.csum_flags & CSUM_TSO) != 0 && M_WRITABLE(m) == 0) {
+		/* We're going to clear the IP header checksum. */
+		m = m_dup(*m_head, M_NOWAIT);
+		m_freem(*m_head);
+		if (m == NULL)
+			goto fail;
+	}
+
+	ip_off = sizeof(struct ether_header);
+	m = m_pullup(m, ip_off);
+	if (m == NULL)
+		goto fail;
+	cflags = 0;
+	eh = mtod(m, struct ether_header *);
+	etype = ntohs(eh->ether_type);
+	if (etype == ETHERTYPE_VLAN) {
+		ip_off = sizeof(struct ether_vlan_header);
+		m = m_pullup(m, ip_off);
+		if (m == NULL)
+			goto fail;
+		etype = ntohs(mtod(m, struct ether_vlan_header *)->evl_proto);
+		/* The tag is already in the frame. */
+		cflags |= 1 << TPD_VLTAGGED_SHIFT;
+	}
+
+	switch (etype) {
+	case ETHERTYPE_IP:
+		m = m_pullup(m, ip_off + sizeof(struct ip));
+		if (m == NULL)
+			goto fail;
+		ip = (struct ip *)(mtod(m, char *) + ip_off);
+		poff = ip_off + (ip->ip_hl << 2);
+		break;
+	case ETHERTYPE_IPV6:
+		/* XXX extension headers */
+		m = m_pullup(m, ip_off + sizeof(struct ip6_hdr));
+		if (m == NULL)
+			goto fail;
+		poff = ip_off + sizeof(struct ip6_hdr);
+		break;
+	default:
+		m_freem(m);
+		*m_head = NULL;
+		return (EINVAL);
+	}
+
+	if ((m->m_pkthdr.csum_flags & CSUM_TSO) != 0) {
+		m = m_pullup(m, poff + sizeof(struct tcphdr));
+		if (m == NULL)
+			goto fail;
+		tcp = (struct tcphdr *)(mtod(m, char *) + poff);
+		m = m_pullup(m, poff + (tcp->th_off << 2));
+		if (m == NULL)
+			goto fail;
+
+		/*
+		 * The stack seeds th_sum with the pseudo-header checksum
+		 * without the length, which is what the hardware wants. It
+		 * also computes the IP header checksum of every segment.
+		 */
+		if (etype == ETHERTYPE_IP) {
+			ip = (struct ip *)(mtod(m, char *) + ip_off);
+			ip->ip_sum = 0;
+			cflags |= 1 << TPD_IPV4_SHIFT;
+		} else
+			/* IPv6 needs LSOv2, see alx_xmit(). */
+			cflags |= 1 << TPD_LSO_V2_SHIFT;
+		cflags |= 1 << TPD_LSO_EN_SHIFT;
+		cflags |= FIELDX(TPD_L4HDROFFSET, poff);
+		cflags |= FIELDX(TPD_MSS, m->m_pkthdr.tso_segsz);
+	} else {
+		/*
+		 * Use the custom checksum mode: the hardware sums everything
+		 * from the L4 header onwards, seeded with the pseudo-header
+		 * checksum supplied by the stack, and stores the result at the
+		 * given offset. Both offsets are in units of 2 bytes.
+		 */
+		cflags |= 1 << TPD_CXSUM_EN_SHIFT;
+		cflags |= FIELDX(TPD_CXSUMSTART, poff >> 1);
+		cflags |= FIELDX(TPD_CXSUMOFFSET,
+		    (poff + m->m_pkthdr.csum_data) >> 1);
+	}
+
+	*m_head = m;
+	*cflagsp = cflags;
+	return (0);
+
+fail:
+	*m_head = NULL;
+	return (ENOBUFS);
+}
+
+/*
+ * Copy a frame into the next bounce slot and queue it as a single descriptor.
+ * The caller frees the mbuf once it is done with it. Returns EAGAIN if the
+ * pool is used up, in which case the frame has to be mapped instead.
+ */
+static int
+alx_tx_bounce(struct alx_softc *sc, struct alx_tx_queue *txq, struct mbuf *m,
+    uint32_t cflags, uint32_t vtag)
+{
+	struct alx_buffer *tx_buf;
+	struct tpd_desc *td;
+	bus_addr_t paddr;
+	int desci, len, slot;
+
+	ALX_TX_LOCK_ASSERT(txq);
+
+	if (txq->bounce_used == ALX_TX_BOUNCE_SLOTS)
+		return (EAGAIN);
+	if (txq->avail == 0) {
+		counter_u64_add(txq->tx_ring_full, 1);
+		return (ENOBUFS);
+	}
+
+	slot = txq->bounce_next;
+	len = m->m_pkthdr.len;
+	m_copydata(m, 0, len, txq->bounce + slot * ALX_TX_BOUNCE_SIZE);
+	paddr = txq->bounce_dma + slot * ALX_TX_BOUNCE_SIZE;
+	bus_dmamap_sync(sc->alx_tx_bounce_tag, txq->bounce_map,
+	    BUS_DMASYNC_PREWRITE);
+
+	desci = txq->pidx;
+	td = &txq->tpd_hdr[desci];
+	td->addr = htole64(paddr);
+	td->len = htole32(FIELDX(TPD_BUFLEN, len) | vtag);
+	td->flags = htole32(cflags | 1 << TPD_EOP_SHIFT);
+
+	tx_buf = &txq->bf_info[desci];
+	tx_buf->flags |= ALX_BUF_TX_BOUNCE;
+	tx_buf->tstamp = sc->alx_hist_enable ? sbinuptime() : 0;
+
+	txq->bounce_next = (slot + 1) % ALX_TX_BOUNCE_SLOTS;
+	txq->bounce_used++;
+	txq->pidx = ALX_TX_INC(desci, sc);
+	txq->avail--;
+	txq->pending++;
+	counter_u64_add(txq->tx_bounce, 1);
+
+	SDT_PROBE3(alx, , , tx__enqueue, txq, m, 1);
+
+	return (0);
+}
+
+/*
+ * Queue a frame on the TPD ring. If *bounced is set on return, the frame was
+ * copied into the bounce pool and the caller must free it. On error the frame
+ * has been freed and *m_head cleared, unless the error is ENOBUFS with
+ * *m_head still set: then the ring is full and the frame can be retried.
+ */
 static int
-alx_xmit(struct alx_softc *sc, struct mbuf **m_head)
+alx_xmit(struct alx_softc *sc, struct alx_tx_queue *txq, struct mbuf **m_head,
+    bool *bounced)
 {
 	struct mbuf *m;
-	bus_dma_segment_t segs[32];
+	bus_dma_segment_t segs[ALX_MAXTXSEGS];
 	bus_dmamap_t txmap;
 	struct tpd_desc *td = NULL;
 	struct alx_buffer *tx_buf, *tx_buf_mapped;
-	int desci, error, nsegs, i;
-	uint16_t cidx;
+	uint32_t cflags, vtag;
+	int desci, error, nsegs, ndesc, i;
+	bool bounce;
 
-	ALX_LOCK_ASSERT(sc);
+	ALX_TX_LOCK_ASSERT(txq);
 
 	M_ASSERTPKTHDR(*m_head);
 
-	ALX_MEM_R16(&sc->hw, sc->alx_tx_queue.c_reg, &cidx);
+	*bounced = false;
+	error = alx_tx_offload(m_head, &cflags);
+	if (error != 0)
+		return (error);
+
+	vtag = 0;
+	if (((*m_head)->m_flags & M_VLANTAG) != 0) {
+		vtag = FIELDX(TPD_VLTAG,
+		    ALX_VLAN_TO_TAG((*m_head)->m_pkthdr.ether_vtag));
+		cflags |= 1 << TPD_INS_VLTAG_SHIFT;
+	}
+
+	/*
+	 * Small frames are cheaper to copy than to map. The bounce pool also
+	 * takes frames with too many fragments, as long as they fit a slot,
+	 * so that they needn't be collapsed. TSO frames are always mapped.
+	 */
+	bounce = ((*m_head)->m_pkthdr.csum_flags & CSUM_TSO) == 0 &&
+	    (*m_head)->m_pkthdr.len <= ALX_TX_BOUNCE_SIZE;
+	if (bounce && (*m_head)->m_pkthdr.len <= sc->alx_tx_bounce) {
+		error = alx_tx_bounce(sc, txq, *m_head, cflags, vtag);
+		if (error != EAGAIN) {
+			*bounced = error == 0;
+			return (error);
+		}
+	}
 
-	desci = sc->alx_tx_queue.pidx;
-	tx_buf = tx_buf_mapped = &sc->alx_tx_queue.bf_info[desci];
+	desci = txq->pidx;
+	tx_buf = &txq->bf_info[desci];
 	txmap = tx_buf->dmamap;
 
 	error = bus_dmamap_load_mbuf_sg(sc->alx_tx_buf_tag, txmap, *m_head,
 	    segs, &nsegs, 0);
+	if (error == EFBIG && bounce) {
+		error = alx_tx_bounce(sc, txq, *m_head, cflags, vtag);
+		if (error != EAGAIN) {
+			*bounced = error == 0;
+			return (error);
+		}
+		error = EFBIG;
+	}
 	if (error == EFBIG) {
-		m = m_collapse(*m_head, M_NOWAIT, 32 /* XXX magic */);
+		m = m_collapse(*m_head, M_NOWAIT, ALX_MAXTXSEGS);
 		if (m == NULL) {
-			/* XXX increment counter? */
 			m_freem(*m_head);
 			*m_head = NULL;
 			return (ENOBUFS);
 		}
 		*m_head = m;
+		counter_u64_add(txq->tx_collapse, 1);
 		/*
 		 * Try to create the mapping again now that some of the
 		 * fragments have been coalesced.
@@ -838,67 +1737,108 @@ alx_xmit(struct alx_softc *sc, struct mbuf **m_head)
 			*m_head = NULL;
 			return (error);
 		}
-	} else if (error != 0)
-		/* XXX increment counter? */
+	} else if (error != 0) {
+		m_freem(*m_head);
+		*m_head = NULL;
 		return (error);
+	}
 
 	if (nsegs == 0) {
 		m_freem(*m_head);
 		*m_head = NULL;
-		/* XXX increment counter? */
 		return (EIO);
 	}
 
 	/* Make sure we have enough descriptors available. */
-	/* XXX what's up with the - 2? It's in em(4) and age(4). */
-	/* XXX count isn't ever modified. */
-	if (nsegs > sc->alx_tx_queue.count - 2) {
-		/* XXX increment counter? */
-		bus_dmamap_unload(sc->alx_tx_tag, txmap);
+	ndesc = nsegs;
+	if ((cflags & (1 << TPD_LSO_V2_SHIFT)) != 0)
+		ndesc++;
+	if (ndesc > txq->avail) {
+		counter_u64_add(txq->tx_ring_full, 1);
+		bus_dmamap_unload(sc->alx_tx_buf_tag, txmap);
 		return (ENOBUFS);
 	}
 
+	/*
+	 * With LSOv2 the first descriptor carries no data; its address word
+	 * holds the total frame length instead.
+	 */
+	if ((cflags & (1 << TPD_LSO_V2_SHIFT)) != 0) {
+		td = &txq->tpd_hdr[desci];
+		td->addr = htole64((*m_head)->m_pkthdr.len);
+		td->len = htole32(vtag);
+		td->flags = htole32(cflags);
+		desci = ALX_TX_INC(desci, sc);
+	}
+
 	for (i = 0; i < nsegs; i++, desci = ALX_TX_INC(desci, sc)) {
-		td = &sc->alx_tx_queue.tpd_hdr[desci];
+		td = &txq->tpd_hdr[desci];
 		td->addr = htole64(segs[i].ds_addr);
-		td->len = htole32(segs[i].ds_len);
-		td->flags = 0;
+		td->len = htole32(FIELDX(TPD_BUFLEN, segs[i].ds_len) | vtag);
+		/*
+		 * Offload flags and the VLAN tag are repeated in every
+		 * descriptor of a frame.
+		 */
+		td->flags = htole32(cflags);
 	}
 
 	/* This is the last descriptor for this packet. */
-	td->flags |= 1 << TPD_EOP_SHIFT;
-
-	/* Update the producer index. */
-	sc->alx_tx_queue.pidx = desci;
+	td->flags |= htole32(1 << TPD_EOP_SHIFT);
 
-	/* Save the mbuf pointer so that we can unmap it later. */
-	tx_buf->m = *m_head;
+	/* Update the producer index; alx_tx_doorbell() tells the chip. */
+	txq->pidx = desci;
+	txq->avail -= ndesc;
+	txq->pending += ndesc;
 
 	/*
-	 * Swap the maps between the first and last descriptors so that the last
-	 * descriptor gets the real map. The first descriptor will end up with
-	 * an unused map.
+	 * Save the mbuf pointer at the last descriptor so that we can unmap it
+	 * once the hardware is done with the whole frame. Swap the maps between
+	 * the first and last descriptors so that the last descriptor gets the
+	 * real map. The first descriptor will end up with an unused map.
 	 */
-	tx_buf_mapped->dmamap = tx_buf->dmamap;
-	tx_buf->dmamap = txmap;
+	tx_buf_mapped = &txq->bf_info[ALX_TX_DEC(desci, sc)];
+	tx_buf->dmamap = tx_buf_mapped->dmamap;
+	tx_buf_mapped->dmamap = txmap;
+	tx_buf_mapped->m = *m_head;
+	tx_buf_mapped->tstamp = sc->alx_hist_enable ? sbinuptime() : 0;
 	bus_dmamap_sync(sc->alx_tx_buf_tag, txmap, BUS_DMASYNC_PREWRITE);
 
-	/* Let the hardware know that we're all set. */
-	bus_dmamap_sync(sc->alx_tx_tag, sc->alx_tx_dmamap,
-	    BUS_DMASYNC_PREREAD | BUS_DMASYNC_PREWRITE);
-
-	ALX_MEM_W16(&sc->hw, sc->alx_tx_queue.p_reg, desci);
+	SDT_PROBE3(alx, , , tx__enqueue, txq, *m_head, ndesc);
 
 	return (0);
 }
 
+/*
+ * Hand the descriptors queued by alx_xmit() to the hardware: one ring sync
+ * and one producer index write per batch.
+ */
+static void
+alx_tx_doorbell(struct alx_softc *sc, struct alx_tx_queue *txq)
+{
+
+	ALX_TX_LOCK_ASSERT(txq);
+
+	if (txq->pending == 0)
+		return;
+	bus_dmamap_sync(sc->ring_header.tag, sc->ring_header.map,
+	    BUS_DMASYNC_PREREAD | BUS_DMASYNC_PREWRITE);
+	SDT_PROBE3(alx, , , tx__doorbell, txq, txq->pidx, txq->pending);
+	ALX_MEM_W16(&sc->hw, txq->p_reg, txq->pidx);
+	txq->pending = 0;
+	if (txq->watchdog == 0)
+		txq->watchdog = ALX_WATCHDOG_TIME;
+}
+
 static void
 alx_stop(struct alx_softc *sc)
 {
 	struct ifnet *ifp;
 	struct alx_hw *hw;
 	struct alx_buffer *tx_buf, *rx_buf;
-	int i, error;
+	struct alx_rx_queue *rxq;
+	struct alx_tx_queue *txq;
+	struct mbuf *m;
+	int i, q, error;
 
 	ALX_LOCK_ASSERT(sc);
 
@@ -906,26 +1846,50 @@ alx_stop(struct alx_softc *sc)
 	ifp = sc->alx_ifp;
 	ifp->if_drv_flags &= ~(IFF_DRV_RUNNING | IFF_DRV_OACTIVE);
 
+	/*
+	 * The MAC is about to be reset, so make alx_update_link() bring the
+	 * link up from scratch on the next init.
+	 */
+	hw->link_up = false;
+	hw->link_speed = 0;
+	hw->link_duplex = 0;
+	sc->alx_link_state = ALX_LSTATE_DOWN;
+
 	alx_intr_disable(sc);
 
+	callout_stop(&sc->alx_tick_ch);
+
 	error = alx_stop_mac(hw);
 	if (error != 0)
 		device_printf(sc->alx_dev, "error stopping MAC\n");
 
+	/* Don't lose the counts since the last tick to the coming reset. */
+	__alx_update_hw_stats(hw);
+
 	/* XXX what else? */
-	for (i = 0; i < sc->tx_ringsz; i++) {
-		tx_buf = &sc->alx_tx_queue.bf_info[i];
-		if (tx_buf->m != NULL) {
-			bus_dmamap_sync(sc->alx_tx_buf_tag, tx_buf->dmamap,
-			    BUS_DMASYNC_POSTWRITE);
-			bus_dmamap_unload(sc->alx_tx_buf_tag, tx_buf->dmamap);
-			m_freem(tx_buf->m);
-			tx_buf->m = NULL;
+	for (q = 0; q < sc->nr_txq; q++) {
+		txq = &sc->alx_tx_queue[q];
+		ALX_TX_LOCK(txq);
+		for (i = 0; i < sc->tx_ringsz; i++) {
+			tx_buf = &txq->bf_info[i];
+			tx_buf->flags = 0;
+			if (tx_buf->m != NULL) {
+				bus_dmamap_sync(sc->alx_tx_buf_tag,
+				    tx_buf->dmamap, BUS_DMASYNC_POSTWRITE);
+				bus_dmamap_unload(sc->alx_tx_buf_tag,
+				    tx_buf->dmamap);
+				m_freem(tx_buf->m);
+				tx_buf->m = NULL;
+			}
 		}
+		txq->bounce_used = 0;
+		ALX_TX_UNLOCK(txq);
 	}
 
+	rxq = &sc->alx_rx_queue[0];
+	ALX_RX_LOCK(rxq);
 	for (i = 0; i < sc->rx_ringsz; i++) {
-		rx_buf = &sc->alx_rx_queue.bf_info[i];
+		rx_buf = &rxq->bf_info[i];
 		if (rx_buf->m != NULL) {
 			bus_dmamap_sync(sc->alx_rx_buf_tag, rx_buf->dmamap,
 			    BUS_DMASYNC_POSTWRITE);
@@ -934,6 +1898,41 @@ alx_stop(struct alx_softc *sc)
 			rx_buf->m = NULL;
 		}
 	}
+	ALX_RX_UNLOCK(rxq);
+
+	/* Drop any frames that were steered but not yet delivered. */
+	for (i = 0; i < sc->nr_rxq; i++) {
+		rxq = &sc->alx_rx_queue[i];
+		ALX_RX_LOCK(rxq);
+		while ((m = rxq->swq_head) != NULL) {
+			rxq->swq_head = m->m_nextpkt;
+			m_freem(m);
+		}
+		rxq->swq_tail = NULL;
+		ALX_RX_UNLOCK(rxq);
+	}
+}
+
+/*
+ * Spread the RSS indirection table evenly across the RX queues and enable
+ * hashing. Each 32-bit word of the table holds eight 4-bit queue indices.
+ */
+static void
+alx_init_rss(struct alx_softc *sc)
+{
+	struct alx_hw *hw;
+	int i, x, y;
+
+	hw = &sc->hw;
+
+	memset(hw->rss_idt, 0, sizeof(hw->rss_idt));
+	for (i = 0; i < hw->rss_idt_size; i++) {
+		x = i >> 3;
+		y = (i * 4) & 0x1F;
+		hw->rss_idt[x] |= (uint32_t)(i % sc->nr_rxq) << y;
+	}
+
+	alx_configure_rss(hw, ALX_CAP(hw, RSS));
 }
 
 static void
@@ -958,6 +1957,9 @@ alx_reset(struct alx_softc *sc)
 	/* XXX what else? */
 }
 
+/*
+ * Bring the MAC in line with the PHY state cached by alx_link_task().
+ */
 static void
 alx_update_link(struct alx_softc *sc)
 {
@@ -968,12 +1970,14 @@ alx_update_link(struct alx_softc *sc)
 
 	ALX_LOCK_ASSERT(sc);
 
-	hw = &sc->hw;
-
-	error = alx_get_phy_link(hw, &link_up, &speed);
-	if (error != 0)
+	/* The benchmark owns the PHY while it runs. */
+	if (ALX_FLAG(sc, TESTING))
 		return;
 
+	hw = &sc->hw;
+	link_up = sc->alx_phy_link;
+	speed = sc->alx_phy_speed;
+
 	if ((!link_up && !hw->link_up) ||
 	    (sc->alx_ifp->if_drv_flags & IFF_DRV_RUNNING) == 0)
 		return;
@@ -989,15 +1993,17 @@ alx_update_link(struct alx_softc *sc)
 		hw->link_duplex = speed % 10;
 		hw->link_speed = speed - hw->link_duplex;
 
-		alx_post_phy_link(hw, hw->link_speed, ALX_CAP(hw, AZ));
-		alx_enable_aspm(hw, ALX_CAP(hw, L0S), ALX_CAP(hw, L1));
+		alx_post_phy_link(hw, hw->link_speed, ALX_PM_CAP(hw, AZ));
+		alx_enable_aspm(hw, ALX_PM_CAP(hw, L0S), ALX_PM_CAP(hw, L1));
 		alx_start_mac(hw);
 
+		sc->alx_link_state = ALX_LSTATE_UP;
 		if_link_state_change(sc->alx_ifp, LINK_STATE_UP);
 	} else {
 		hw->link_duplex = 0;
 		hw->link_speed = 0;
 
+		__alx_update_hw_stats(hw);
 		error = alx_reset_mac(hw);
 		if (error != 0) {
 			device_printf(sc->alx_dev, "failed to reset MAC\n");
@@ -1007,403 +2013,2564 @@ alx_update_link(struct alx_softc *sc)
 		alx_intr_disable(sc);
 		/* XXX refresh rings */
 		alx_configure_basic(hw);
-		alx_configure_rss(hw, 0 /* XXX */);
-		alx_enable_aspm(hw, false, ALX_CAP(hw, L1));
-		alx_post_phy_link(hw, 0, ALX_CAP(hw, AZ));
+		alx_configure_rss(hw, ALX_CAP(hw, RSS));
+		alx_enable_aspm(hw, false, ALX_PM_CAP(hw, L1));
+		alx_post_phy_link(hw, 0, ALX_PM_CAP(hw, AZ));
 		alx_intr_enable(sc);
 
+		sc->alx_link_state = ALX_LSTATE_DOWN;
 		if_link_state_change(sc->alx_ifp, LINK_STATE_DOWN);
 	}
 }
 
+/*
+ * Program the interrupt moderation timer and the TX completion threshold.
+ */
 static void
-alx_int_task(void *context, int pending __unused)
+alx_imod_set(struct alx_softc *sc, int imt, int ith_tpd)
 {
-	struct alx_softc *sc;
+	struct alx_hw *hw;
 
-#if 0
-	printf("in alx_int_task\n");
-#endif
+	hw = &sc->hw;
+	if (hw->imt == imt && hw->ith_tpd == ith_tpd)
+		return;
+	hw->imt = imt;
+	hw->ith_tpd = ith_tpd;
 
-	sc = context;
+	/* Otherwise alx_configure_basic() will pick up the new values. */
+	if ((sc->alx_ifp->if_drv_flags & IFF_DRV_RUNNING) == 0)
+		return;
+	ALX_MEM_W32(hw, ALX_IRQ_MODU_TIMER,
+	    FIELDX(ALX_IRQ_MODU_TIMER1, imt >> 1));
+	ALX_MEM_W32(hw, ALX_TINT_TPD_THRSHLD, ith_tpd);
+	ALX_MEM_W32(hw, ALX_TINT_TIMER, imt);
+}
 
-	ALX_LOCK(sc);
+/*
+ * Apply a moderation profile. Adaptive mode starts from the throughput
+ * settings and is retuned by alx_imod_update().
+ */
+static void
+alx_imod_apply(struct alx_softc *sc)
+{
 
-	/* XXX check isr? */
-	alx_rxintr(sc);
-	alx_txintr(sc);
+	switch (sc->alx_imod_profile) {
+	case ALX_IMOD_FIXED:
+		alx_imod_set(sc, sc->alx_imod_fixed, sc->tx_ringsz / 3);
+		break;
+	case ALX_IMOD_LOWLAT:
+		alx_imod_set(sc, ALX_IMT_LOWLAT, sc->tx_ringsz / 8);
+		break;
+	case ALX_IMOD_ADAPTIVE:
+		sc->alx_imod_ticks = ticks;
+		atomic_readandclear_int(&sc->alx_imod_pkts);
+		atomic_readandclear_int(&sc->alx_imod_bytes);
+		atomic_readandclear_int(&sc->alx_imod_intrs);
+		/* FALLTHROUGH */
+	case ALX_IMOD_BULK:
+		alx_imod_set(sc, ALX_IMT_BULK, sc->tx_ringsz / 3);
+		break;
+	}
+}
 
-	ALX_UNLOCK(sc);
+/*
+ * Account for one interrupt and, in adaptive mode, retune moderation once per
+ * interval. Sparse traffic gets a short timer so that single requests aren't
+ * delayed; streams of large frames get a long one so that each interrupt
+ * covers as much work as possible.
+ */
+static void
+alx_imod_update(struct alx_softc *sc)
+{
+	u_int bytes, intrs, last, pkts;
+
+	if (sc->alx_imod_profile != ALX_IMOD_ADAPTIVE)
+		return;
+
+	atomic_add_int(&sc->alx_imod_intrs, 1);
+	last = sc->alx_imod_ticks;
+	if ((u_int)ticks - last < ALX_IMOD_INTERVAL)
+		return;
+	/* Only one vector gets to do the update. */
+	if (!atomic_cmpset_int(&sc->alx_imod_ticks, last, ticks))
+		return;
+
+	pkts = atomic_readandclear_int(&sc->alx_imod_pkts);
+	bytes = atomic_readandclear_int(&sc->alx_imod_bytes);
+	intrs = atomic_readandclear_int(&sc->alx_imod_intrs);
+
+	if (pkts < intrs * ALX_IMOD_LOWLAT_PKTS)
+		alx_imod_set(sc, ALX_IMT_LOWLAT, sc->tx_ringsz / 8);
+	else if (bytes / pkts >= ALX_IMOD_BULK_BYTES)
+		alx_imod_set(sc, ALX_IMT_BULK, sc->tx_ringsz / 3);
+	else
+		alx_imod_set(sc, ALX_IMT_MID, sc->tx_ringsz / 6);
 }
 
+/*
+ * Once a second: fold the MIB registers, which clear on read, into
+ * hw->stats before they can wrap.
+ */
 static void
-alx_link_task(void *arg, int pending __unused)
+alx_tick(void *arg)
 {
 	struct alx_softc *sc;
-	struct alx_hw *hw;
 
 	sc = arg;
-	hw = &sc->hw;
+	ALX_LOCK_ASSERT(sc);
 
-	ALX_LOCK(sc);
+	__alx_update_hw_stats(&sc->hw);
+	alx_watchdog(sc);
 
-	alx_clear_phy_intr(hw);
+	if (sc->alx_link_state == ALX_LSTATE_ANEG)
+		taskqueue_enqueue(sc->alx_tq, &sc->alx_link_task);
 
-	hw->imask |= ALX_ISR_PHY;
-	ALX_MEM_W32(hw, ALX_IMR, hw->imask);
+	callout_reset(&sc->alx_tick_ch, hz, alx_tick, sc);
+}
 
-	alx_update_link(sc);
+/*
+ * Count down the TX watchdogs and recover from a queue the hardware has
+ * stopped making progress on. A stalled link holds the watchdogs.
+ */
+static void
+alx_watchdog(struct alx_softc *sc)
+{
+	struct alx_tx_queue *txq;
+	bool hung;
+	int q;
 
-	ALX_UNLOCK(sc);
+	ALX_LOCK_ASSERT(sc);
+
+	if (!sc->hw.link_up || ALX_FLAG(sc, TESTING))
+		return;
+
+	hung = false;
+	for (q = 0; q < sc->nr_txq; q++) {
+		txq = &sc->alx_tx_queue[q];
+		ALX_TX_LOCK(txq);
+		if (txq->watchdog == 0 || --txq->watchdog != 0) {
+			ALX_TX_UNLOCK(txq);
+			continue;
+		}
+		/* Perhaps it was only the interrupt that went missing. */
+		alx_txeof(sc, txq, sc->tx_ringsz);
+		if (txq->watchdog == 0 && txq->avail < sc->tx_ringsz - 1) {
+			counter_u64_add(txq->tx_watchdog, 1);
+			device_printf(sc->alx_dev,
+			    "watchdog timeout on TX queue %d\n", q);
+			hung = true;
+		}
+		ALX_TX_UNLOCK(txq);
+	}
+
+	/* The ring tasks have to be fenced off, which can't be done here. */
+	if (hung)
+		taskqueue_enqueue(sc->alx_tq, &sc->alx_reset_task);
 }
 
-static int
-alx_intr_legacy(void *arg)
+/*
+ * Recover from a wedged ring without touching the PHY or resetting the MAC:
+ * stop the DMA engines, rebuild the rings in place and reload the ring
+ * pointers. ALX_SRAM_LOAD_PTR rewinds every ring, so the healthy TX rings
+ * are drained first and only lose frames the chip hadn't fetched yet. The
+ * RFDs keep their buffers and are simply posted again. If this doesn't stick
+ * the whole chip is reset. alx_reset_task() has the interrupts masked and the
+ * ring tasks fenced off by the time we get here.
+ */
+static void
+alx_recover(struct alx_softc *sc)
 {
-	struct alx_softc *sc;
 	struct alx_hw *hw;
-	uint32_t intr;
+	struct ifnet *ifp;
+	struct alx_tx_queue *txq;
+	struct alx_rx_queue *rxq;
+	struct alx_buffer *tx_buf;
+	int i, q;
+
+	ALX_LOCK_ASSERT(sc);
 
-	sc = arg;
 	hw = &sc->hw;
+	ifp = sc->alx_ifp;
 
-	ALX_MEM_R32(hw, ALX_ISR, &intr);
-	if (intr & ALX_ISR_DIS || (intr & hw->imask) == 0)
-		return (FILTER_STRAY);
+	if ((ifp->if_drv_flags & IFF_DRV_RUNNING) == 0 ||
+	    ALX_FLAG(sc, TESTING))
+		return;
 
-#if 0
-	printf("intr is 0x%x, imask is 0x%x\n", intr, hw->imask);
+#ifdef DEV_NETMAP
+	/* The rings belong to netmap; let alx_init_locked() rebuild them. */
+	if ((ifp->if_capenable & IFCAP_NETMAP) != 0)
+		goto reset;
 #endif
+	if (sc->alx_recover_time != 0 &&
+	    ticks - sc->alx_recover_time < ALX_RECOVER_INTERVAL * hz)
+		goto reset;
+	sc->alx_recover_time = ticks;
 
-	/* Acknowledge and disable interrupts. */
-	ALX_MEM_W32(hw, ALX_ISR, intr | ALX_ISR_DIS);
-
-	intr &= hw->imask;
-	if (intr & ALX_ISR_PHY) {
-		hw->imask &= ~ALX_ISR_PHY;
-		ALX_MEM_W32(hw, ALX_IMR, hw->imask);
-		taskqueue_enqueue(sc->alx_tq, &sc->alx_link_task);
+	ifp->if_drv_flags |= IFF_DRV_OACTIVE;
+	alx_intr_disable(sc);
+	if (alx_stop_mac(hw) != 0)
+		goto reset;
+
+	for (q = 0; q < sc->nr_txq; q++) {
+		txq = &sc->alx_tx_queue[q];
+		ALX_TX_LOCK(txq);
+		alx_txeof(sc, txq, sc->tx_ringsz);
+		for (i = 0; i < sc->tx_ringsz; i++) {
+			tx_buf = &txq->bf_info[i];
+			if ((tx_buf->flags & ALX_BUF_TX_BOUNCE) != 0) {
+				tx_buf->flags = 0;
+				counter_u64_add(txq->tx_drops, 1);
+			}
+			if (tx_buf->m == NULL)
+				continue;
+			bus_dmamap_sync(sc->alx_tx_buf_tag, tx_buf->dmamap,
+			    BUS_DMASYNC_POSTWRITE);
+			bus_dmamap_unload(sc->alx_tx_buf_tag, tx_buf->dmamap);
+			m_freem(tx_buf->m);
+			tx_buf->m = NULL;
+			counter_u64_add(txq->tx_drops, 1);
+		}
+		txq->pidx = 0;
+		txq->cidx = 0;
+		txq->avail = sc->tx_ringsz - 1;
+		txq->pending = 0;
+		txq->oactive = false;
+		txq->watchdog = 0;
+		txq->bounce_next = 0;
+		txq->bounce_used = 0;
+		ALX_TX_UNLOCK(txq);
 	}
 
-	if (intr & (ALX_ISR_TX_Q0 | ALX_ISR_RX_Q0))
-		taskqueue_enqueue(sc->alx_tq, &sc->alx_int_task);
+	rxq = &sc->alx_rx_queue[0];
+	ALX_RX_LOCK(rxq);
+	bzero(rxq->rrd_hdr, sc->rx_ringsz * sizeof(struct rrd_desc));
+	rxq->pidx = 0;
+	rxq->cidx = 0;
+	alx_rx_refill(sc, rxq);
+	ALX_RX_UNLOCK(rxq);
 
-	ALX_MEM_W32(hw, ALX_ISR, 0);
+	ALX_MEM_W32(hw, ALX_SRAM9, ALX_SRAM_LOAD_PTR);
+	if (hw->link_up)
+		alx_start_mac(hw);
+	ifp->if_drv_flags &= ~IFF_DRV_OACTIVE;
+	alx_intr_enable(sc);
 
-	return (FILTER_HANDLED);
+	sc->alx_ring_resets++;
+	device_printf(sc->alx_dev, "rings reset\n");
+
+	for (q = 0; q < sc->nr_txq; q++)
+		taskqueue_enqueue(sc->alx_tx_queue[q].tq,
+		    &sc->alx_tx_queue[q].start_task);
+	return;
+
+reset:
+	sc->alx_chip_resets++;
+	device_printf(sc->alx_dev, "resetting the chip\n");
+	alx_stop(sc);
+	alx_init_locked(sc);
 }
 
-static int
-alx_intr_msi(void *arg)
+static void
+alx_reset_task(void *arg, int pending __unused)
 {
 	struct alx_softc *sc;
-	struct alx_hw *hw;
-	uint32_t intr;
 
 	sc = arg;
-	hw = &sc->hw;
-
-	ALX_MEM_R32(hw, ALX_ISR, &intr);
-
-	ALX_MEM_W32(hw, ALX_ISR, intr | ALX_ISR_DIS);
 
-	intr &= hw->imask;
-	if (intr & ALX_ISR_PHY) {
-		hw->imask &= ~ALX_ISR_PHY;
-		ALX_MEM_W32(hw, ALX_IMR, hw->imask);
-		taskqueue_enqueue(sc->alx_tq, &sc->alx_link_task);
+	ALX_LOCK(sc);
+	if ((sc->alx_ifp->if_drv_flags & IFF_DRV_RUNNING) == 0 ||
+	    ALX_FLAG(sc, TESTING)) {
+		ALX_UNLOCK(sc);
+		return;
 	}
+	ALX_FLAG_SET(sc, HALT);
+	alx_intr_disable(sc);
+	ALX_UNLOCK(sc);
 
-	ALX_MEM_W32(hw, ALX_ISR, 0);
+	alx_tasks_fence(sc, false);
 
-	return (FILTER_HANDLED);
+	ALX_LOCK(sc);
+	ALX_FLAG_CLEAR(sc, HALT);
+	alx_recover(sc);
+	ALX_UNLOCK(sc);
 }
 
-static int
-alx_alloc_intr(struct alx_softc *sc)
+static void
+alx_task_fence(struct taskqueue *tq, struct task *task)
 {
-	device_t dev;
-	driver_filter_t *filter;
-	struct alx_hw *hw;
-	uint32_t msi_ctrl;
-	int rid, error, nmsi;
 
-	dev = sc->alx_dev;
-	hw = &sc->hw;
+	/* Only wait for a task that is running. */
+	if (taskqueue_cancel(tq, task, NULL) != 0)
+		taskqueue_drain(tq, task);
+}
 
-	rid = 0; /* For legacy INTx interrupts. */
-	filter = alx_intr_legacy;
+/*
+ * Wait for the interrupt tasks to finish and throw away any that are still
+ * queued. The caller has masked the interrupts and made alx_tasks_halted()
+ * true so that the tasks don't requeue themselves or unmask anything, and
+ * turns the interrupts back on when it is done. This may be called from a
+ * task on alx_tq, which is why queued tasks are cancelled, not drained. With
+ * swq set the tasks feeding the RX software queues to the stack go as well.
+ */
+static void
+alx_tasks_fence(struct alx_softc *sc, bool swq)
+{
+	struct alx_vec *vec;
+	struct alx_rx_queue *rxq;
+	int i;
 
-	if (alx_enable_msi) {
-		nmsi = 1;
-		msi_ctrl = FIELDX(ALX_MSI_RETRANS_TM, hw->imt >> 1);
-		if (pci_alloc_msi(dev, &nmsi) == 0 && nmsi == 1) {
-			rid = 1;
-			ALX_MEM_W32(hw, ALX_MSI_RETRANS_TIMER,
-			    msi_ctrl | ALX_MSI_MASK_SEL_LINE);
-			ALX_FLAG_SET(sc, USING_MSI);
-			filter = alx_intr_msi;
-		} else
-			device_printf(dev,
-		    "could not allocate MSI message, falling back to INTx\n");
+	ALX_UNLOCK_ASSERT(sc);
+
+	alx_task_fence(sc->alx_tq, &sc->alx_int_task);
+	for (i = 0; i < sc->nr_vec; i++) {
+		vec = &sc->alx_vec[i];
+		if (vec->tq != NULL)
+			alx_task_fence(vec->tq, &vec->task);
+	}
+	if (!swq)
+		return;
+	for (i = 0; i < sc->nr_rxq; i++) {
+		rxq = &sc->alx_rx_queue[i];
+		if (rxq->swq_tq != NULL)
+			alx_task_fence(rxq->swq_tq, &rxq->swq_task);
 	}
+}
 
-	if (!ALX_FLAG(sc, USING_MSIX) && !ALX_FLAG(sc, USING_MSI))
-		ALX_MEM_W32(hw, ALX_MSI_RETRANS_TIMER, 0);
+/*
+ * Tell the interrupt tasks to stand down; see alx_tasks_fence(). The poll
+ * handler owns the rings while polling is on.
+ */
+static bool
+alx_tasks_halted(struct alx_softc *sc)
+{
 
-	sc->nr_txq = 1;
-	sc->nr_rxq = 1; // XXX needed?
-	sc->nr_vec = 1;
-	sc->nr_hwrxq = 1;
+#ifdef DEVICE_POLLING
+	if ((sc->alx_ifp->if_capenable & IFCAP_POLLING) != 0)
+		return (true);
+#endif
+	return (ALX_FLAG(sc, HALT));
+}
 
-	sc->alx_irq = bus_alloc_resource_any(dev, SYS_RES_IRQ, &rid,
-	    RF_ACTIVE | RF_SHAREABLE);
-	if (sc->alx_irq == NULL) {
-		device_printf(dev, "cannot allocate IRQ\n");
-		return (ENXIO);
-	}
+/*
+ * Packet and byte counts come from the per-queue counters, errors and
+ * collisions from the MAC. hw->stats is read without the softc lock, so a
+ * value may be a tick old.
+ */
+static uint64_t
+alx_get_counter(struct ifnet *ifp, ift_counter cnt)
+{
+	struct alx_softc *sc;
+	struct alx_hw_stats *stats;
+	struct alx_rx_queue *rxq;
+	struct alx_tx_queue *txq;
+	uint64_t val;
+	int q;
 
-	error = bus_setup_intr(dev, sc->alx_irq, INTR_TYPE_NET | INTR_MPSAFE,
-	    filter, NULL, sc, &sc->alx_cookie);
-	if (error != 0) {
-		device_printf(dev, "failed to register interrupt handler\n");
-		return (ENXIO);
+	sc = ifp->if_softc;
+	stats = &sc->hw.stats;
+
+	val = 0;
+	switch (cnt) {
+	case IFCOUNTER_IPACKETS:
+		for (q = 0; q < sc->nr_rxq; q++)
+			val += counter_u64_fetch(
+			    sc->alx_rx_queue[q].rx_packets);
+		return (val);
+	case IFCOUNTER_IBYTES:
+		for (q = 0; q < sc->nr_rxq; q++)
+			val += counter_u64_fetch(sc->alx_rx_queue[q].rx_bytes);
+		return (val);
+	case IFCOUNTER_OPACKETS:
+		for (q = 0; q < sc->nr_txq; q++)
+			val += counter_u64_fetch(
+			    sc->alx_tx_queue[q].tx_packets);
+		return (val);
+	case IFCOUNTER_OBYTES:
+		for (q = 0; q < sc->nr_txq; q++)
+			val += counter_u64_fetch(sc->alx_tx_queue[q].tx_bytes);
+		return (val);
+	case IFCOUNTER_IMCASTS:
+		return (stats->rx_mcast);
+	case IFCOUNTER_OMCASTS:
+		return (stats->tx_mcast);
+	case IFCOUNTER_COLLISIONS:
+		return (stats->tx_single_col + stats->tx_multi_col +
+		    stats->tx_late_col + stats->tx_abort_col);
+	case IFCOUNTER_IERRORS:
+		/* These cover the frames alx_rxintr() drops for RRD errors. */
+		val = stats->rx_frag + stats->rx_fcs_err + stats->rx_len_err +
+		    stats->rx_ov_sz + stats->rx_align_err;
+		break;
+	case IFCOUNTER_OERRORS:
+		val = stats->tx_late_col + stats->tx_abort_col +
+		    stats->tx_underrun + stats->tx_trunc;
+		break;
+	case IFCOUNTER_IQDROPS:
+		val = stats->rx_ov_rxf + stats->rx_ov_rrd;
+		for (q = 0; q < sc->nr_hwrxq; q++) {
+			rxq = &sc->alx_rx_queue[q];
+			val += counter_u64_fetch(rxq->rx_mbuf_fail);
+		}
+		break;
+	case IFCOUNTER_OQDROPS:
+		for (q = 0; q < sc->nr_txq; q++) {
+			txq = &sc->alx_tx_queue[q];
+			val += counter_u64_fetch(txq->tx_mbuf_fail) +
+			    counter_u64_fetch(txq->tx_drops);
+		}
+		break;
+	default:
+		break;
 	}
 
-	TASK_INIT(&sc->alx_int_task, 0, alx_int_task, sc);
-	TASK_INIT(&sc->alx_link_task, 0, alx_link_task, sc);
-	sc->alx_tq = taskqueue_create_fast("alx_taskq", M_WAITOK,
-	    taskqueue_thread_enqueue, &sc->alx_tq);
-	if (sc->alx_tq == NULL) {
-		device_printf(dev, "could not create taskqueue\n");
-		return (ENXIO);
-	}
-	taskqueue_start_threads(&sc->alx_tq, 1, PI_NET, "%s taskq",
-	    device_get_nameunit(sc->alx_dev));
+	/* The stack and the driver count some drops and errors themselves. */
+	return (val + if_get_counter_default(ifp, cnt));
+}
 
-	return (0);
+static void
+alx_hist_add(struct alx_hist *h, uint64_t val)
+{
+	int b;
+
+	b = val == 0 ? 0 : flsll(val);
+	if (b >= ALX_HIST_BUCKETS)
+		b = ALX_HIST_BUCKETS - 1;
+	h->bucket[b]++;
 }
 
+/*
+ * Account for the time between an interrupt and the start of its task. A
+ * task requeued to finish its work has no interrupt time.
+ */
 static void
-alx_free_intr(struct alx_softc *sc)
+alx_intr_delay(struct alx_softc *sc, struct alx_vec *vec)
+{
+
+	if (vec->intr_time == 0)
+		return;
+	if (sc->alx_hist_enable)
+		alx_hist_add(&vec->intr_delay,
+		    sbttous(sbinuptime() - vec->intr_time));
+	vec->intr_time = 0;
+}
+
+static void
+alx_int_task(void *context, int pending __unused)
+{
+	struct alx_softc *sc;
+	struct alx_rx_queue *rxq;
+	struct alx_tx_queue *txq;
+	bool more;
+	int q;
+
+#if 0
+	printf("in alx_int_task\n");
+#endif
+
+	sc = context;
+	if (alx_tasks_halted(sc))
+		return;
+	SDT_PROBE2(alx, , , task__start, sc, 0);
+	alx_intr_delay(sc, &sc->alx_vec[0]);
+
+	/* XXX check isr? */
+	more = false;
+	for (q = 0; q < sc->nr_hwrxq; q++) {
+		rxq = &sc->alx_rx_queue[q];
+		ALX_RX_LOCK(rxq);
+		if (alx_rxintr(sc, rxq, sc->alx_rx_process_limit) ==
+		    sc->alx_rx_process_limit)
+			more = true;
+		ALX_RX_UNLOCK(rxq);
+	}
+	for (q = 0; q < sc->nr_txq; q++) {
+		txq = &sc->alx_tx_queue[q];
+		ALX_TX_LOCK(txq);
+		more |= alx_txintr(sc, txq, sc->alx_tx_process_limit);
+		ALX_TX_UNLOCK(txq);
+	}
+
+	if ((sc->alx_ifp->if_drv_flags & IFF_DRV_RUNNING) == 0 ||
+	    alx_tasks_halted(sc))
+		return;
+
+	alx_imod_update(sc);
+
+	/*
+	 * Come back for the rest if we ran out of budget, leaving the queue
+	 * interrupts masked until the rings have been drained.
+	 */
+	if (more)
+		taskqueue_enqueue(sc->alx_tq, &sc->alx_int_task);
+	else
+		alx_intr_enable(sc);
+	SDT_PROBE3(alx, , , task__done, sc, 0, more);
+}
+
+#ifdef DEVICE_POLLING
+static int
+alx_poll(struct ifnet *ifp, enum poll_cmd cmd, int count)
+{
+	struct alx_softc *sc;
+	struct alx_hw *hw;
+	struct alx_rx_queue *rxq;
+	struct alx_tx_queue *txq;
+	uint32_t intr;
+	int q, rx_npkts;
+
+	sc = ifp->if_softc;
+	hw = &sc->hw;
+	rx_npkts = 0;
+
+	if ((ifp->if_drv_flags & IFF_DRV_RUNNING) == 0 ||
+	    ALX_FLAG(sc, HALT))
+		return (rx_npkts);
+
+	if (cmd == POLL_AND_CHECK_STATUS) {
+		ALX_MEM_R32(hw, ALX_ISR, &intr);
+		intr &= hw->imask & ~ALX_ISR_ALL_QUEUES;
+		ALX_MEM_W32(hw, ALX_ISR, intr);
+		if (intr & ALX_ISR_PHY)
+			taskqueue_enqueue(sc->alx_tq, &sc->alx_link_task);
+	}
+
+	for (q = 0; q < sc->nr_hwrxq; q++) {
+		rxq = &sc->alx_rx_queue[q];
+		ALX_RX_LOCK(rxq);
+		rx_npkts += alx_rxintr(sc, rxq, count);
+		ALX_RX_UNLOCK(rxq);
+	}
+	for (q = 0; q < sc->nr_txq; q++) {
+		txq = &sc->alx_tx_queue[q];
+		ALX_TX_LOCK(txq);
+		alx_txintr(sc, txq, sc->alx_tx_process_limit);
+		ALX_TX_UNLOCK(txq);
+	}
+
+	return (rx_npkts);
+}
+#endif /* DEVICE_POLLING */
+
+/*
+ * The link state machine. The PHY is only read here, under the MDIO lock
+ * alone, so a slow MDIO transaction never holds up anything behind alx_mtx.
+ * A PHY interrupt costs a single ISR read unless it reports a link change;
+ * otherwise the cached state stands. While autonegotiation is in progress
+ * alx_tick() also runs this once a second, in case an interrupt goes missing.
+ */
+static void
+alx_link_task(void *arg, int pending __unused)
+{
+	struct alx_softc *sc;
+	struct alx_hw *hw;
+	bool link_up, rescan;
+	int error;
+	uint16_t isr, speed;
+
+	sc = arg;
+	hw = &sc->hw;
+
+	/* Reading the ISR acks the interrupt. */
+	error = alx_read_phy_reg(hw, ALX_MII_ISR, &isr);
+	rescan = error != 0 ||
+	    (isr & (ALX_ISR_LINK_UP | ALX_ISR_LINK_DOWN)) != 0 ||
+	    sc->alx_link_state == ALX_LSTATE_ANEG;
+	if (rescan) {
+		error = alx_get_phy_link(hw, &link_up, &speed);
+		if (error == 0 && !link_up)
+			speed = 0;
+	}
+
+	ALX_LOCK(sc);
+
+	ALX_IMR_LOCK(sc);
+	hw->imask |= ALX_ISR_PHY;
+#ifdef DEVICE_POLLING
+	if ((sc->alx_ifp->if_capenable & IFCAP_POLLING) == 0)
+#endif
+		alx_imr_write(sc);
+	ALX_IMR_UNLOCK(sc);
+
+	if (rescan && error == 0) {
+		sc->alx_phy_link = link_up;
+		sc->alx_phy_speed = speed;
+		alx_update_link(sc);
+	}
+
+	ALX_UNLOCK(sc);
+}
+
+/*
+ * Have alx_link_task() find out what the PHY is doing, now and then once a
+ * second until the link comes up.
+ */
+static void
+alx_link_kick(struct alx_softc *sc)
+{
+
+	ALX_LOCK_ASSERT(sc);
+
+	sc->alx_link_state = ALX_LSTATE_ANEG;
+	taskqueue_enqueue(sc->alx_tq, &sc->alx_link_task);
+}
+
+static int
+alx_intr_legacy(void *arg)
+{
+	struct alx_softc *sc;
+	struct alx_hw *hw;
+	uint32_t intr;
+
+	sc = arg;
+	hw = &sc->hw;
+
+	ALX_MEM_R32(hw, ALX_ISR, &intr);
+	if (intr & ALX_ISR_DIS || (intr & hw->imask) == 0)
+		return (FILTER_STRAY);
+	SDT_PROBE2(alx, , , intr__filter, sc, intr);
+
+#if 0
+	printf("intr is 0x%x, imask is 0x%x\n", intr, hw->imask);
+#endif
+
+	/* Acknowledge and disable interrupts. */
+	ALX_MEM_W32(hw, ALX_ISR, intr | ALX_ISR_DIS);
+
+	alx_intr_ack(sc, intr);
+
+	ALX_MEM_W32(hw, ALX_ISR, 0);
+
+	return (FILTER_HANDLED);
+}
+
+/*
+ * Mask what the legacy and MSI filters hand off to the tasks: the PHY
+ * interrupt until alx_link_task() has run, and the queue interrupts until
+ * alx_int_task() has caught up.
+ */
+static void
+alx_intr_ack(struct alx_softc *sc, uint32_t intr)
+{
+	struct alx_hw *hw;
+
+	hw = &sc->hw;
+
+	ALX_IMR_LOCK(sc);
+	intr &= hw->imask;
+	if (intr & ALX_ISR_PHY)
+		hw->imask &= ~ALX_ISR_PHY;
+	if (intr & ALX_ISR_ALL_QUEUES)
+		sc->alx_int_masked = true;
+	if (intr & (ALX_ISR_PHY | ALX_ISR_ALL_QUEUES))
+		alx_imr_write(sc);
+	ALX_IMR_UNLOCK(sc);
+
+	if (intr & ALX_ISR_PHY)
+		taskqueue_enqueue(sc->alx_tq, &sc->alx_link_task);
+	if (intr & ALX_ISR_ALL_QUEUES) {
+		if (sc->alx_hist_enable)
+			sc->alx_vec[0].intr_time = sbinuptime();
+		taskqueue_enqueue(sc->alx_tq, &sc->alx_int_task);
+	}
+}
+
+static int
+alx_intr_msi(void *arg)
+{
+	struct alx_softc *sc;
+	struct alx_hw *hw;
+	uint32_t intr;
+
+	sc = arg;
+	hw = &sc->hw;
+
+	ALX_MEM_R32(hw, ALX_ISR, &intr);
+	SDT_PROBE2(alx, , , intr__filter, sc, intr);
+
+	ALX_MEM_W32(hw, ALX_ISR, intr | ALX_ISR_DIS);
+
+	alx_intr_ack(sc, intr);
+
+	ALX_MEM_W32(hw, ALX_ISR, 0);
+
+	return (FILTER_HANDLED);
+}
+
+static int
+alx_intr_msix_misc(void *arg)
+{
+	struct alx_softc *sc;
+	struct alx_hw *hw;
+	uint32_t intr;
+
+	sc = arg;
+	hw = &sc->hw;
+
+	/* Mask the vector to acknowledge the interrupt. */
+	alx_mask_msix(hw, 0, true);
+
+	ALX_MEM_R32(hw, ALX_ISR, &intr);
+	intr &= hw->imask & ~ALX_ISR_ALL_QUEUES;
+	SDT_PROBE2(alx, , , intr__filter, sc, intr);
+	if (intr & ALX_ISR_PHY) {
+		ALX_IMR_LOCK(sc);
+		hw->imask &= ~ALX_ISR_PHY;
+		alx_imr_write(sc);
+		ALX_IMR_UNLOCK(sc);
+		taskqueue_enqueue(sc->alx_tq, &sc->alx_link_task);
+	}
+
+	ALX_MEM_W32(hw, ALX_ISR, intr);
+	alx_mask_msix(hw, 0, false);
+
+	return (FILTER_HANDLED);
+}
+
+static int
+alx_intr_msix_ring(void *arg)
+{
+	struct alx_vec *vec;
+	struct alx_hw *hw;
+
+	vec = arg;
+	hw = &vec->sc->hw;
+
+	/*
+	 * Mask the vector and clear its status bits. The vector is unmasked
+	 * again once its task has finished with the rings.
+	 */
+	alx_mask_msix(hw, vec->vec_idx, true);
+	ALX_MEM_W32(hw, ALX_ISR, vec->vec_mask);
+	SDT_PROBE2(alx, , , intr__filter, vec->sc, vec->vec_mask);
+
+	if (vec->sc->alx_hist_enable)
+		vec->intr_time = sbinuptime();
+	taskqueue_enqueue(vec->tq, &vec->task);
+
+	return (FILTER_HANDLED);
+}
+
+static void
+alx_msix_task(void *arg, int pending __unused)
+{
+	struct alx_vec *vec;
+	struct alx_softc *sc;
+	struct alx_rx_queue *rxq;
+	bool more;
+
+	vec = arg;
+	sc = vec->sc;
+	if (alx_tasks_halted(sc))
+		return;
+	SDT_PROBE2(alx, , , task__start, sc, vec->vec_idx);
+	alx_intr_delay(sc, vec);
+
+	/* Only the vector the RX interrupts are routed to scans the ring. */
+	more = false;
+	if (vec->hwrxq != NULL) {
+		rxq = vec->hwrxq;
+		ALX_RX_LOCK(rxq);
+		if (alx_rxintr(sc, rxq, sc->alx_rx_process_limit) ==
+		    sc->alx_rx_process_limit)
+			more = true;
+		ALX_RX_UNLOCK(rxq);
+	}
+	if (vec->txq != NULL) {
+		ALX_TX_LOCK(vec->txq);
+		more |= alx_txintr(sc, vec->txq, sc->alx_tx_process_limit);
+		ALX_TX_UNLOCK(vec->txq);
+	}
+
+	if ((sc->alx_ifp->if_drv_flags & IFF_DRV_RUNNING) == 0 ||
+	    alx_tasks_halted(sc))
+		return;
+
+	alx_imod_update(sc);
+
+	/* Keep the vector masked until we've caught up. */
+	if (more)
+		taskqueue_enqueue(vec->tq, &vec->task);
+	else
+		alx_mask_msix(&sc->hw, vec->vec_idx, false);
+	SDT_PROBE3(alx, , , task__done, sc, vec->vec_idx, more);
+}
+
+/*
+ * Route queue interrupts to their vectors: TX queue i is serviced by vector
+ * i + 1, and all other events go to vector 0. There is a single hardware RX
+ * ring, so the interrupts of every RX queue go to its vector, vector 1.
+ */
+static void
+alx_map_msix(struct alx_softc *sc)
+{
+	struct alx_hw *hw;
+	uint32_t tbl[2];
+	int i;
+
+	hw = &sc->hw;
+	tbl[0] = tbl[1] = 0;
+
+	if (ALX_FLAG(sc, USING_MSIX)) {
+		for (i = 0; i < sc->nr_txq; i++)
+			tbl[alx_txq_vec_map[i][0]] |=
+			    (uint32_t)(i + 1) << alx_txq_vec_map[i][1];
+		for (i = 0; i < sc->nr_rxq; i++)
+			tbl[alx_rxq_vec_map[i][0]] |=
+			    (uint32_t)1 << alx_rxq_vec_map[i][1];
+	}
+
+	ALX_MEM_W32(hw, ALX_MSI_MAP_TBL1, tbl[0]);
+	ALX_MEM_W32(hw, ALX_MSI_MAP_TBL2, tbl[1]);
+	ALX_MEM_W32(hw, ALX_MSI_ID_MAP, 0);
+}
+
+/*
+ * Allocate one MSI-X vector for miscellaneous events plus one for each RX/TX
+ * queue pair. Each queue vector gets its own taskqueue thread, bound to the
+ * same CPU as the interrupt.
+ */
+static int
+alx_alloc_msix(struct alx_softc *sc)
+{
+	device_t dev;
+	struct alx_vec *vec;
+	cpuset_t cpus;
+	int cpu, error, i, j, nvec, q, rid;
+
+	dev = sc->alx_dev;
+
+	nvec = min(pci_msix_count(dev), ALX_MAX_MSIX_INTRS);
+	nvec = min(nvec, max(sc->nr_rxq, sc->nr_txq) + 1);
+	if (nvec < 2)
+		return (ENXIO);
+	if (pci_alloc_msix(dev, &nvec) != 0)
+		return (ENXIO);
+	if (nvec < 2) {
+		pci_release_msi(dev);
+		return (ENXIO);
+	}
+
+	ALX_FLAG_SET(sc, USING_MSIX);
+	sc->nr_vec = nvec;
+	sc->nr_rxq = min(sc->nr_rxq, nvec - 1);
+	sc->nr_txq = min(sc->nr_txq, nvec - 1);
+
+	for (i = 0; i < nvec; i++) {
+		vec = &sc->alx_vec[i];
+		vec->sc = sc;
+		vec->vec_idx = i;
+
+		rid = i + 1;
+		vec->irq = bus_alloc_resource_any(dev, SYS_RES_IRQ, &rid,
+		    RF_ACTIVE);
+		if (vec->irq == NULL) {
+			device_printf(dev, "cannot allocate MSI-X vector %d\n",
+			    i);
+			return (ENXIO);
+		}
+
+		if (i == 0) {
+			error = bus_setup_intr(dev, vec->irq,
+			    INTR_TYPE_NET | INTR_MPSAFE, alx_intr_msix_misc,
+			    NULL, sc, &vec->cookie);
+			if (error != 0) {
+				device_printf(dev,
+				    "failed to register interrupt handler\n");
+				return (ENXIO);
+			}
+			bus_describe_intr(dev, vec->irq, vec->cookie, "misc");
+			continue;
+		}
+
+		q = i - 1;
+		if (q < sc->nr_rxq)
+			vec->rxq = &sc->alx_rx_queue[q];
+		if (q == 0) {
+			/* See alx_map_msix(). */
+			vec->hwrxq = &sc->alx_rx_queue[0];
+			for (j = 0; j < sc->nr_rxq; j++)
+				vec->vec_mask |= alx_rxq_isr[j];
+		}
+		if (q < sc->nr_txq) {
+			vec->txq = &sc->alx_tx_queue[q];
+			vec->vec_mask |= alx_txq_isr[q];
+		}
+
+		TASK_INIT(&vec->task, 0, alx_msix_task, vec);
+		vec->tq = taskqueue_create_fast("alx_vecq", M_WAITOK,
+		    taskqueue_thread_enqueue, &vec->tq);
+		if (vec->tq == NULL) {
+			device_printf(dev, "could not create taskqueue\n");
+			return (ENXIO);
+		}
+		if (vec->rxq != NULL)
+			vec->rxq->swq_tq = vec->tq;
+		if (vec->txq != NULL)
+			vec->txq->tq = vec->tq;
+
+		error = bus_setup_intr(dev, vec->irq,
+		    INTR_TYPE_NET | INTR_MPSAFE, alx_intr_msix_ring, NULL, vec,
+		    &vec->cookie);
+		if (error != 0) {
+			device_printf(dev,
+			    "failed to register interrupt handler\n");
+			return (ENXIO);
+		}
+		bus_describe_intr(dev, vec->irq, vec->cookie, "q%d", q);
+
+		cpu = q % mp_ncpus;
+		if (bus_bind_intr(dev, vec->irq, cpu) != 0)
+			device_printf(dev, "could not bind vector %d to CPU %d\n",
+			    i, cpu);
+		CPU_SETOF(cpu, &cpus);
+		taskqueue_start_threads_cpuset(&vec->tq, 1, PI_NET, &cpus,
+		    "%s q%d", device_get_nameunit(dev), q);
+	}
+
+	return (0);
+}
+
+static int
+alx_alloc_intr(struct alx_softc *sc)
+{
+	device_t dev;
+	driver_filter_t *filter;
+	struct alx_hw *hw;
+	uint32_t msi_ctrl;
+	int rid, error, nmsi, i;
+
+	dev = sc->alx_dev;
+	hw = &sc->hw;
+
+	sc->nr_vec = 1;
+
+	/* Each TX queue has its own TPD priority ring. */
+	sc->nr_txq = 1;
+	if (ALX_CAP(hw, MTQ)) {
+		sc->nr_txq = alx_tx_queues > 0 ? alx_tx_queues : mp_ncpus;
+		sc->nr_txq = min(sc->nr_txq, ALX_MAX_TX_QUEUES);
+	}
+
+	/*
+	 * The RSS queue is reported in each RRD, but the chip only has a
+	 * single RFD/RRD ring pair: frames for the other queues are steered to
+	 * them in software.
+	 */
+	sc->nr_hwrxq = 1;
+	sc->nr_rxq = 1;
+	if (ALX_CAP(hw, RSS)) {
+		sc->nr_rxq = alx_rx_queues > 0 ? alx_rx_queues : mp_ncpus;
+		sc->nr_rxq = min(sc->nr_rxq, ALX_MAX_RX_QUEUES);
+	}
+
+	TASK_INIT(&sc->alx_int_task, 0, alx_int_task, sc);
+	TASK_INIT(&sc->alx_link_task, 0, alx_link_task, sc);
+	TASK_INIT(&sc->alx_reset_task, 0, alx_reset_task, sc);
+	sc->alx_tq = taskqueue_create_fast("alx_taskq", M_WAITOK,
+	    taskqueue_thread_enqueue, &sc->alx_tq);
+	if (sc->alx_tq == NULL) {
+		device_printf(dev, "could not create taskqueue\n");
+		return (ENXIO);
+	}
+
+	for (i = 0; i < ALX_MAX_RX_QUEUES; i++) {
+		sc->alx_rx_queue[i].sc = sc;
+		sc->alx_rx_queue[i].swq_tq = sc->alx_tq;
+		TASK_INIT(&sc->alx_rx_queue[i].swq_task, 0, alx_swq_task,
+		    &sc->alx_rx_queue[i]);
+	}
+	for (i = 0; i < ALX_MAX_TX_QUEUES; i++) {
+		sc->alx_tx_queue[i].sc = sc;
+		sc->alx_tx_queue[i].tq = sc->alx_tq;
+		TASK_INIT(&sc->alx_tx_queue[i].start_task, 0, alx_txq_task,
+		    &sc->alx_tx_queue[i]);
+	}
+
+	msi_ctrl = FIELDX(ALX_MSI_RETRANS_TM, hw->imt >> 1);
+
+	if (alx_enable_msix && ALX_CAP(hw, MSIX)) {
+		error = alx_alloc_msix(sc);
+		if (error == 0) {
+			ALX_MEM_W32(hw, ALX_MSI_RETRANS_TIMER, msi_ctrl);
+			taskqueue_start_threads(&sc->alx_tq, 1, PI_NET,
+			    "%s taskq", device_get_nameunit(dev));
+			return (0);
+		}
+		if (ALX_FLAG(sc, USING_MSIX))
+			return (error);
+		device_printf(dev,
+		    "could not allocate MSI-X vectors, falling back to MSI\n");
+	}
+
+	rid = 0; /* For legacy INTx interrupts. */
+	filter = alx_intr_legacy;
+
+	if (alx_enable_msi) {
+		nmsi = 1;
+		if (pci_alloc_msi(dev, &nmsi) == 0 && nmsi == 1) {
+			rid = 1;
+			ALX_MEM_W32(hw, ALX_MSI_RETRANS_TIMER,
+			    msi_ctrl | ALX_MSI_MASK_SEL_LINE);
+			ALX_FLAG_SET(sc, USING_MSI);
+			filter = alx_intr_msi;
+		} else
+			device_printf(dev,
+		    "could not allocate MSI message, falling back to INTx\n");
+	}
+
+	if (!ALX_FLAG(sc, USING_MSIX) && !ALX_FLAG(sc, USING_MSI))
+		ALX_MEM_W32(hw, ALX_MSI_RETRANS_TIMER, 0);
+
+	sc->alx_irq = bus_alloc_resource_any(dev, SYS_RES_IRQ, &rid,
+	    RF_ACTIVE | RF_SHAREABLE);
+	if (sc->alx_irq == NULL) {
+		device_printf(dev, "cannot allocate IRQ\n");
+		return (ENXIO);
+	}
+
+	error = bus_setup_intr(dev, sc->alx_irq, INTR_TYPE_NET | INTR_MPSAFE,
+	    filter, NULL, sc, &sc->alx_cookie);
+	if (error != 0) {
+		device_printf(dev, "failed to register interrupt handler\n");
+		return (ENXIO);
+	}
+
+	taskqueue_start_threads(&sc->alx_tq, sc->nr_rxq, PI_NET, "%s taskq",
+	    device_get_nameunit(sc->alx_dev));
+
+	return (0);
+}
+
+static void
+alx_free_intr(struct alx_softc *sc)
+{
+	device_t dev;
+	struct alx_vec *vec;
+	int i;
+
+	dev = sc->alx_dev;
+
+	if (sc->alx_cookie != NULL)
+		bus_teardown_intr(dev, sc->alx_irq, sc->alx_cookie);
+	for (i = 0; i < sc->nr_vec; i++) {
+		vec = &sc->alx_vec[i];
+		if (vec->cookie != NULL)
+			bus_teardown_intr(dev, vec->irq, vec->cookie);
+	}
+
+	for (i = 0; i < sc->nr_rxq; i++)
+		if (sc->alx_rx_queue[i].swq_tq != NULL)
+			taskqueue_drain(sc->alx_rx_queue[i].swq_tq,
+			    &sc->alx_rx_queue[i].swq_task);
+	for (i = 0; i < sc->nr_txq; i++)
+		if (sc->alx_tx_queue[i].tq != NULL)
+			taskqueue_drain(sc->alx_tx_queue[i].tq,
+			    &sc->alx_tx_queue[i].start_task);
+
+	for (i = 0; i < sc->nr_vec; i++) {
+		vec = &sc->alx_vec[i];
+		if (vec->tq != NULL) {
+			taskqueue_drain(vec->tq, &vec->task);
+			taskqueue_free(vec->tq);
+		}
+		if (vec->irq != NULL)
+			bus_release_resource(dev, SYS_RES_IRQ,
+			    rman_get_rid(vec->irq), vec->irq);
+	}
+
+	if (sc->alx_tq != NULL) {
+		taskqueue_drain(sc->alx_tq, &sc->alx_int_task);
+		taskqueue_drain(sc->alx_tq, &sc->alx_link_task);
+		taskqueue_drain(sc->alx_tq, &sc->alx_reset_task);
+		taskqueue_free(sc->alx_tq);
+	}
+
+	if (sc->alx_irq != NULL)
+		bus_release_resource(dev, SYS_RES_IRQ,
+		    rman_get_rid(sc->alx_irq), sc->alx_irq);
+
+	if (ALX_FLAG(sc, USING_MSI) || ALX_FLAG(sc, USING_MSIX))
+		pci_release_msi(dev);
+}
+
+static int
+alx_media_change(struct ifnet *ifp)
+{
+
+	return (0);
+}
+
+static void
+alx_media_status(struct ifnet *ifp, struct ifmediareq *ifmr)
+{
+	struct alx_softc *sc;
+	struct alx_hw *hw;
+
+	sc = ifp->if_softc;
+	hw = &sc->hw;
+
+	ALX_LOCK(sc);
+
+	ifmr->ifm_status = IFM_AVALID;
+	ifmr->ifm_active = IFM_ETHER;
+
+	if (hw->link_up)
+		ifmr->ifm_status |= IFM_ACTIVE;
+	else {
+		ALX_UNLOCK(sc);
+		return;
+	}
+
+	switch (hw->link_duplex) {
+	case ALX_FULL_DUPLEX:
+		ifmr->ifm_active |= IFM_FDX;
+		break;
+	case ALX_HALF_DUPLEX:
+		ifmr->ifm_active |= IFM_HDX;
+		break;
+	default:
+		device_printf(sc->alx_dev, "invalid duplex mode %u\n",
+		    hw->link_duplex);
+		break;
+	}
+
+	switch (hw->link_speed) {
+	case SPEED_10:
+		ifmr->ifm_active |= IFM_10_T;
+		break;
+	case SPEED_100:
+		ifmr->ifm_active |= IFM_100_TX;
+		break;
+	case SPEED_1000:
+		ifmr->ifm_active |= IFM_1000_T;
+		break;
+	default:
+		device_printf(sc->alx_dev, "invalid link speed %u\n",
+		    hw->link_speed);
+		break;
+	}
+
+	ALX_UNLOCK(sc);
+}
+
+static int
+alx_ioctl(struct ifnet *ifp, u_long command, caddr_t data)
+{
+	struct alx_softc *sc;
+	struct ifreq *ifr;
+	int error = 0, mask;
+
+	sc = ifp->if_softc;
+	ifr = (struct ifreq *)data;
+
+	switch (command) {
+	case SIOCSIFFLAGS:
+		ALX_LOCK(sc);
+		if ((ifp->if_flags & IFF_UP) != 0) {
+			if ((ifp->if_drv_flags & IFF_DRV_RUNNING) != 0) {
+				if (((ifp->if_flags ^ sc->alx_if_flags) &
+				    (IFF_PROMISC | IFF_ALLMULTI)) != 0)
+					alx_rxfilter(sc);
+			} else
+				alx_init_locked(sc);
+		} else if ((ifp->if_drv_flags & IFF_DRV_RUNNING) != 0)
+			alx_stop(sc);
+		sc->alx_if_flags = ifp->if_flags;
+		ALX_UNLOCK(sc);
+		break;
+	case SIOCADDMULTI:
+	case SIOCDELMULTI:
+		ALX_LOCK(sc);
+		if ((ifp->if_drv_flags & IFF_DRV_RUNNING) != 0)
+			alx_rxfilter(sc);
+		ALX_UNLOCK(sc);
+		break;
+	case SIOCGIFMEDIA:
+		error = ifmedia_ioctl(ifp, ifr, &sc->alx_media, command);
+		break;
+	case SIOCSIFMTU:
+		if (ifr->ifr_mtu < ALX_MIN_MTU || ifr->ifr_mtu > ALX_MAX_MTU) {
+			error = EINVAL;
+			break;
+		}
+		ALX_LOCK(sc);
+		if (ifp->if_mtu != ifr->ifr_mtu) {
+			ifp->if_mtu = ifr->ifr_mtu;
+			/* TSO needs the whole frame to fit in the TX FIFO. */
+			if (ifp->if_mtu > ALX_MAX_TSO_PKT_SIZE) {
+				ifp->if_capenable &= ~(IFCAP_TSO4 | IFCAP_TSO6 |
+				    IFCAP_VLAN_HWTSO);
+				ifp->if_hwassist &= ~CSUM_TSO;
+			}
+			if ((ifp->if_drv_flags & IFF_DRV_RUNNING) != 0) {
+				ifp->if_drv_flags &= ~IFF_DRV_RUNNING;
+				alx_init_locked(sc);
+			}
+		}
+		ALX_UNLOCK(sc);
+		VLAN_CAPABILITIES(ifp);
+		break;
+	case SIOCSIFCAP:
+		mask = ifr->ifr_reqcap ^ ifp->if_capenable;
+#ifdef DEVICE_POLLING
+		if (mask & IFCAP_POLLING) {
+			if (ifr->ifr_reqcap & IFCAP_POLLING) {
+				ALX_LOCK(sc);
+				if (ALX_FLAG(sc, TESTING)) {
+					ALX_UNLOCK(sc);
+					error = EBUSY;
+					break;
+				}
+				ifp->if_capenable |= IFCAP_POLLING;
+				alx_intr_disable(sc);
+				ALX_UNLOCK(sc);
+				/*
+				 * alx_poll() must not share the rings and their
+				 * LRO state with a task that is still running.
+				 */
+				alx_tasks_fence(sc, false);
+				error = ether_poll_register(alx_poll, ifp);
+				if (error != 0) {
+					ALX_LOCK(sc);
+					ifp->if_capenable &= ~IFCAP_POLLING;
+					if (ifp->if_drv_flags & IFF_DRV_RUNNING)
+						alx_intr_enable(sc);
+					ALX_UNLOCK(sc);
+					break;
+				}
+			} else {
+				/* This waits for a running poll handler. */
+				error = ether_poll_deregister(ifp);
+				ALX_LOCK(sc);
+				ifp->if_capenable &= ~IFCAP_POLLING;
+				if (ifp->if_drv_flags & IFF_DRV_RUNNING)
+					alx_intr_enable(sc);
+				ALX_UNLOCK(sc);
+			}
+		}
+#endif
+		ALX_LOCK(sc);
+		if ((mask & IFCAP_TXCSUM) != 0 &&
+		    (ifp->if_capabilities & IFCAP_TXCSUM) != 0) {
+			ifp->if_capenable ^= IFCAP_TXCSUM;
+			if ((ifp->if_capenable & IFCAP_TXCSUM) != 0)
+				ifp->if_hwassist |= ALX_CSUM_FEATURES_IPV4;
+			else
+				ifp->if_hwassist &= ~ALX_CSUM_FEATURES_IPV4;
+		}
+		if ((mask & IFCAP_TXCSUM_IPV6) != 0 &&
+		    (ifp->if_capabilities & IFCAP_TXCSUM_IPV6) != 0) {
+			ifp->if_capenable ^= IFCAP_TXCSUM_IPV6;
+			if ((ifp->if_capenable & IFCAP_TXCSUM_IPV6) != 0)
+				ifp->if_hwassist |= ALX_CSUM_FEATURES_IPV6;
+			else
+				ifp->if_hwassist &= ~ALX_CSUM_FEATURES_IPV6;
+		}
+		if ((mask & IFCAP_TSO4) != 0 &&
+		    (ifp->if_capabilities & IFCAP_TSO4) != 0 &&
+		    ifp->if_mtu <= ALX_MAX_TSO_PKT_SIZE) {
+			ifp->if_capenable ^= IFCAP_TSO4;
+			if ((ifp->if_capenable & IFCAP_TSO4) != 0)
+				ifp->if_hwassist |= CSUM_IP_TSO;
+			else
+				ifp->if_hwassist &= ~CSUM_IP_TSO;
+		}
+		if ((mask & IFCAP_TSO6) != 0 &&
+		    (ifp->if_capabilities & IFCAP_TSO6) != 0 &&
+		    ifp->if_mtu <= ALX_MAX_TSO_PKT_SIZE) {
+			ifp->if_capenable ^= IFCAP_TSO6;
+			if ((ifp->if_capenable & IFCAP_TSO6) != 0)
+				ifp->if_hwassist |= CSUM_IP6_TSO;
+			else
+				ifp->if_hwassist &= ~CSUM_IP6_TSO;
+		}
+		if ((mask & IFCAP_RXCSUM) != 0 &&
+		    (ifp->if_capabilities & IFCAP_RXCSUM) != 0)
+			ifp->if_capenable ^= IFCAP_RXCSUM;
+		if ((mask & IFCAP_LRO) != 0 &&
+		    (ifp->if_capabilities & IFCAP_LRO) != 0)
+			ifp->if_capenable ^= IFCAP_LRO;
+		if ((mask & IFCAP_VLAN_HWCSUM) != 0 &&
+		    (ifp->if_capabilities & IFCAP_VLAN_HWCSUM) != 0)
+			ifp->if_capenable ^= IFCAP_VLAN_HWCSUM;
+		if ((mask & IFCAP_VLAN_HWTSO) != 0 &&
+		    (ifp->if_capabilities & IFCAP_VLAN_HWTSO) != 0)
+			ifp->if_capenable ^= IFCAP_VLAN_HWTSO;
+		if ((mask & IFCAP_VLAN_HWTAGGING) != 0 &&
+		    (ifp->if_capabilities & IFCAP_VLAN_HWTAGGING) != 0) {
+			ifp->if_capenable ^= IFCAP_VLAN_HWTAGGING;
+			/* TSO and checksums over VLANs need hardware tagging. */
+			if ((ifp->if_capenable & IFCAP_VLAN_HWTAGGING) == 0)
+				ifp->if_capenable &=
+				    ~(IFCAP_VLAN_HWTSO | IFCAP_VLAN_HWCSUM);
+			alx_rxvlan(sc);
+		}
+		ALX_UNLOCK(sc);
+		VLAN_CAPABILITIES(ifp);
+		break;
+	default:
+		error = ether_ioctl(ifp, command, data);
+		break;
+	}
+
+	return (error);
+}
+
+static void
+alx_init(void *arg)
+{
+	struct alx_softc *sc;
+
+	sc = arg;
+	ALX_LOCK(sc);
+	alx_init_locked(sc);
+	ALX_UNLOCK(sc);
+}
+
+/*
+ * Have the MAC strip VLAN tags on receive if hardware tagging is enabled.
+ */
+static void
+alx_rxvlan(struct alx_softc *sc)
+{
+	struct alx_hw *hw;
+
+	ALX_LOCK_ASSERT(sc);
+
+	hw = &sc->hw;
+	if ((sc->alx_ifp->if_capenable & IFCAP_VLAN_HWTAGGING) != 0)
+		hw->rx_ctrl |= ALX_MAC_CTRL_VLANSTRIP;
+	else
+		hw->rx_ctrl &= ~ALX_MAC_CTRL_VLANSTRIP;
+	ALX_MEM_W32(hw, ALX_MAC_CTRL, hw->rx_ctrl);
+}
+
+/*
+ * Program the promiscuous and all-multicast bits and the multicast hash
+ * table from the interface's flags and multicast list.
+ */
+static void
+alx_rxfilter(struct alx_softc *sc)
+{
+	struct ifnet *ifp;
+	struct alx_hw *hw;
+	struct ifmultiaddr *ifma;
+
+	ALX_LOCK_ASSERT(sc);
+
+	ifp = sc->alx_ifp;
+	hw = &sc->hw;
+
+	hw->rx_ctrl &= ~(ALX_MAC_CTRL_PROMISC_EN | ALX_MAC_CTRL_MULTIALL_EN);
+	if ((ifp->if_flags & IFF_PROMISC) != 0)
+		hw->rx_ctrl |= ALX_MAC_CTRL_PROMISC_EN;
+	if ((ifp->if_flags & (IFF_PROMISC | IFF_ALLMULTI)) != 0) {
+		hw->rx_ctrl |= ALX_MAC_CTRL_MULTIALL_EN;
+		hw->mc_hash[0] = hw->mc_hash[1] = 0xFFFFFFFF;
+	} else {
+		hw->mc_hash[0] = hw->mc_hash[1] = 0;
+		if_maddr_rlock(ifp);
+		TAILQ_FOREACH(ifma, &ifp->if_multiaddrs, ifma_link) {
+			if (ifma->ifma_addr->sa_family != AF_LINK)
+				continue;
+			alx_add_mc_addr(hw,
+			    LLADDR((struct sockaddr_dl *)ifma->ifma_addr));
+		}
+		if_maddr_runlock(ifp);
+	}
+
+	ALX_MEM_W32(hw, ALX_HASH_TBL0, hw->mc_hash[0]);
+	ALX_MEM_W32(hw, ALX_HASH_TBL1, hw->mc_hash[1]);
+	ALX_MEM_W32(hw, ALX_MAC_CTRL, hw->rx_ctrl);
+}
+
+static void
+alx_init_locked(struct alx_softc *sc)
+{
+	struct ifnet *ifp;
+	struct alx_hw *hw;
+
+	ALX_LOCK_ASSERT(sc);
+
+	ifp = sc->alx_ifp;
+	hw = &sc->hw;
+
+	if (ifp->if_drv_flags & IFF_DRV_RUNNING)
+		return;
+
+	alx_stop(sc);
+
+	/* Reset to a known good state. */
+	alx_reset(sc);
+
+	memcpy(hw->mac_addr, IF_LLADDR(ifp), ETHER_ADDR_LEN);
+	alx_set_rxbuf_size(sc);
+	alx_imod_apply(sc);
+	/* This also programs the MAC address, the MTU and moderation. */
+	alx_configure_basic(hw);
+
+	alx_init_rx_ring(sc);
+	alx_init_tx_ring(sc);
+	alx_init_rss(sc);
+	alx_map_msix(sc);
+
+#if 0
+	printf("rfd: 0x%lx, rrd: 0x%lx, txd: 0x%lx\n", sc->alx_rx_queue[0].rfd_dma,
+	    sc->alx_rx_queue[0].rrd_dma, sc->alx_tx_queue[0].tpd_dma);
+#endif
+
+	/* Load the DMA pointers. */
+	ALX_MEM_W32(hw, ALX_SRAM9, ALX_SRAM_LOAD_PTR);
+
+	alx_rxvlan(sc);
+	alx_rxfilter(sc);
+
+	ifp->if_drv_flags |= IFF_DRV_RUNNING;
+	ifp->if_drv_flags &= ~IFF_DRV_OACTIVE;
+
+	/* Don't wait for autonegotiation; the link task starts the MAC. */
+	alx_link_kick(sc);
+
+	ALX_MEM_W32(hw, ALX_ISR, (uint32_t)~ALX_ISR_DIS);
+	alx_intr_enable(sc);
+
+	callout_reset(&sc->alx_tick_ch, hz, alx_tick, sc);
+}
+
+/*
+ * Queue a frame on one of the TX queues, chosen by the frame's flow ID if it
+ * has one so that a flow's frames stay in order.
+ */
+static int
+alx_transmit(struct ifnet *ifp, struct mbuf *m)
+{
+	struct alx_softc *sc;
+	struct alx_tx_queue *txq;
+	int error, q;
+
+	sc = ifp->if_softc;
+
+	if (M_HASHTYPE_GET(m) != M_HASHTYPE_NONE)
+		q = m->m_pkthdr.flowid % sc->nr_txq;
+	else
+		q = curcpu % sc->nr_txq;
+	txq = &sc->alx_tx_queue[q];
+
+	error = drbr_enqueue(ifp, txq->br, m);
+	if (error != 0)
+		return (error);
+
+	if (ALX_TX_TRYLOCK(txq)) {
+		alx_start_locked(ifp, txq);
+		ALX_TX_UNLOCK(txq);
+	} else
+		taskqueue_enqueue(txq->tq, &txq->start_task);
+
+	return (0);
+}
+
+static void
+alx_txq_task(void *arg, int pending __unused)
+{
+	struct alx_tx_queue *txq;
+
+	txq = arg;
+
+	ALX_TX_LOCK(txq);
+	alx_start_locked(txq->sc->alx_ifp, txq);
+	ALX_TX_UNLOCK(txq);
+}
+
+static void
+alx_qflush(struct ifnet *ifp)
+{
+	struct alx_softc *sc;
+	struct alx_tx_queue *txq;
+	int q;
+
+	sc = ifp->if_softc;
+
+	for (q = 0; q < sc->nr_txq; q++) {
+		txq = &sc->alx_tx_queue[q];
+		ALX_TX_LOCK(txq);
+		drbr_flush(ifp, txq->br);
+		ALX_TX_UNLOCK(txq);
+	}
+	if_qflush(ifp);
+}
+
+/*
+ * Transmit all of the frames in a queue's buf_ring.
+ */
+static void
+alx_start_locked(struct ifnet *ifp, struct alx_tx_queue *txq)
+{
+	struct alx_softc *sc;
+	struct mbuf *m_head;
+	int error;
+	bool bounced;
+
+	sc = ifp->if_softc;
+	ALX_TX_LOCK_ASSERT(txq);
+
+	if ((ifp->if_drv_flags & (IFF_DRV_RUNNING | IFF_DRV_OACTIVE)) !=
+	    IFF_DRV_RUNNING || txq->oactive || !sc->hw.link_up ||
+	    ALX_FLAG(sc, TESTING))
+		return;
+
+	while ((m_head = drbr_peek(ifp, txq->br)) != NULL) {
+		/* Reclaim completed descriptors before the ring runs dry. */
+		if (txq->avail < ALX_TX_RECLAIM_THRESH)
+			alx_txeof(sc, txq, sc->tx_ringsz);
+
+		error = alx_xmit(sc, txq, &m_head, &bounced);
+		if (error != 0) {
+			if (m_head == NULL) {
+				/* The frame was dropped; carry on. */
+				if (error == ENOBUFS)
+					counter_u64_add(txq->tx_mbuf_fail, 1);
+				else
+					counter_u64_add(txq->tx_drops, 1);
+				drbr_advance(ifp, txq->br);
+				continue;
+			}
+			drbr_putback(ifp, txq->br, m_head);
+			/* The ring is full; alx_txintr() restarts us. */
+			if (error == ENOBUFS)
+				txq->oactive = true;
+			break;
+		}
+		drbr_advance(ifp, txq->br);
+		counter_u64_add(txq->tx_packets, 1);
+		counter_u64_add(txq->tx_bytes, m_head->m_pkthdr.len);
+
+		/* Let BPF listeners know about this frame. */
+		ETHER_BPF_MTAP(ifp, m_head);
+		/* A bounced frame has been copied out already. */
+		if (bounced)
+			m_freem(m_head);
+
+		/* Don't let a long burst starve the chip. */
+		if (txq->pending >= sc->alx_tx_doorbell_thresh)
+			alx_tx_doorbell(sc, txq);
+	}
+
+	/* This also arms the watchdog; alx_txeof() disarms it. */
+	alx_tx_doorbell(sc, txq);
+}
+
+static int
+alx_sysctl_process_limit(SYSCTL_HANDLER_ARGS)
+{
+	int error, value;
+
+	value = *(int *)arg1;
+	error = sysctl_handle_int(oidp, &value, 0, req);
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+	if (value < 1)
+		return (EINVAL);
+	*(int *)arg1 = value;
+	return (0);
+}
+
+static int
+alx_sysctl_copybreak(SYSCTL_HANDLER_ARGS)
+{
+	int error, value;
+
+	value = *(int *)arg1;
+	error = sysctl_handle_int(oidp, &value, 0, req);
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+	if (value < 0 || value > ALX_RX_COPYBREAK_MAX)
+		return (EINVAL);
+	*(int *)arg1 = value;
+	return (0);
+}
+
+static int
+alx_sysctl_tx_bounce(SYSCTL_HANDLER_ARGS)
+{
+	int error, value;
+
+	value = *(int *)arg1;
+	error = sysctl_handle_int(oidp, &value, 0, req);
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+	if (value < 0 || value > ALX_TX_BOUNCE_SIZE)
+		return (EINVAL);
+	*(int *)arg1 = value;
+	return (0);
+}
+
+/*
+ * Resize the TX rings (arg2 0) or the RX ring (arg2 1). The new rings are
+ * allocated up front, so that a failure leaves the interface as it was, and
+ * are swapped in while the interface is stopped. The LRO sort queues keep the
+ * depth they got at attach time; that only bounds how many frames are batched.
+ */
+static int
+alx_sysctl_ring_size(SYSCTL_HANDLER_ARGS)
+{
+	struct alx_softc *sc;
+	struct alx_rings r;
+	struct ifnet *ifp;
+	int error, q, value;
+
+	sc = arg1;
+	ifp = sc->alx_ifp;
+
+	value = arg2 == 0 ? sc->tx_ringsz : sc->rx_ringsz;
+	error = sysctl_handle_int(oidp, &value, 0, req);
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+	if (value < ALX_RING_MIN ||
+	    value > (arg2 == 0 ? ALX_TX_RING_MAX : ALX_RX_RING_MAX))
+		return (EINVAL);
+
+	bzero(&r, sizeof(r));
+	ALX_LOCK(sc);
+	r.tx_ringsz = arg2 == 0 ? value : sc->tx_ringsz;
+	r.rx_ringsz = arg2 == 0 ? sc->rx_ringsz : value;
+	if (r.tx_ringsz == sc->tx_ringsz && r.rx_ringsz == sc->rx_ringsz) {
+		ALX_UNLOCK(sc);
+		return (0);
+	}
+	/* RESETING keeps other resizes out while the lock is dropped. */
+	if (ALX_FLAG(sc, TESTING) || ALX_FLAG(sc, RESETING))
+		error = EBUSY;
+#ifdef DEV_NETMAP
+	else if ((ifp->if_capenable & IFCAP_NETMAP) != 0)
+		error = EBUSY;
+#endif
+	else
+		ALX_FLAG_SET(sc, RESETING);
+	ALX_UNLOCK(sc);
+	if (error != 0)
+		return (error);
+
+	error = alx_rings_alloc(sc, &r);
+
+	ALX_LOCK(sc);
+	if (error == 0 && ALX_FLAG(sc, TESTING))
+		error = EBUSY;
+	if (error == 0) {
+		if ((ifp->if_drv_flags & IFF_DRV_RUNNING) != 0)
+			alx_stop(sc);
+		/* Completions may still be reaped without the softc lock. */
+		for (q = 0; q < sc->nr_txq; q++)
+			ALX_TX_LOCK(&sc->alx_tx_queue[q]);
+		for (q = 0; q < sc->nr_hwrxq; q++)
+			ALX_RX_LOCK(&sc->alx_rx_queue[q]);
+		alx_rings_swap(sc, &r);
+		for (q = 0; q < sc->nr_hwrxq; q++)
+			ALX_RX_UNLOCK(&sc->alx_rx_queue[q]);
+		for (q = 0; q < sc->nr_txq; q++)
+			ALX_TX_UNLOCK(&sc->alx_tx_queue[q]);
+	}
+#ifdef DEV_NETMAP
+	if (error == 0) {
+		/* netmap sizes its rings at attach time. */
+		ALX_UNLOCK(sc);
+		netmap_detach(ifp);
+		alx_netmap_attach(sc);
+		ALX_LOCK(sc);
+	}
+#endif
+	if (error == 0 && (ifp->if_flags & IFF_UP) != 0)
+		alx_init_locked(sc);
+	ALX_FLAG_CLEAR(sc, RESETING);
+	ALX_UNLOCK(sc);
+
+	/* Release the old rings, or the new ones if we gave up. */
+	alx_rings_free(sc, &r);
+
+	for (q = 0; q < sc->nr_txq; q++)
+		taskqueue_enqueue(sc->alx_tx_queue[q].tq,
+		    &sc->alx_tx_queue[q].start_task);
+
+	return (error);
+}
+
+static int
+alx_sysctl_imod_profile(SYSCTL_HANDLER_ARGS)
+{
+	struct alx_softc *sc;
+	int error, value;
+
+	sc = arg1;
+	value = sc->alx_imod_profile;
+	error = sysctl_handle_int(oidp, &value, 0, req);
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+	if (value < ALX_IMOD_FIXED || value > ALX_IMOD_BULK)
+		return (EINVAL);
+
+	ALX_LOCK(sc);
+	sc->alx_imod_profile = value;
+	alx_imod_apply(sc);
+	ALX_UNLOCK(sc);
+	return (0);
+}
+
+static int
+alx_sysctl_imod_timer(SYSCTL_HANDLER_ARGS)
+{
+	struct alx_softc *sc;
+	int error, value;
+
+	sc = arg1;
+	value = sc->hw.imt;
+	error = sysctl_handle_int(oidp, &value, 0, req);
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+	if (value < 2 || value > ALX_IMT_MAX)
+		return (EINVAL);
+
+	ALX_LOCK(sc);
+	sc->alx_imod_fixed = value;
+	sc->alx_imod_profile = ALX_IMOD_FIXED;
+	alx_imod_apply(sc);
+	ALX_UNLOCK(sc);
+	return (0);
+}
+
+/*
+ * Switch between the power profiles. The interface is reinitialized so that
+ * ASPM and clock gating are set up again; EEE is only advertised by the PHY
+ * after a PHY reset.
+ */
+static int
+alx_sysctl_pm_profile(SYSCTL_HANDLER_ARGS)
+{
+	struct alx_softc *sc;
+	struct alx_hw *hw;
+	struct ifnet *ifp;
+	int error, value;
+
+	sc = arg1;
+	hw = &sc->hw;
+	value = sc->alx_pm_profile;
+	error = sysctl_handle_int(oidp, &value, 0, req);
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+	if (value != ALX_PM_POWERSAVE && value != ALX_PM_LOWLAT)
+		return (EINVAL);
+
+	ALX_LOCK(sc);
+	if (value == sc->alx_pm_profile) {
+		ALX_UNLOCK(sc);
+		return (0);
+	}
+	sc->alx_pm_profile = value;
+	hw->low_latency = value == ALX_PM_LOWLAT;
+
+	ifp = sc->alx_ifp;
+	if ((ifp->if_drv_flags & IFF_DRV_RUNNING) != 0)
+		alx_stop(sc);
+	if (ALX_CAP(hw, AZ)) {
+		alx_reset_phy(hw, !hw->hib_patch);
+		error = alx_setup_speed_duplex(hw, hw->adv_cfg, hw->flowctrl);
+		if (error != 0)
+			device_printf(sc->alx_dev,
+			    "failed to configure PHY with error %d\n", error);
+	}
+	if ((ifp->if_flags & IFF_UP) != 0)
+		alx_init_locked(sc);
+	ALX_UNLOCK(sc);
+
+	return (0);
+}
+
+/*
+ * Turn the histograms on or off. They start out empty each time they're
+ * turned on.
+ */
+static int
+alx_sysctl_hist_enable(SYSCTL_HANDLER_ARGS)
 {
-	device_t dev;
+	struct alx_softc *sc;
+	int error, i, value;
 
-	dev = sc->alx_dev;
+	sc = arg1;
+	value = sc->alx_hist_enable;
+	error = sysctl_handle_int(oidp, &value, 0, req);
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+	if (value != 0 && value != 1)
+		return (EINVAL);
 
-	if (sc->alx_tq != NULL) {
-		taskqueue_drain(sc->alx_tq, &sc->alx_int_task);
-		taskqueue_drain(taskqueue_swi, &sc->alx_link_task);
-		taskqueue_free(sc->alx_tq);
+	ALX_LOCK(sc);
+	if (value != 0 && sc->alx_hist_enable == 0) {
+		for (i = 0; i < ALX_MAX_MSIX_INTRS; i++)
+			bzero(&sc->alx_vec[i].intr_delay,
+			    sizeof(struct alx_hist));
+		for (i = 0; i < ALX_MAX_RX_QUEUES; i++)
+			bzero(&sc->alx_rx_queue[i].rx_poll_pkts,
+			    sizeof(struct alx_hist));
+		for (i = 0; i < ALX_MAX_TX_QUEUES; i++)
+			bzero(&sc->alx_tx_queue[i].tx_compl_lat,
+			    sizeof(struct alx_hist));
 	}
+	sc->alx_hist_enable = value;
+	ALX_UNLOCK(sc);
 
-	if (sc->alx_cookie != NULL)
-		bus_teardown_intr(dev, sc->alx_irq, sc->alx_cookie);
-
-	if (sc->alx_irq != NULL)
-		bus_release_resource(dev, SYS_RES_IRQ, 0, sc->alx_irq);
-
-	if (ALX_FLAG(sc, USING_MSI))
-		pci_release_msi(dev);
+	return (0);
 }
 
+/*
+ * Print the non-empty buckets of a histogram, one range per line.
+ */
 static int
-alx_media_change(struct ifnet *ifp)
+alx_sysctl_hist(SYSCTL_HANDLER_ARGS)
 {
+	struct alx_hist *h;
+	struct sbuf *sb;
+	uint64_t lo;
+	int b, error;
+
+	h = arg1;
+	sb = sbuf_new_for_sysctl(NULL, NULL, 256, req);
+	if (sb == NULL)
+		return (ENOMEM);
+
+	for (b = 0; b < ALX_HIST_BUCKETS; b++) {
+		if (h->bucket[b] == 0)
+			continue;
+		lo = b == 0 ? 0 : (uint64_t)1 << (b - 1);
+		if (b == ALX_HIST_BUCKETS - 1)
+			sbuf_printf(sb, "\n%8ju+         %ju", (uintmax_t)lo,
+			    (uintmax_t)h->bucket[b]);
+		else
+			sbuf_printf(sb, "\n%8ju-%-8ju %ju", (uintmax_t)lo,
+			    (uintmax_t)(((uint64_t)1 << b) - 1),
+			    (uintmax_t)h->bucket[b]);
+	}
 
-	return (0);
+	error = sbuf_finish(sb);
+	sbuf_delete(sb);
+	return (error);
 }
 
-static void
-alx_media_status(struct ifnet *ifp, struct ifmediareq *ifmr)
+/*
+ * Run the loopback benchmark: write ALX_BENCH_MAC or ALX_BENCH_PHY to loop
+ * frames back in the MAC or in the PHY. Each TX queue in turn sends
+ * bench.frames frames of every size in bench.sizes; the results are kept for
+ * bench.results. The interface must be up with a link, and it carries no
+ * other traffic until the run is over and it has been reinitialized.
+ */
+static int
+alx_sysctl_bench_run(SYSCTL_HANDLER_ARGS)
 {
 	struct alx_softc *sc;
+	struct alx_bench *bench;
 	struct alx_hw *hw;
+	struct ifnet *ifp;
+	uint32_t *lat;
+	uint16_t bmcr;
+	int error, mode, nsizes, q, s, sizes[ALX_BENCH_MAX_SIZES];
 
-	sc = ifp->if_softc;
+	sc = arg1;
+	bench = &sc->alx_bench;
 	hw = &sc->hw;
+	ifp = sc->alx_ifp;
 
-	ALX_LOCK(sc);
+	mode = ALX_BENCH_NONE;
+	error = sysctl_handle_int(oidp, &mode, 0, req);
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+	if (mode != ALX_BENCH_MAC && mode != ALX_BENCH_PHY)
+		return (EINVAL);
+	if (bench->frames < 1 || bench->frames > ALX_BENCH_FRAMES_MAX)
+		return (EINVAL);
+	error = alx_bench_sizes(sc, sizes, &nsizes);
+	if (error != 0)
+		return (error);
 
-	ifmr->ifm_status = IFM_AVALID;
-	ifmr->ifm_active = IFM_ETHER;
+	lat = malloc(bench->frames * sizeof(*lat), M_DEVBUF, M_WAITOK);
 
-	if (hw->link_up)
-		ifmr->ifm_status |= IFM_ACTIVE;
-	else {
+	ALX_LOCK(sc);
+	if (ALX_FLAG(sc, TESTING) || ALX_FLAG(sc, RESETING) ||
+	    ALX_FLAG(sc, HALT))
+		error = EBUSY;
+	else if ((ifp->if_drv_flags & IFF_DRV_RUNNING) == 0 || !hw->link_up)
+		error = ENETDOWN;
+#ifdef DEV_NETMAP
+	else if ((ifp->if_capenable & IFCAP_NETMAP) != 0)
+		error = EBUSY;
+#endif
+#ifdef DEVICE_POLLING
+	/* There is no waiting for the poll handler at the end of the run. */
+	else if ((ifp->if_capenable & IFCAP_POLLING) != 0)
+		error = EBUSY;
+#endif
+	if (error != 0) {
 		ALX_UNLOCK(sc);
-		return;
+		free(lat, M_DEVBUF);
+		return (error);
 	}
-
-	switch (hw->link_duplex) {
-	case ALX_FULL_DUPLEX:
-		ifmr->ifm_active |= IFM_FDX;
-		break;
-	case ALX_HALF_DUPLEX:
-		ifmr->ifm_active |= IFM_HDX;
-		break;
-	default:
-		device_printf(sc->alx_dev, "invalid duplex mode %u\n",
-		    hw->link_duplex);
-		break;
+	ALX_FLAG_SET(sc, TESTING);
+	bench->mode = mode;
+	bench->nframes = bench->frames;
+	bzero(bench->res, sizeof(bench->res));
+
+	if (mode == ALX_BENCH_MAC) {
+		hw->rx_ctrl |= ALX_MAC_CTRL_LPBACK_EN;
+		ALX_MEM_W32(hw, ALX_MAC_CTRL, hw->rx_ctrl);
+	} else {
+		/* Loop back at the speed the MAC is running at. */
+		bmcr = BMCR_LOOP;
+		if (hw->link_speed == SPEED_1000)
+			bmcr |= BMCR_S1000;
+		else if (hw->link_speed == SPEED_100)
+			bmcr |= BMCR_S100;
+		if (hw->link_duplex == ALX_FULL_DUPLEX)
+			bmcr |= BMCR_FDX;
+		if (alx_write_phy_reg(hw, MII_BMCR, bmcr) != 0)
+			error = EIO;
 	}
+	ALX_UNLOCK(sc);
 
-	switch (hw->link_speed) {
-	case SPEED_10:
-		ifmr->ifm_active |= IFM_10_T;
-		break;
-	case SPEED_100:
-		ifmr->ifm_active |= IFM_100_TX;
-		break;
-	case SPEED_1000:
-		ifmr->ifm_active |= IFM_1000_T;
-		break;
-	default:
-		device_printf(sc->alx_dev, "invalid link speed %u\n",
-		    hw->link_speed);
-		break;
-	}
+	/* Let the loopback settle before the clock starts. */
+	if (error == 0)
+		pause("alxbch", hz / 10);
+
+	for (q = 0; q < sc->nr_txq && error == 0; q++)
+		for (s = 0; s < nsizes && error == 0; s++)
+			error = alx_bench_queue(sc, &sc->alx_tx_queue[q],
+			    sizes[s], lat, &bench->res[q][s]);
 
+	ALX_LOCK(sc);
+	bench->txq = -1;
+	hw->rx_ctrl &= ~ALX_MAC_CTRL_LPBACK_EN;
+	if ((ifp->if_drv_flags & IFF_DRV_RUNNING) != 0)
+		alx_stop(sc);
+	/*
+	 * A task may still be handing frames from the rings or the software
+	 * queues to alx_bench_input(); wait for it before lat goes away.
+	 */
+	ALX_FLAG_SET(sc, HALT);
+	ALX_UNLOCK(sc);
+	alx_tasks_fence(sc, true);
+	ALX_LOCK(sc);
+	ALX_FLAG_CLEAR(sc, HALT);
+	bench->lat = NULL;
+	if (mode == ALX_BENCH_PHY) {
+		alx_reset_phy(hw, !hw->hib_patch);
+		if (alx_setup_speed_duplex(hw, hw->adv_cfg, hw->flowctrl) != 0)
+			device_printf(sc->alx_dev,
+			    "failed to configure PHY after loopback\n");
+	}
+	ALX_FLAG_CLEAR(sc, TESTING);
+	if ((ifp->if_flags & IFF_UP) != 0)
+		alx_init_locked(sc);
 	ALX_UNLOCK(sc);
+
+	free(lat, M_DEVBUF);
+
+	/* Send whatever piled up in the buf_rings meanwhile. */
+	for (q = 0; q < sc->nr_txq; q++)
+		taskqueue_enqueue(sc->alx_tx_queue[q].tq,
+		    &sc->alx_tx_queue[q].start_task);
+
+	return (error);
 }
 
+/*
+ * Parse the comma-separated list of frame sizes in bench.sizes. Sizes are
+ * without the CRC.
+ */
 static int
-alx_ioctl(struct ifnet *ifp, u_long command, caddr_t data)
+alx_bench_sizes(struct alx_softc *sc, int *sizes, int *nsizes)
 {
-	struct alx_softc *sc;
-	struct ifreq *ifr;
-	int error = 0;
-
-	sc = ifp->if_softc;
-	ifr = (struct ifreq *)data;
-
-	switch (command) {
-	case SIOCSIFFLAGS:
-		ALX_LOCK(sc);
-		if ((ifp->if_flags & IFF_UP) &&
-		    !(ifp->if_flags & IFF_DRV_RUNNING)) {
-			alx_init_locked(sc);
-		} else {
-			if (!(ifp->if_flags & IFF_DRV_RUNNING))
-				alx_stop(sc);
-		}
-		sc->alx_if_flags = ifp->if_flags;
-		ALX_UNLOCK(sc);
-		break;
-	case SIOCGIFMEDIA:
-		error = ifmedia_ioctl(ifp, ifr, &sc->alx_media, command);
-		break;
-	default:
-		error = ether_ioctl(ifp, command, data);
-		break;
+	char buf[sizeof(sc->alx_bench.sizes)], *end, *p;
+	u_long size;
+	int n;
+
+	strlcpy(buf, sc->alx_bench.sizes, sizeof(buf));
+	n = 0;
+	for (p = buf; *p != '\0'; p = end) {
+		if (n == ALX_BENCH_MAX_SIZES)
+			return (EINVAL);
+		size = strtoul(p, &end, 10);
+		if (end == p || (*end != ',' && *end != '\0'))
+			return (EINVAL);
+		if (size < ETHER_MIN_LEN - ETHER_CRC_LEN ||
+		    size > sc->alx_ifp->if_mtu + ETHER_HDR_LEN ||
+		    size > MJUM9BYTES)
+			return (EINVAL);
+		sizes[n++] = size;
+		if (*end == ',')
+			end++;
 	}
+	if (n == 0)
+		return (EINVAL);
 
-	return (error);
+	*nsizes = n;
+	return (0);
 }
 
-static void
-alx_init(void *arg)
+/*
+ * Build a benchmark frame addressed to ourselves. The timestamp is filled in
+ * just before the frame is queued.
+ */
+static struct mbuf *
+alx_bench_frame(struct alx_softc *sc, int qidx, int size, u_int seq)
 {
-	struct alx_softc *sc;
+	struct alx_bench_hdr *hdr;
+	struct mbuf *m;
 
-	sc = arg;
-	ALX_LOCK(sc);
-	alx_init_locked(sc);
-	ALX_UNLOCK(sc);
+	/* The whole frame goes in a single buffer. */
+	if (size <= MHLEN)
+		m = m_gethdr(M_NOWAIT, MT_DATA);
+	else if (size <= MCLBYTES)
+		m = m_getcl(M_NOWAIT, MT_DATA, M_PKTHDR);
+	else if (size <= MJUMPAGESIZE)
+		m = m_getjcl(M_NOWAIT, MT_DATA, M_PKTHDR, MJUMPAGESIZE);
+	else
+		m = m_getjcl(M_NOWAIT, MT_DATA, M_PKTHDR, MJUM9BYTES);
+	if (m == NULL)
+		return (NULL);
+	m->m_len = m->m_pkthdr.len = size;
+	bzero(mtod(m, void *), size);
+
+	hdr = mtod(m, struct alx_bench_hdr *);
+	memcpy(hdr->eh.ether_dhost, IF_LLADDR(sc->alx_ifp), ETHER_ADDR_LEN);
+	memcpy(hdr->eh.ether_shost, IF_LLADDR(sc->alx_ifp), ETHER_ADDR_LEN);
+	hdr->eh.ether_type = htons(ALX_BENCH_ETHERTYPE);
+	hdr->magic = htonl(ALX_BENCH_MAGIC);
+	hdr->txq = qidx;
+	hdr->size = size;
+	hdr->seq = seq;
+
+	return (m);
 }
 
-static void
-alx_init_locked(struct alx_softc *sc)
+/*
+ * Push bench.frames frames of one size through a TX queue and wait for them
+ * to come back. At most half a ring is in flight so that the RX ring never
+ * overflows, which would measure the drop path rather than the data path.
+ */
+static int
+alx_bench_queue(struct alx_softc *sc, struct alx_tx_queue *txq, int size,
+    uint32_t *lat, struct alx_bench_result *res)
 {
+	struct alx_bench *bench;
 	struct ifnet *ifp;
-	struct alx_hw *hw;
-
-	ALX_LOCK_ASSERT(sc);
+	struct mbuf *m;
+	sbintime_t elapsed, start;
+	uint64_t sum;
+	u_int i, received, seq, window;
+	int error;
+	bool bounced;
 
+	bench = &sc->alx_bench;
 	ifp = sc->alx_ifp;
-	hw = &sc->hw;
+	window = min(sc->tx_ringsz, sc->rx_ringsz) / 2;
+
+	memset(lat, 0xff, bench->nframes * sizeof(*lat));
+	bench->lat = lat;
+	bench->size = size;
+	bench->received = 0;
+	start = sbinuptime();
+	bench->last_rx = start;
+	wmb();
+	bench->txq = txq->qidx;
+
+	error = 0;
+	for (seq = 0; seq < bench->nframes; ) {
+		if ((ifp->if_drv_flags & IFF_DRV_RUNNING) == 0) {
+			error = ENETDOWN;
+			break;
+		}
+		if (seq - bench->received < window) {
+			m = alx_bench_frame(sc, txq->qidx, size, seq);
+			if (m == NULL) {
+				error = ENOBUFS;
+				break;
+			}
+			ALX_TX_LOCK(txq);
+			if (txq->avail < ALX_TX_RECLAIM_THRESH)
+				alx_txeof(sc, txq, sc->tx_ringsz);
+			mtod(m, struct alx_bench_hdr *)->stamp = sbinuptime();
+			error = alx_xmit(sc, txq, &m, &bounced);
+			if (error == 0)
+				alx_tx_doorbell(sc, txq);
+			ALX_TX_UNLOCK(txq);
+			if (error == 0) {
+				if (bounced)
+					m_freem(m);
+				seq++;
+				continue;
+			}
+			if (m == NULL)
+				break;
+			/* The ring is full; wait for completions. */
+			m_freem(m);
+			error = 0;
+		}
+		/* Let the loopback catch up, but not forever. */
+		if (sbinuptime() - bench->last_rx > ALX_BENCH_TIMEOUT)
+			break;
+		DELAY(1);
+		maybe_yield();
+	}
+	while (bench->received < seq &&
+	    sbinuptime() - bench->last_rx <= ALX_BENCH_TIMEOUT)
+		pause("alxbch", 1);
+	bench->txq = -1;
+	wmb();
+
+	res->size = size;
+	res->sent = seq;
+	res->received = received = bench->received;
+	if (received == 0)
+		return (error);
 
-	if (ifp->if_drv_flags & IFF_DRV_RUNNING)
-		return;
+	elapsed = bench->last_rx - start;
+	if (elapsed <= 0)
+		elapsed = 1;
+	res->pps = (uint64_t)received * SBT_1S / elapsed;
+	res->bps = (uint64_t)received * size * SBT_1S / elapsed;
+
+	/* The frames that never came back sort last. */
+	qsort(lat, seq, sizeof(*lat), alx_bench_cmp);
+	sum = 0;
+	for (i = 0; i < received; i++)
+		sum += lat[i];
+	res->lat_min = lat[0];
+	res->lat_avg = sum / received;
+	res->lat_p99 = lat[(received * 99 + 99) / 100 - 1];
 
-	alx_stop(sc);
+	return (error);
+}
 
-	/* Reset to a known good state. */
-	alx_reset(sc);
+/*
+ * Account for a frame received while the benchmark runs, and drop it.
+ */
+static void
+alx_bench_input(struct alx_softc *sc, struct mbuf *m)
+{
+	struct alx_bench *bench;
+	struct alx_bench_hdr hdr;
+	sbintime_t now;
+	int64_t ns;
 
-	memcpy(hw->mac_addr, IF_LLADDR(ifp), ETHER_ADDR_LEN);
-	alx_set_macaddr(hw, hw->mac_addr);
+	bench = &sc->alx_bench;
+	now = sbinuptime();
 
-	alx_init_rx_ring(sc);
-	alx_init_tx_ring(sc);
+	if (m->m_pkthdr.len < sizeof(hdr)) {
+		m_freem(m);
+		return;
+	}
+	m_copydata(m, 0, sizeof(hdr), (caddr_t)&hdr);
+	m_freem(m);
 
-#if 0
-	printf("rfd: 0x%lx, rrd: 0x%lx, txd: 0x%lx\n", sc->alx_rx_queue.rfd_dma,
-	    sc->alx_rx_queue.rrd_dma, sc->alx_tx_queue.tpd_dma);
-#endif
+	if (hdr.eh.ether_type != htons(ALX_BENCH_ETHERTYPE) ||
+	    hdr.magic != htonl(ALX_BENCH_MAGIC) || hdr.txq != bench->txq ||
+	    hdr.size != bench->size || hdr.seq >= bench->nframes ||
+	    bench->lat == NULL || bench->lat[hdr.seq] != UINT32_MAX)
+		return;
 
-	/* Load the DMA pointers. */
-	ALX_MEM_W32(hw, ALX_SRAM9, ALX_SRAM_LOAD_PTR);
+	ns = sbttons(now - hdr.stamp);
+	bench->lat[hdr.seq] = min(ns, UINT32_MAX - 1);
+	bench->last_rx = now;
+	atomic_add_int(&bench->received, 1);
+}
 
-	/*
-	 * XXX configure some VLAN rx strip thingy and some promiscuous mode
-	 * stuff and some multicast stuff.
-	 */
+static int
+alx_bench_cmp(const void *a, const void *b)
+{
+	uint32_t x, y;
 
-	ifp->if_drv_flags |= IFF_DRV_RUNNING;
-	ifp->if_drv_flags &= ~IFF_DRV_OACTIVE;
+	x = *(const uint32_t *)a;
+	y = *(const uint32_t *)b;
+	return (x < y ? -1 : x > y);
+}
 
-	alx_update_link(sc);
+static int
+alx_sysctl_bench_results(SYSCTL_HANDLER_ARGS)
+{
+	struct alx_softc *sc;
+	struct alx_bench *bench;
+	struct alx_bench_result *res;
+	struct sbuf *sb;
+	int error, q, s;
+
+	sc = arg1;
+	bench = &sc->alx_bench;
+	sb = sbuf_new_for_sysctl(NULL, NULL, 512, req);
+	if (sb == NULL)
+		return (ENOMEM);
+
+	sbuf_printf(sb, "\nloopback: %s%s",
+	    bench->mode == ALX_BENCH_MAC ? "mac" :
+	    bench->mode == ALX_BENCH_PHY ? "phy" : "none",
+	    ALX_FLAG(sc, TESTING) ? " (running)" : "");
+	sbuf_printf(sb, "\nqueue  size     sent     rcvd       pkts/s"
+	    "      bytes/s   min_ns   avg_ns   p99_ns");
+	for (q = 0; q < ALX_MAX_TX_QUEUES; q++) {
+		for (s = 0; s < ALX_BENCH_MAX_SIZES; s++) {
+			res = &bench->res[q][s];
+			if (res->size == 0)
+				continue;
+			sbuf_printf(sb, "\n%5d %5d %8u %8u %12ju %12ju"
+			    " %8u %8u %8u", q, res->size, res->sent,
+			    res->received, (uintmax_t)res->pps,
+			    (uintmax_t)res->bps, res->lat_min, res->lat_avg,
+			    res->lat_p99);
+		}
+	}
 
-	ALX_MEM_W32(hw, ALX_ISR, (uint32_t)~ALX_ISR_DIS);
-	alx_intr_enable(sc);
+	error = sbuf_finish(sb);
+	sbuf_delete(sb);
+	return (error);
 }
 
 static void
-alx_start(struct ifnet *ifp)
+alx_add_sysctls(struct alx_softc *sc)
 {
-	struct alx_softc *sc = ifp->if_softc;
-
-	if (!(ifp->if_drv_flags & IFF_DRV_RUNNING))
-		return;
-
-	ALX_LOCK(sc);
-	alx_start_locked(ifp);
-	ALX_UNLOCK(sc);
+	struct sysctl_ctx_list *ctx;
+	struct sysctl_oid_list *child;
+	struct sysctl_oid *tree;
+
+	ctx = device_get_sysctl_ctx(sc->alx_dev);
+	child = SYSCTL_CHILDREN(device_get_sysctl_tree(sc->alx_dev));
+
+	SYSCTL_ADD_PROC(ctx, child, OID_AUTO, "rx_process_limit",
+	    CTLTYPE_INT | CTLFLAG_RW, &sc->alx_rx_process_limit, 0,
+	    alx_sysctl_process_limit, "I",
+	    "Max number of RX frames to process per pass");
+	SYSCTL_ADD_PROC(ctx, child, OID_AUTO, "tx_process_limit",
+	    CTLTYPE_INT | CTLFLAG_RW, &sc->alx_tx_process_limit, 0,
+	    alx_sysctl_process_limit, "I",
+	    "Max number of TX completions to process per pass");
+	SYSCTL_ADD_PROC(ctx, child, OID_AUTO, "tx_doorbell_thresh",
+	    CTLTYPE_INT | CTLFLAG_RW, &sc->alx_tx_doorbell_thresh, 0,
+	    alx_sysctl_process_limit, "I",
+	    "Max number of TX descriptors queued before notifying the chip");
+	SYSCTL_ADD_PROC(ctx, child, OID_AUTO, "rx_copybreak",
+	    CTLTYPE_INT | CTLFLAG_RW, &sc->alx_rx_copybreak, 0,
+	    alx_sysctl_copybreak, "I",
+	    "Copy received frames up to this size into a new mbuf");
+	SYSCTL_ADD_PROC(ctx, child, OID_AUTO, "tx_bounce",
+	    CTLTYPE_INT | CTLFLAG_RW, &sc->alx_tx_bounce, 0,
+	    alx_sysctl_tx_bounce, "I",
+	    "Copy transmitted frames up to this size into a pre-mapped buffer");
+	SYSCTL_ADD_INT(ctx, child, OID_AUTO, "rx_sw_timestamp", CTLFLAG_RW,
+	    &sc->alx_rx_sw_tstmp, 0,
+	    "Stamp received frames in software with the time of the RX ring "
+	    "pass (not hardware timestamps)");
+	SYSCTL_ADD_PROC(ctx, child, OID_AUTO, "tx_ring_size",
+	    CTLTYPE_INT | CTLFLAG_RW, sc, 0, alx_sysctl_ring_size, "I",
+	    "Number of descriptors in each TX ring");
+	SYSCTL_ADD_PROC(ctx, child, OID_AUTO, "rx_ring_size",
+	    CTLTYPE_INT | CTLFLAG_RW, sc, 1, alx_sysctl_ring_size, "I",
+	    "Number of descriptors in the RX ring");
+	SYSCTL_ADD_PROC(ctx, child, OID_AUTO, "int_mod_profile",
+	    CTLTYPE_INT | CTLFLAG_RW, sc, 0, alx_sysctl_imod_profile, "I",
+	    "Interrupt moderation: 0 fixed, 1 adaptive, 2 low latency, "
+	    "3 throughput");
+	SYSCTL_ADD_PROC(ctx, child, OID_AUTO, "power_profile",
+	    CTLTYPE_INT | CTLFLAG_RWTUN, sc, 0, alx_sysctl_pm_profile, "I",
+	    "Power profile: 0 power saving, 1 low latency (no ASPM, EEE or "
+	    "clock gating)");
+	SYSCTL_ADD_PROC(ctx, child, OID_AUTO, "histograms",
+	    CTLTYPE_INT | CTLFLAG_RW, sc, 0, alx_sysctl_hist_enable, "I",
+	    "Keep the latency and batching histograms under stats");
+	SYSCTL_ADD_PROC(ctx, child, OID_AUTO, "int_mod_timer",
+	    CTLTYPE_INT | CTLFLAG_RW, sc, 0, alx_sysctl_imod_timer, "I",
+	    "Current interrupt moderation timer (us); setting it pins the "
+	    "value");
+
+	tree = SYSCTL_ADD_NODE(ctx, child, OID_AUTO, "bench", CTLFLAG_RD,
+	    NULL, "Loopback benchmark");
+	child = SYSCTL_CHILDREN(tree);
+	SYSCTL_ADD_INT(ctx, child, OID_AUTO, "frames", CTLFLAG_RW,
+	    &sc->alx_bench.frames, 0, "Frames to send per queue and size");
+	SYSCTL_ADD_STRING(ctx, child, OID_AUTO, "sizes", CTLFLAG_RW,
+	    sc->alx_bench.sizes, sizeof(sc->alx_bench.sizes),
+	    "Comma-separated frame sizes, without the CRC");
+	SYSCTL_ADD_PROC(ctx, child, OID_AUTO, "run",
+	    CTLTYPE_INT | CTLFLAG_RW, sc, 0, alx_sysctl_bench_run, "I",
+	    "Run the benchmark: 1 MAC loopback, 2 PHY loopback");
+	SYSCTL_ADD_PROC(ctx, child, OID_AUTO, "results",
+	    CTLTYPE_STRING | CTLFLAG_RD, sc, 0, alx_sysctl_bench_results, "A",
+	    "Results of the last run");
+
+	alx_add_stats_sysctls(sc);
 }
 
+#define ALX_SYSCTL_STAT_ADD(c, h, n, p, d)	\
+	SYSCTL_ADD_ULONG(c, h, OID_AUTO, n, CTLFLAG_RD, p, d)
+#define ALX_SYSCTL_COUNTER_ADD(c, h, n, p, d)	\
+	SYSCTL_ADD_COUNTER_U64(c, h, OID_AUTO, n, CTLFLAG_RD, p, d)
+#define ALX_SYSCTL_HIST_ADD(c, h, n, p, d)	\
+	SYSCTL_ADD_PROC(c, h, OID_AUTO, n, CTLTYPE_STRING | CTLFLAG_RD, p, 0, \
+	    alx_sysctl_hist, "A", d)
+
 /*
- * Transmit all of the frames in our send queue.
+ * Export the MAC statistics and the per-queue counters under
+ * dev.alx.N.stats.
  */
 static void
-alx_start_locked(struct ifnet *ifp)
+alx_add_stats_sysctls(struct alx_softc *sc)
 {
-	struct alx_softc *sc;
-	struct mbuf *m_head;
-
-	sc = ifp->if_softc;
-	ALX_LOCK_ASSERT(sc);
+	struct sysctl_ctx_list *ctx;
+	struct sysctl_oid_list *child, *parent;
+	struct sysctl_oid *tree;
+	struct alx_hw_stats *stats;
+	struct alx_rx_queue *rxq;
+	struct alx_tx_queue *txq;
+	struct alx_vec *vec;
+	char name[16];
+	int q;
+
+	ctx = device_get_sysctl_ctx(sc->alx_dev);
+	child = SYSCTL_CHILDREN(device_get_sysctl_tree(sc->alx_dev));
+	stats = &sc->hw.stats;
+
+	tree = SYSCTL_ADD_NODE(ctx, child, OID_AUTO, "stats", CTLFLAG_RD,
+	    NULL, "Statistics");
+	parent = SYSCTL_CHILDREN(tree);
+
+	ALX_SYSCTL_STAT_ADD(ctx, parent, "ring_resets", &sc->alx_ring_resets,
+	    "Rings rebuilt to recover from an error");
+	ALX_SYSCTL_STAT_ADD(ctx, parent, "chip_resets", &sc->alx_chip_resets,
+	    "Full resets to recover from an error");
+
+	tree = SYSCTL_ADD_NODE(ctx, parent, OID_AUTO, "rx", CTLFLAG_RD,
+	    NULL, "MAC RX statistics");
+	child = SYSCTL_CHILDREN(tree);
+	ALX_SYSCTL_STAT_ADD(ctx, child, "good_frames", &stats->rx_ok,
+	    "Good frames");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "good_bcast_frames", &stats->rx_bcast,
+	    "Good broadcast frames");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "good_mcast_frames", &stats->rx_mcast,
+	    "Good multicast frames");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "pause_frames", &stats->rx_pause,
+	    "Pause control frames");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "control_frames", &stats->rx_ctrl,
+	    "Control frames");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "crc_errs", &stats->rx_fcs_err,
+	    "CRC errors");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "len_errs", &stats->rx_len_err,
+	    "Frames with length mismatches");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "good_octets", &stats->rx_byte_cnt,
+	    "Good octets");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "good_bcast_octets",
+	    &stats->rx_bc_byte_cnt, "Good broadcast octets");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "good_mcast_octets",
+	    &stats->rx_mc_byte_cnt, "Good multicast octets");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "runts", &stats->rx_runt,
+	    "Too short frames");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "fragments", &stats->rx_frag,
+	    "Fragmented frames");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "frames_64", &stats->rx_sz_64B,
+	    "64 byte frames");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "frames_65_127", &stats->rx_sz_127B,
+	    "65 to 127 byte frames");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "frames_128_255", &stats->rx_sz_255B,
+	    "128 to 255 byte frames");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "frames_256_511", &stats->rx_sz_511B,
+	    "256 to 511 byte frames");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "frames_512_1023",
+	    &stats->rx_sz_1023B, "512 to 1023 byte frames");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "frames_1024_1518",
+	    &stats->rx_sz_1518B, "1024 to 1518 byte frames");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "frames_1519_max", &stats->rx_sz_max,
+	    "1519 to max frames");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "trunc_errs", &stats->rx_ov_sz,
+	    "Frames truncated due to MTU size");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "fifo_oflows", &stats->rx_ov_rxf,
+	    "FIFO overflows");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "rrd_oflows", &stats->rx_ov_rrd,
+	    "Return descriptor overflows");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "align_errs", &stats->rx_align_err,
+	    "Alignment errors");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "filtered", &stats->rx_err_addr,
+	    "Frames dropped due to address filtering");
+
+	tree = SYSCTL_ADD_NODE(ctx, parent, OID_AUTO, "tx", CTLFLAG_RD,
+	    NULL, "MAC TX statistics");
+	child = SYSCTL_CHILDREN(tree);
+	ALX_SYSCTL_STAT_ADD(ctx, child, "good_frames", &stats->tx_ok,
+	    "Good frames");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "good_bcast_frames", &stats->tx_bcast,
+	    "Good broadcast frames");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "good_mcast_frames", &stats->tx_mcast,
+	    "Good multicast frames");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "pause_frames", &stats->tx_pause,
+	    "Pause control frames");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "excess_defers", &stats->tx_exc_defer,
+	    "Frames with excessive deferrals");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "control_frames", &stats->tx_ctrl,
+	    "Control frames");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "defers", &stats->tx_defer,
+	    "Frames with deferrals");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "good_octets", &stats->tx_byte_cnt,
+	    "Good octets");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "good_bcast_octets",
+	    &stats->tx_bc_byte_cnt, "Good broadcast octets");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "good_mcast_octets",
+	    &stats->tx_mc_byte_cnt, "Good multicast octets");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "frames_64", &stats->tx_sz_64B,
+	    "64 byte frames");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "frames_65_127", &stats->tx_sz_127B,
+	    "65 to 127 byte frames");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "frames_128_255", &stats->tx_sz_255B,
+	    "128 to 255 byte frames");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "frames_256_511", &stats->tx_sz_511B,
+	    "256 to 511 byte frames");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "frames_512_1023",
+	    &stats->tx_sz_1023B, "512 to 1023 byte frames");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "frames_1024_1518",
+	    &stats->tx_sz_1518B, "1024 to 1518 byte frames");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "frames_1519_max", &stats->tx_sz_max,
+	    "1519 to max frames");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "single_colls", &stats->tx_single_col,
+	    "Single collisions");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "multi_colls", &stats->tx_multi_col,
+	    "Multiple collisions");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "late_colls", &stats->tx_late_col,
+	    "Late collisions");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "excess_colls", &stats->tx_abort_col,
+	    "Frames aborted due to excessive collisions");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "underruns", &stats->tx_underrun,
+	    "FIFO underruns");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "desc_underruns", &stats->tx_trd_eop,
+	    "Descriptor write-back errors");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "len_errs", &stats->tx_len_err,
+	    "Frames with length mismatches");
+	ALX_SYSCTL_STAT_ADD(ctx, child, "trunc_errs", &stats->tx_trunc,
+	    "Frames truncated due to MTU size");
+
+	for (q = 0; q < sc->nr_rxq; q++) {
+		rxq = &sc->alx_rx_queue[q];
+		snprintf(name, sizeof(name), "rxq%d", q);
+		tree = SYSCTL_ADD_NODE(ctx, parent, OID_AUTO, name,
+		    CTLFLAG_RD, NULL, "RX queue statistics");
+		child = SYSCTL_CHILDREN(tree);
+		ALX_SYSCTL_COUNTER_ADD(ctx, child, "packets", &rxq->rx_packets,
+		    "Frames passed up the stack");
+		ALX_SYSCTL_COUNTER_ADD(ctx, child, "bytes", &rxq->rx_bytes,
+		    "Bytes passed up the stack");
+		ALX_SYSCTL_COUNTER_ADD(ctx, child, "mbuf_fail",
+		    &rxq->rx_mbuf_fail,
+		    "Frames dropped for want of a replacement buffer");
+		if (q < sc->nr_hwrxq)
+			ALX_SYSCTL_COUNTER_ADD(ctx, child, "desync",
+			    &rxq->rx_desync,
+			    "Times an RRD didn't match the RFD ring");
+		if (q < sc->nr_hwrxq)
+			ALX_SYSCTL_HIST_ADD(ctx, child, "poll_packets",
+			    &rxq->rx_poll_pkts,
+			    "Frames processed per pass over the ring");
+	}
 
-	if ((ifp->if_drv_flags & (IFF_DRV_RUNNING | IFF_DRV_OACTIVE)) !=
-	    IFF_DRV_RUNNING || !sc->hw.link_up)
-		return;
+	for (q = 0; q < sc->nr_txq; q++) {
+		txq = &sc->alx_tx_queue[q];
+		snprintf(name, sizeof(name), "txq%d", q);
+		tree = SYSCTL_ADD_NODE(ctx, parent, OID_AUTO, name,
+		    CTLFLAG_RD, NULL, "TX queue statistics");
+		child = SYSCTL_CHILDREN(tree);
+		ALX_SYSCTL_COUNTER_ADD(ctx, child, "packets", &txq->tx_packets,
+		    "Frames handed to the chip");
+		ALX_SYSCTL_COUNTER_ADD(ctx, child, "bytes", &txq->tx_bytes,
+		    "Bytes handed to the chip");
+		ALX_SYSCTL_COUNTER_ADD(ctx, child, "mbuf_fail",
+		    &txq->tx_mbuf_fail,
+		    "Frames dropped for want of mbufs");
+		ALX_SYSCTL_COUNTER_ADD(ctx, child, "drops", &txq->tx_drops,
+		    "Frames dropped because they couldn't be mapped");
+		ALX_SYSCTL_COUNTER_ADD(ctx, child, "collapse",
+		    &txq->tx_collapse, "Frames collapsed to fit the ring");
+		ALX_SYSCTL_COUNTER_ADD(ctx, child, "bounce",
+		    &txq->tx_bounce, "Frames copied into the bounce pool");
+		ALX_SYSCTL_COUNTER_ADD(ctx, child, "ring_full",
+		    &txq->tx_ring_full,
+		    "Times the queue stalled on free descriptors");
+		ALX_SYSCTL_COUNTER_ADD(ctx, child, "watchdog",
+		    &txq->tx_watchdog, "Watchdog timeouts");
+		ALX_SYSCTL_HIST_ADD(ctx, child, "completion_us",
+		    &txq->tx_compl_lat,
+		    "Time from queueing a frame to its completion (us)");
+	}
 
-	while (!IFQ_DRV_IS_EMPTY(&ifp->if_snd)) {
-		IFQ_DRV_DEQUEUE(&ifp->if_snd, m_head);
-		if (m_head == NULL)
-			break;
+	/* Vector 0 only has a task when it is the only interrupt. */
+	for (q = ALX_FLAG(sc, USING_MSIX) ? 1 : 0; q < sc->nr_vec; q++) {
+		vec = &sc->alx_vec[q];
+		snprintf(name, sizeof(name), "vec%d", q);
+		tree = SYSCTL_ADD_NODE(ctx, parent, OID_AUTO, name,
+		    CTLFLAG_RD, NULL, "Interrupt vector statistics");
+		child = SYSCTL_CHILDREN(tree);
+		ALX_SYSCTL_HIST_ADD(ctx, child, "intr_delay_us",
+		    &vec->intr_delay,
+		    "Time from the interrupt to the start of its task (us)");
+	}
+}
 
-		if (alx_xmit(sc, &m_head)) {
-			if (m_head != NULL)
-				IFQ_DRV_PREPEND(&ifp->if_snd, m_head);
-			break;
-		}
+#undef ALX_SYSCTL_STAT_ADD
+#undef ALX_SYSCTL_COUNTER_ADD
+#undef ALX_SYSCTL_HIST_ADD
 
-		/* Let BPF listeners know about this frame. */
-		ETHER_BPF_MTAP(ifp, m_head);
+static void
+alx_counters_alloc(struct alx_softc *sc)
+{
+	struct alx_rx_queue *rxq;
+	struct alx_tx_queue *txq;
+	int q;
+
+	for (q = 0; q < ALX_MAX_RX_QUEUES; q++) {
+		rxq = &sc->alx_rx_queue[q];
+		rxq->rx_packets = counter_u64_alloc(M_WAITOK);
+		rxq->rx_bytes = counter_u64_alloc(M_WAITOK);
+		rxq->rx_mbuf_fail = counter_u64_alloc(M_WAITOK);
+		rxq->rx_desync = counter_u64_alloc(M_WAITOK);
+	}
+	for (q = 0; q < ALX_MAX_TX_QUEUES; q++) {
+		txq = &sc->alx_tx_queue[q];
+		txq->tx_packets = counter_u64_alloc(M_WAITOK);
+		txq->tx_bytes = counter_u64_alloc(M_WAITOK);
+		txq->tx_mbuf_fail = counter_u64_alloc(M_WAITOK);
+		txq->tx_drops = counter_u64_alloc(M_WAITOK);
+		txq->tx_collapse = counter_u64_alloc(M_WAITOK);
+		txq->tx_bounce = counter_u64_alloc(M_WAITOK);
+		txq->tx_ring_full = counter_u64_alloc(M_WAITOK);
+		txq->tx_watchdog = counter_u64_alloc(M_WAITOK);
 	}
+}
+
+static void
+alx_counters_free(struct alx_softc *sc)
+{
+	struct alx_rx_queue *rxq;
+	struct alx_tx_queue *txq;
+	int q;
 
-	/* XXX start wdog */
+	for (q = 0; q < ALX_MAX_RX_QUEUES; q++) {
+		rxq = &sc->alx_rx_queue[q];
+		if (rxq->rx_packets == NULL)
+			continue;
+		counter_u64_free(rxq->rx_packets);
+		counter_u64_free(rxq->rx_bytes);
+		counter_u64_free(rxq->rx_mbuf_fail);
+		counter_u64_free(rxq->rx_desync);
+	}
+	for (q = 0; q < ALX_MAX_TX_QUEUES; q++) {
+		txq = &sc->alx_tx_queue[q];
+		if (txq->tx_packets == NULL)
+			continue;
+		counter_u64_free(txq->tx_packets);
+		counter_u64_free(txq->tx_bytes);
+		counter_u64_free(txq->tx_mbuf_fail);
+		counter_u64_free(txq->tx_drops);
+		counter_u64_free(txq->tx_collapse);
+		counter_u64_free(txq->tx_bounce);
+		counter_u64_free(txq->tx_ring_full);
+		counter_u64_free(txq->tx_watchdog);
+	}
 }
 
 static int
@@ -1434,14 +4601,32 @@ alx_attach(device_t dev)
 	struct alx_softc *sc;
 	struct alx_hw *hw;
 	struct ifnet *ifp;
+	struct alx_rx_queue *rxq;
+	struct alx_tx_queue *txq;
 	bool phy_cfged;
-	int error, rid;
+	int error, q, rid;
 
 	sc = device_get_softc(dev);
 	sc->alx_dev = dev;
 
 	mtx_init(&sc->alx_mtx, device_get_nameunit(dev), MTX_NETWORK_LOCK,
 	    MTX_DEF);
+	for (q = 0; q < ALX_MAX_RX_QUEUES; q++) {
+		rxq = &sc->alx_rx_queue[q];
+		snprintf(rxq->rx_mtx_name, sizeof(rxq->rx_mtx_name), "%s:rx%d",
+		    device_get_nameunit(dev), q);
+		mtx_init(&rxq->rx_mtx, rxq->rx_mtx_name, NULL, MTX_DEF);
+	}
+	for (q = 0; q < ALX_MAX_TX_QUEUES; q++) {
+		txq = &sc->alx_tx_queue[q];
+		snprintf(txq->tx_mtx_name, sizeof(txq->tx_mtx_name), "%s:tx%d",
+		    device_get_nameunit(dev), q);
+		mtx_init(&txq->tx_mtx, txq->tx_mtx_name, NULL, MTX_DEF);
+	}
+	callout_init_mtx(&sc->alx_tick_ch, &sc->alx_mtx, 0);
+	alx_counters_alloc(sc);
+	mtx_init(&sc->hw.mdio_lock, "alx mdio", NULL, MTX_DEF);
+	mtx_init(&sc->alx_imr_mtx, "alx imr", NULL, MTX_SPIN);
 
 	rid = PCIR_BAR(0);
 	sc->alx_res = bus_alloc_resource_any(dev, SYS_RES_MEMORY, &rid,
@@ -1535,12 +4720,43 @@ alx_attach(device_t dev)
 	ifp->if_softc = sc;
 	if_initname(ifp, device_get_name(dev), device_get_unit(dev));
 	ifp->if_flags = IFF_BROADCAST | IFF_SIMPLEX | IFF_MULTICAST; /* XXX */
-	ifp->if_capabilities = 0; //IFCAP_HWCSUM; /* XXX others? */
+	ifp->if_capabilities = IFCAP_TXCSUM | IFCAP_TXCSUM_IPV6 | IFCAP_RXCSUM |
+	    IFCAP_TSO4 | IFCAP_TSO6 | IFCAP_VLAN_MTU | IFCAP_VLAN_HWTAGGING |
+	    IFCAP_VLAN_HWCSUM | IFCAP_VLAN_HWTSO | IFCAP_JUMBO_MTU | IFCAP_LRO;
+	/* XXX others? */
+	for (q = 0; q < sc->nr_rxq; q++) {
+		error = tcp_lro_init_args(&sc->alx_rx_queue[q].lro, ifp,
+		    TCP_LRO_ENTRIES, sc->rx_ringsz);
+		if (error != 0) {
+			device_printf(dev, "failed to initialize LRO, "
+			    "disabling it\n");
+			ifp->if_capabilities &= ~IFCAP_LRO;
+			error = 0;
+			break;
+		}
+	}
+	ifp->if_capenable = ifp->if_capabilities;
+	ifp->if_hwassist = ALX_CSUM_FEATURES | CSUM_TSO;
+	ifp->if_hw_tsomax = ALX_TSO_MAXSIZE;
+	/* Leave room for the extra LSOv2 descriptor. */
+	ifp->if_hw_tsomaxsegcount = ALX_MAXTXSEGS - 1;
+	ifp->if_hw_tsomaxsegsize = ALX_TSO_MAXSEGSIZE;
+#ifdef DEVICE_POLLING
+	/* Polling is off by default. */
+	ifp->if_capabilities |= IFCAP_POLLING;
+#endif
 	ifp->if_ioctl = alx_ioctl;
-	ifp->if_start = alx_start;
+	ifp->if_transmit = alx_transmit;
+	ifp->if_qflush = alx_qflush;
 	ifp->if_init = alx_init;
+	ifp->if_get_counter = alx_get_counter;
 
 	ether_ifattach(ifp, hw->mac_addr);
+#ifdef DEV_NETMAP
+	alx_netmap_attach(sc);
+#endif
+
+	alx_add_sysctls(sc);
 
 	ifmedia_init(&sc->alx_media, IFM_IMASK, alx_media_change,
 	    alx_media_status);
@@ -1556,9 +4772,7 @@ alx_attach(device_t dev)
 	}
 	ifmedia_set(&sc->alx_media, IFM_ETHER | IFM_AUTO);
 
-	hw->mtu = sc->alx_ifp->if_mtu;
-	//sc->rxbuf_size = MCLBYTES;
-	sc->rxbuf_size = ALIGN(ALX_RAW_MTU(hw->mtu));
+	alx_set_rxbuf_size(sc);
 #if 0
 	printf("rxbuf size is %d\n", sc->rxbuf_size);
 #endif
@@ -1574,24 +4788,42 @@ alx_detach(device_t dev)
 {
 	struct alx_softc *sc;
 	struct alx_hw *hw;
+	int q;
 
 	sc = device_get_softc(dev);
 	hw = &sc->hw;
 
+#ifdef DEVICE_POLLING
+	if (sc->alx_ifp != NULL && sc->alx_ifp->if_capenable & IFCAP_POLLING)
+		ether_poll_deregister(sc->alx_ifp);
+#endif
+
+	if (device_is_attached(dev)) {
+		ALX_LOCK(sc);
+		alx_stop(sc);
+		ALX_UNLOCK(sc);
+		callout_drain(&sc->alx_tick_ch);
+	}
+
 	/* Restore permanent mac address. */
 	alx_set_macaddr(hw, hw->perm_addr);
 
-	/* XXX Free DMA */
-	free(sc->alx_tx_queue.bf_info, M_DEVBUF);
-	free(sc->alx_rx_queue.bf_info, M_DEVBUF);
+	for (q = 0; q < ALX_MAX_RX_QUEUES; q++)
+		if (sc->alx_rx_queue[q].lro.ifp != NULL)
+			tcp_lro_free(&sc->alx_rx_queue[q].lro);
 
 	if (sc->alx_ifp != NULL) {
+#ifdef DEV_NETMAP
+		netmap_detach(sc->alx_ifp);
+#endif
 		ether_ifdetach(sc->alx_ifp);
 		if_free(sc->alx_ifp);
 		sc->alx_ifp = NULL;
 	}
 
 	alx_free_intr(sc);
+	alx_dma_free(sc);
+	alx_counters_free(sc);
 
 	if (sc->alx_res != NULL)
 		bus_release_resource(dev, SYS_RES_MEMORY, PCIR_BAR(0),
@@ -1599,6 +4831,12 @@ alx_detach(device_t dev)
 
 	bus_generic_detach(dev);
 
+	for (q = 0; q < ALX_MAX_RX_QUEUES; q++)
+		mtx_destroy(&sc->alx_rx_queue[q].rx_mtx);
+	for (q = 0; q < ALX_MAX_TX_QUEUES; q++)
+		mtx_destroy(&sc->alx_tx_queue[q].tx_mtx);
+	mtx_destroy(&sc->hw.mdio_lock);
+	mtx_destroy(&sc->alx_imr_mtx);
 	mtx_destroy(&sc->alx_mtx);
 
 	return (0);
@@ -1628,9 +4866,32 @@ alx_suspend(device_t dev)
 	return (bus_generic_suspend(dev));
 }
 
+/*
+ * Reconfigure the PHY if it lost its settings, and bring the interface back
+ * up if it was. Autonegotiation finishes in the background.
+ */
 static int
 alx_resume(device_t dev)
 {
+	struct alx_softc *sc;
+	struct alx_hw *hw;
+	int error;
 
-	return (0);
+	sc = device_get_softc(dev);
+	hw = &sc->hw;
+
+	ALX_LOCK(sc);
+	alx_reset_pcie(hw);
+	if (!alx_phy_configed(hw)) {
+		alx_reset_phy(hw, !hw->hib_patch);
+		error = alx_setup_speed_duplex(hw, hw->adv_cfg, hw->flowctrl);
+		if (error != 0)
+			device_printf(dev,
+			    "failed to configure PHY with error %d\n", error);
+	}
+	if ((sc->alx_ifp->if_flags & IFF_UP) != 0)
+		alx_init_locked(sc);
+	ALX_UNLOCK(sc);
+
+	return (bus_generic_resume(dev));
 }
@@ -0,0 +1,1395 @@
+/*-
+ * Copyright (c) 2012 Qualcomm Atheros, Inc.
+ * Copyright (c) 2013, Mark Johnston <markj@FreeBSD.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * iflib(4) front end for alx, built instead of if_alx.c on FreeBSD 13 and
+ * later unless "make WITHOUT_IFLIB=1" is given. iflib owns the rings,
+ * buffers, interrupts and the ifnet; this file only translates between its
+ * descriptor model and the chip's, and reuses alx_hw.c for everything else.
+ *
+ * The chip has a single RX ring made of an RFD free list and an RRD
+ * completion ring, so there is exactly one RX queue set. The TX rings are
+ * serviced from the same MSI-X vector; vector 0 handles PHY events.
+ */
+
+#include <sys/cdefs.h>
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/bitstring.h>
+#include <sys/buf_ring.h>
+#include <sys/bus.h>
+#include <sys/counter.h>
+#include <sys/endian.h>
+#include <sys/kernel.h>
+#include <sys/lock.h>
+#include <sys/malloc.h>
+#include <sys/mbuf.h>
+#include <sys/module.h>
+#include <sys/mutex.h>
+#include <sys/rman.h>
+#include <sys/socket.h>
+#include <sys/sockio.h>
+#include <sys/sysctl.h>
+#include <sys/taskqueue.h>
+
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <net/if_dl.h>
+#include <net/if_media.h>
+#include <net/if_types.h>
+#include <net/if_var.h>
+#include <net/iflib.h>
+
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <netinet/tcp_lro.h>
+#include <netinet/udp.h>
+
+#include <dev/pci/pcireg.h>
+#include <dev/pci/pcivar.h>
+
+#include <machine/bus.h>
+
+#include "ifdi_if.h"
+
+#include "compat.h"
+#include "alx_hw.h"
+#include "if_alxreg.h"
+#include "if_alxvar.h"
+
+/*
+ * Descriptor ring sizes. The RRD and RFD rings are consumed in lockstep, so
+ * they always have the same size; RRD_SI limits them to 4095 entries.
+ */
+#define ALX_IFL_TXD_MIN		64
+#define ALX_IFL_TXD_MAX		4096
+#define ALX_IFL_TXD_DEF		256
+#define ALX_IFL_RXD_MIN		64
+#define ALX_IFL_RXD_MAX		2048
+#define ALX_IFL_RXD_DEF		512
+
+/* The RX queue set's rings: RRD completions, then the RFD free list. */
+#define ALX_IFL_RRD_RING	0
+#define ALX_IFL_RFD_RING	1
+
+/* MSI-X vector servicing the RX ring and all of the TX rings. */
+#define ALX_IFL_RING_VEC	1
+
+struct alx_ifl_softc;
+
+struct alx_ifl_tx_queue {
+	struct alx_ifl_softc	*sc;
+	struct tpd_desc		*tpd;
+	uint64_t		 tpd_pa;
+	uint16_t		 p_reg;
+	uint16_t		 c_reg;
+	/* The consumer index last reported to iflib. */
+	uint16_t		 cidx;
+	int			 qidx;
+};
+
+struct alx_ifl_rx_queue {
+	struct alx_ifl_softc	*sc;
+	struct rrd_desc		*rrd;
+	uint64_t		 rrd_pa;
+	struct rfd_desc		*rfd;
+	uint64_t		 rfd_pa;
+	struct if_irq		 irq;
+	int			 qidx;
+	/* frames dropped for RRD errors; the MAC's counts feed IERRORS */
+	uint64_t		 rx_errors;
+};
+
+struct alx_ifl_softc {
+	struct alx_hw		 hw;
+	device_t		 dev;
+	if_ctx_t		 ctx;
+	if_softc_ctx_t		 scctx;
+	struct ifmedia		*media;
+	struct resource		*res;
+	struct if_irq		 admin_irq;
+	struct alx_ifl_tx_queue	 txq[ALX_MAX_TX_QUEUES];
+	struct alx_ifl_rx_queue	 rxq;
+	int			 ntxq;
+};
+
+static void	*alx_ifl_register(device_t);
+static int	alx_ifl_attach_pre(if_ctx_t);
+static int	alx_ifl_attach_post(if_ctx_t);
+static int	alx_ifl_detach(if_ctx_t);
+static void	alx_ifl_init(if_ctx_t);
+static void	alx_ifl_stop(if_ctx_t);
+static int	alx_ifl_tx_queues_alloc(if_ctx_t, caddr_t *, uint64_t *, int,
+		    int);
+static int	alx_ifl_rx_queues_alloc(if_ctx_t, caddr_t *, uint64_t *, int,
+		    int);
+static void	alx_ifl_queues_free(if_ctx_t);
+static int	alx_ifl_msix_intr_assign(if_ctx_t, int);
+static void	alx_ifl_intr_enable(if_ctx_t);
+static void	alx_ifl_intr_disable(if_ctx_t);
+static int	alx_ifl_rx_queue_intr_enable(if_ctx_t, uint16_t);
+static int	alx_ifl_tx_queue_intr_enable(if_ctx_t, uint16_t);
+static void	alx_ifl_multi_set(if_ctx_t);
+static int	alx_ifl_mtu_set(if_ctx_t, uint32_t);
+static void	alx_ifl_media_status(if_ctx_t, struct ifmediareq *);
+static int	alx_ifl_media_change(if_ctx_t);
+static int	alx_ifl_promisc_set(if_ctx_t, int);
+static void	alx_ifl_update_admin_status(if_ctx_t);
+static void	alx_ifl_timer(if_ctx_t, uint16_t);
+static uint64_t	alx_ifl_get_counter(if_ctx_t, ift_counter);
+
+static int	alx_ifl_init_sw(struct alx_ifl_softc *);
+static void	alx_ifl_reset(struct alx_ifl_softc *);
+static void	alx_ifl_map_msix(struct alx_ifl_softc *);
+static void	alx_ifl_rxfilter(struct alx_ifl_softc *);
+static int	alx_ifl_intr_legacy(void *);
+static int	alx_ifl_intr_misc(void *);
+static int	alx_ifl_intr_ring(void *);
+
+static int	alx_ifl_txd_encap(void *, if_pkt_info_t);
+static void	alx_ifl_txd_flush(void *, uint16_t, qidx_t);
+static int	alx_ifl_txd_credits_update(void *, uint16_t, bool);
+static int	alx_ifl_rxd_available(void *, uint16_t, qidx_t, qidx_t);
+static int	alx_ifl_rxd_pkt_get(void *, if_rxd_info_t);
+static void	alx_ifl_rxd_refill(void *, if_rxd_update_t);
+static void	alx_ifl_rxd_flush(void *, uint16_t, uint8_t, qidx_t);
+
+static pci_vendor_info_t alx_ifl_vendor_info[] = {
+	PVID(ALX_VENDOR_ID, ALX_DEV_ID_AR8161,
+	    "Qualcomm Atheros AR8161 Gigabit Ethernet"),
+	PVID(ALX_VENDOR_ID, ALX_DEV_ID_AR8162,
+	    "Qualcomm Atheros AR8162 Fast Ethernet"),
+	PVID(ALX_VENDOR_ID, ALX_DEV_ID_AR8171,
+	    "Qualcomm Atheros AR8171 Gigabit Ethernet"),
+	PVID(ALX_VENDOR_ID, ALX_DEV_ID_AR8172,
+	    "Qualcomm Atheros AR8172 Fast Ethernet"),
+	PVID(ALX_VENDOR_ID, ALX_DEV_ID_KI2201,
+	    "Qualcomm Atheros Killer E2201 Gigabit Ethernet"),
+	PVID_END
+};
+
+static device_method_t alx_ifl_methods[] = {
+	DEVMETHOD(device_register,	alx_ifl_register),
+	DEVMETHOD(device_probe,		iflib_device_probe),
+	DEVMETHOD(device_attach,	iflib_device_attach),
+	DEVMETHOD(device_detach,	iflib_device_detach),
+	DEVMETHOD(device_shutdown,	iflib_device_shutdown),
+	DEVMETHOD(device_suspend,	iflib_device_suspend),
+	DEVMETHOD(device_resume,	iflib_device_resume),
+
+	DEVMETHOD_END
+};
+
+static driver_t alx_ifl_driver = {
+	"alx",
+	alx_ifl_methods,
+	sizeof(struct alx_ifl_softc)
+};
+
+static devclass_t alx_ifl_devclass;
+
+DRIVER_MODULE(alx, pci, alx_ifl_driver, alx_ifl_devclass, 0, 0);
+IFLIB_PNP_INFO(pci, alx, alx_ifl_vendor_info);
+MODULE_DEPEND(alx, pci, 1, 1, 1);
+MODULE_DEPEND(alx, ether, 1, 1, 1);
+MODULE_DEPEND(alx, iflib, 1, 1, 1);
+
+static device_method_t alx_ifl_if_methods[] = {
+	DEVMETHOD(ifdi_attach_pre,	alx_ifl_attach_pre),
+	DEVMETHOD(ifdi_attach_post,	alx_ifl_attach_post),
+	DEVMETHOD(ifdi_detach,		alx_ifl_detach),
+	DEVMETHOD(ifdi_init,		alx_ifl_init),
+	DEVMETHOD(ifdi_stop,		alx_ifl_stop),
+	DEVMETHOD(ifdi_tx_queues_alloc,	alx_ifl_tx_queues_alloc),
+	DEVMETHOD(ifdi_rx_queues_alloc,	alx_ifl_rx_queues_alloc),
+	DEVMETHOD(ifdi_queues_free,	alx_ifl_queues_free),
+	DEVMETHOD(ifdi_msix_intr_assign, alx_ifl_msix_intr_assign),
+	DEVMETHOD(ifdi_intr_enable,	alx_ifl_intr_enable),
+	DEVMETHOD(ifdi_intr_disable,	alx_ifl_intr_disable),
+	DEVMETHOD(ifdi_rx_queue_intr_enable, alx_ifl_rx_queue_intr_enable),
+	DEVMETHOD(ifdi_tx_queue_intr_enable, alx_ifl_tx_queue_intr_enable),
+	DEVMETHOD(ifdi_multi_set,	alx_ifl_multi_set),
+	DEVMETHOD(ifdi_mtu_set,		alx_ifl_mtu_set),
+	DEVMETHOD(ifdi_media_status,	alx_ifl_media_status),
+	DEVMETHOD(ifdi_media_change,	alx_ifl_media_change),
+	DEVMETHOD(ifdi_promisc_set,	alx_ifl_promisc_set),
+	DEVMETHOD(ifdi_update_admin_status, alx_ifl_update_admin_status),
+	DEVMETHOD(ifdi_timer,		alx_ifl_timer),
+	DEVMETHOD(ifdi_get_counter,	alx_ifl_get_counter),
+
+	DEVMETHOD_END
+};
+
+static driver_t alx_ifl_if_driver = {
+	"alx_if",
+	alx_ifl_if_methods,
+	sizeof(struct alx_ifl_softc)
+};
+
+static struct if_txrx alx_ifl_txrx = {
+	.ift_txd_encap = alx_ifl_txd_encap,
+	.ift_txd_flush = alx_ifl_txd_flush,
+	.ift_txd_credits_update = alx_ifl_txd_credits_update,
+	.ift_rxd_available = alx_ifl_rxd_available,
+	.ift_rxd_pkt_get = alx_ifl_rxd_pkt_get,
+	.ift_rxd_refill = alx_ifl_rxd_refill,
+	.ift_rxd_flush = alx_ifl_rxd_flush,
+	.ift_legacy_intr = alx_ifl_intr_legacy,
+};
+
+static struct if_shared_ctx alx_ifl_sctx_init = {
+	.isc_magic = IFLIB_MAGIC,
+	.isc_q_align = CACHE_LINE_SIZE,
+	.isc_tx_maxsize = ALX_TSO_MAXSIZE,
+	.isc_tx_maxsegsize = ALX_TSO_MAXSEGSIZE,
+	.isc_tso_maxsize = ALX_TSO_MAXSIZE,
+	.isc_tso_maxsegsize = ALX_TSO_MAXSEGSIZE,
+	.isc_rx_maxsize = MJUM9BYTES,
+	.isc_rx_nsegments = 1,
+	.isc_rx_maxsegsize = MJUM9BYTES,
+	.isc_nfl = 1,
+	.isc_ntxqs = 1,
+	.isc_nrxqs = 2,
+	.isc_admin_intrcnt = 1,
+	.isc_vendor_info = alx_ifl_vendor_info,
+	.isc_driver_version = "1",
+	.isc_driver = &alx_ifl_if_driver,
+	/* iflib zeroes ip_sum and seeds th_sum the way alx_tx_offload() does. */
+	.isc_flags = IFLIB_HAS_RXCQ | IFLIB_TSO_INIT_IP,
+	.isc_ntxd_min = { ALX_IFL_TXD_MIN },
+	.isc_ntxd_max = { ALX_IFL_TXD_MAX },
+	.isc_ntxd_default = { ALX_IFL_TXD_DEF },
+	.isc_nrxd_min = { ALX_IFL_RXD_MIN, ALX_IFL_RXD_MIN },
+	.isc_nrxd_max = { ALX_IFL_RXD_MAX, ALX_IFL_RXD_MAX },
+	.isc_nrxd_default = { ALX_IFL_RXD_DEF, ALX_IFL_RXD_DEF },
+};
+
+static void *
+alx_ifl_register(device_t dev)
+{
+
+	return (&alx_ifl_sctx_init);
+}
+
+/* The ring and datapath settings of alx_init_sw() are iflib's. */
+static int
+alx_ifl_init_sw(struct alx_ifl_softc *sc)
+{
+	struct alx_hw *hw;
+	int error;
+
+	hw = &sc->hw;
+
+	error = alx_init_hw_sw(hw);
+	if (error != 0) {
+		device_printf(sc->dev, "unrecognized chip, aborting\n");
+		return (error);
+	}
+
+	/* With one RX queue the indirection table is all zeroes. */
+	memset(hw->rss_idt, 0, sizeof(hw->rss_idt));
+	hw->imt = ALX_IMT_BULK;
+	hw->ith_tpd = ALX_IFL_TXD_DEF / 3;
+
+	return (0);
+}
+
+static int
+alx_ifl_attach_pre(if_ctx_t ctx)
+{
+	struct alx_ifl_softc *sc;
+	struct alx_hw *hw;
+	if_softc_ctx_t scctx;
+	device_t dev;
+	bool phy_cfged;
+	int error, rid;
+
+	sc = iflib_get_softc(ctx);
+	dev = iflib_get_dev(ctx);
+	sc->ctx = ctx;
+	sc->dev = dev;
+	sc->scctx = scctx = iflib_get_softc_ctx(ctx);
+	sc->media = iflib_get_media(ctx);
+	hw = &sc->hw;
+
+	mtx_init(&hw->mdio_lock, "alx mdio", NULL, MTX_DEF);
+
+	rid = PCIR_BAR(0);
+	sc->res = bus_alloc_resource_any(dev, SYS_RES_MEMORY, &rid,
+	    RF_ACTIVE);
+	if (sc->res == NULL) {
+		device_printf(dev, "cannot allocate memory resources\n");
+		error = ENXIO;
+		goto fail;
+	}
+	hw->hw_addr = sc->res;
+	hw->dev = dev;
+
+	pci_enable_busmaster(dev);
+
+	error = alx_ifl_init_sw(sc);
+	if (error != 0) {
+		error = ENXIO;
+		goto fail;
+	}
+
+	alx_reset_pcie(hw);
+
+	phy_cfged = alx_phy_configed(hw);
+	if (!phy_cfged)
+		alx_reset_phy(hw, !hw->hib_patch);
+
+	error = alx_reset_mac(hw);
+	if (error != 0) {
+		device_printf(dev, "MAC reset failed with error %d\n", error);
+		error = ENXIO;
+		goto fail;
+	}
+
+	if (!phy_cfged) {
+		error = alx_setup_speed_duplex(hw, hw->adv_cfg, hw->flowctrl);
+		if (error != 0) {
+			device_printf(dev,
+			    "failed to configure PHY with error %d\n", error);
+			error = ENXIO;
+			goto fail;
+		}
+	}
+
+	error = alx_get_perm_macaddr(hw, hw->perm_addr);
+	if (error != 0) {
+		device_printf(dev, "could not retrieve MAC address\n");
+		error = ENXIO;
+		goto fail;
+	}
+	memcpy(&hw->mac_addr, &hw->perm_addr, ETHER_ADDR_LEN);
+	iflib_set_mac(ctx, hw->mac_addr);
+
+	if (!alx_get_phy_info(hw)) {
+		device_printf(dev, "failed to identify PHY\n");
+		error = ENXIO;
+		goto fail;
+	}
+
+	scctx->isc_ntxqsets_max = ALX_CAP(hw, MTQ) ? ALX_MAX_TX_QUEUES : 1;
+	scctx->isc_nrxqsets_max = 1;
+	scctx->isc_txqsizes[0] = roundup2(scctx->isc_ntxd[0] *
+	    sizeof(struct tpd_desc), CACHE_LINE_SIZE);
+	scctx->isc_rxqsizes[ALX_IFL_RRD_RING] = roundup2(
+	    scctx->isc_nrxd[ALX_IFL_RRD_RING] * sizeof(struct rrd_desc),
+	    CACHE_LINE_SIZE);
+	scctx->isc_rxqsizes[ALX_IFL_RFD_RING] = roundup2(
+	    scctx->isc_nrxd[ALX_IFL_RFD_RING] * sizeof(struct rfd_desc),
+	    CACHE_LINE_SIZE);
+	scctx->isc_txrx = &alx_ifl_txrx;
+	scctx->isc_msix_bar = pci_msix_table_bar(dev);
+	/* Leave room for the extra LSOv2 descriptor. */
+	scctx->isc_tx_nsegments = ALX_MAXTXSEGS - 1;
+	scctx->isc_tx_tso_segments_max = ALX_MAXTXSEGS - 1;
+	scctx->isc_tx_tso_size_max = ALX_TSO_MAXSIZE;
+	scctx->isc_tx_tso_segsize_max = ALX_TSO_MAXSEGSIZE;
+	scctx->isc_tx_csum_flags = ALX_CSUM_FEATURES | CSUM_TSO;
+	scctx->isc_max_frame_size = ALX_RAW_MTU(ETHERMTU);
+	scctx->isc_rss_table_size = hw->rss_idt_size;
+	scctx->isc_capabilities = scctx->isc_capenable = IFCAP_TXCSUM |
+	    IFCAP_TXCSUM_IPV6 | IFCAP_RXCSUM | IFCAP_TSO4 | IFCAP_TSO6 |
+	    IFCAP_VLAN_MTU | IFCAP_VLAN_HWTAGGING | IFCAP_VLAN_HWCSUM |
+	    IFCAP_VLAN_HWTSO | IFCAP_JUMBO_MTU | IFCAP_LRO;
+
+	return (0);
+
+fail:
+	if (sc->res != NULL)
+		bus_release_resource(dev, SYS_RES_MEMORY, PCIR_BAR(0),
+		    sc->res);
+	mtx_destroy(&hw->mdio_lock);
+	return (error);
+}
+
+static int
+alx_ifl_attach_post(if_ctx_t ctx)
+{
+	struct alx_ifl_softc *sc;
+
+	sc = iflib_get_softc(ctx);
+
+	ifmedia_add(sc->media, IFM_ETHER | IFM_AUTO, 0, NULL);
+	ifmedia_add(sc->media, IFM_ETHER | IFM_10_T, 0, NULL);
+	ifmedia_add(sc->media, IFM_ETHER | IFM_10_T | IFM_FDX, 0, NULL);
+	ifmedia_add(sc->media, IFM_ETHER | IFM_100_TX, 0, NULL);
+	ifmedia_add(sc->media, IFM_ETHER | IFM_100_TX | IFM_FDX, 0, NULL);
+	if (ALX_CAP(&sc->hw, GIGA)) {
+		ifmedia_add(sc->media, IFM_ETHER | IFM_1000_T, 0, NULL);
+		ifmedia_add(sc->media, IFM_ETHER | IFM_1000_T | IFM_FDX, 0,
+		    NULL);
+	}
+	ifmedia_set(sc->media, IFM_ETHER | IFM_AUTO);
+
+	SYSCTL_ADD_U64(device_get_sysctl_ctx(sc->dev),
+	    SYSCTL_CHILDREN(device_get_sysctl_tree(sc->dev)), OID_AUTO,
+	    "rx_errors", CTLFLAG_RD, &sc->rxq.rx_errors, 0,
+	    "Received frames dropped for RRD errors");
+
+	return (0);
+}
+
+static int
+alx_ifl_detach(if_ctx_t ctx)
+{
+	struct alx_ifl_softc *sc;
+
+	sc = iflib_get_softc(ctx);
+
+	/* Restore permanent mac address. */
+	alx_set_macaddr(&sc->hw, sc->hw.perm_addr);
+
+	iflib_irq_free(ctx, &sc->rxq.irq);
+	iflib_irq_free(ctx, &sc->admin_irq);
+
+	if (sc->res != NULL)
+		bus_release_resource(sc->dev, SYS_RES_MEMORY, PCIR_BAR(0),
+		    sc->res);
+	mtx_destroy(&sc->hw.mdio_lock);
+
+	return (0);
+}
+
+static void
+alx_ifl_reset(struct alx_ifl_softc *sc)
+{
+	struct alx_hw *hw;
+
+	hw = &sc->hw;
+
+	alx_reset_pcie(hw);
+	if (!alx_phy_configed(hw))
+		alx_reset_phy(hw, !hw->hib_patch);
+	if (alx_reset_mac(hw))
+		device_printf(sc->dev, "failed to reset MAC\n");
+}
+
+/*
+ * The RX ring and every TX ring share vector 1; alx_ifl_intr_ring() sorts
+ * out which TX queues need attention.
+ */
+static void
+alx_ifl_map_msix(struct alx_ifl_softc *sc)
+{
+	struct alx_hw *hw;
+	uint32_t tbl[2];
+	int i;
+
+	hw = &sc->hw;
+	tbl[0] = tbl[1] = 0;
+
+	if (sc->scctx->isc_intr == IFLIB_INTR_MSIX) {
+		tbl[0] |= (uint32_t)ALX_IFL_RING_VEC <<
+		    ALX_MSI_MAP_TBL1_RXQ0_SHIFT;
+		for (i = 0; i < sc->ntxq; i++)
+			tbl[alx_txq_vec_map[i][0]] |=
+			    (uint32_t)ALX_IFL_RING_VEC <<
+			    alx_txq_vec_map[i][1];
+	}
+
+	ALX_MEM_W32(hw, ALX_MSI_MAP_TBL1, tbl[0]);
+	ALX_MEM_W32(hw, ALX_MSI_MAP_TBL2, tbl[1]);
+	ALX_MEM_W32(hw, ALX_MSI_ID_MAP, 0);
+}
+
+static void
+alx_ifl_init(if_ctx_t ctx)
+{
+	struct alx_ifl_softc *sc;
+	struct alx_hw *hw;
+	struct alx_ifl_tx_queue *txq;
+	struct alx_ifl_rx_queue *rxq;
+	if_softc_ctx_t scctx;
+	struct ifnet *ifp;
+	int q;
+
+	sc = iflib_get_softc(ctx);
+	scctx = sc->scctx;
+	ifp = iflib_get_ifp(ctx);
+	hw = &sc->hw;
+
+	alx_ifl_reset(sc);
+
+	memcpy(hw->mac_addr, if_getlladdr(ifp), ETHER_ADDR_LEN);
+	hw->mtu = if_getmtu(ifp);
+	hw->ith_tpd = scctx->isc_ntxd[0] / 3;
+	/* This also programs the MAC address, the MTU and moderation. */
+	alx_configure_basic(hw);
+
+	hw->imask = ALX_ISR_MISC | ALX_ISR_RX_Q0;
+	for (q = 0; q < sc->ntxq; q++) {
+		txq = &sc->txq[q];
+		txq->cidx = 0;
+		ALX_MEM_W32(hw, alx_txq_regs[q].addr_lo, txq->tpd_pa);
+		hw->imask |= alx_txq_isr[q];
+	}
+	ALX_MEM_W32(hw, ALX_TX_BASE_ADDR_HI, sc->txq[0].tpd_pa >> 32);
+	ALX_MEM_W32(hw, ALX_TPD_RING_SZ, scctx->isc_ntxd[0]);
+
+	rxq = &sc->rxq;
+	bzero(rxq->rrd, scctx->isc_rxqsizes[ALX_IFL_RRD_RING]);
+	ALX_MEM_W32(hw, ALX_RX_BASE_ADDR_HI, rxq->rfd_pa >> 32);
+	ALX_MEM_W32(hw, ALX_RRD_ADDR_LO, rxq->rrd_pa);
+	ALX_MEM_W32(hw, ALX_RFD_ADDR_LO, rxq->rfd_pa);
+	ALX_MEM_W32(hw, ALX_RRD_RING_SZ, scctx->isc_nrxd[ALX_IFL_RRD_RING]);
+	ALX_MEM_W32(hw, ALX_RFD_RING_SZ, scctx->isc_nrxd[ALX_IFL_RFD_RING]);
+	ALX_MEM_W32(hw, ALX_RFD_BUF_SZ, iflib_get_rx_mbuf_sz(ctx));
+
+	alx_configure_rss(hw, ALX_CAP(hw, RSS));
+	alx_ifl_map_msix(sc);
+
+	/*
+	 * Load the DMA pointers. iflib fills the free list and writes the RFD
+	 * producer index once we return.
+	 */
+	ALX_MEM_W32(hw, ALX_SRAM9, ALX_SRAM_LOAD_PTR);
+
+	if ((if_getcapenable(ifp) & IFCAP_VLAN_HWTAGGING) != 0)
+		hw->rx_ctrl |= ALX_MAC_CTRL_VLANSTRIP;
+	else
+		hw->rx_ctrl &= ~ALX_MAC_CTRL_VLANSTRIP;
+	alx_ifl_rxfilter(sc);
+
+	/* The admin task starts the MAC once the PHY reports a link. */
+	hw->link_up = false;
+	hw->link_speed = 0;
+	hw->link_duplex = 0;
+	iflib_admin_intr_deferred(ctx);
+}
+
+static void
+alx_ifl_stop(if_ctx_t ctx)
+{
+	struct alx_ifl_softc *sc;
+	struct alx_hw *hw;
+
+	sc = iflib_get_softc(ctx);
+	hw = &sc->hw;
+
+	alx_ifl_intr_disable(ctx);
+	if (alx_stop_mac(hw) != 0)
+		device_printf(sc->dev, "failed to stop MAC\n");
+	__alx_update_hw_stats(hw);
+
+	hw->link_up = false;
+	hw->link_speed = 0;
+	hw->link_duplex = 0;
+}
+
+/*
+ * The chip has a single high address register for all of the TPD rings, and
+ * another for the RFD and RRD rings, so every ring in a group must sit in the
+ * same 4GB region. iflib allocates the rings separately; check that they do.
+ */
+static int
+alx_ifl_tx_queues_alloc(if_ctx_t ctx, caddr_t *vaddrs, uint64_t *paddrs,
+    int ntxqs, int ntxqsets)
+{
+	struct alx_ifl_softc *sc;
+	struct alx_ifl_tx_queue *txq;
+	int q;
+
+	sc = iflib_get_softc(ctx);
+
+	MPASS(ntxqs == 1);
+	MPASS(ntxqsets <= ALX_MAX_TX_QUEUES);
+
+	for (q = 0; q < ntxqsets; q++) {
+		txq = &sc->txq[q];
+		txq->sc = sc;
+		txq->qidx = q;
+		txq->tpd = (struct tpd_desc *)vaddrs[q * ntxqs];
+		txq->tpd_pa = paddrs[q * ntxqs];
+		txq->p_reg = alx_txq_regs[q].pidx;
+		txq->c_reg = alx_txq_regs[q].cidx;
+		txq->cidx = 0;
+		if ((txq->tpd_pa >> 32) != (sc->txq[0].tpd_pa >> 32)) {
+			device_printf(sc->dev,
+			    "TX rings span a 4GB boundary\n");
+			return (ENOMEM);
+		}
+	}
+	sc->ntxq = ntxqsets;
+
+	return (0);
+}
+
+static int
+alx_ifl_rx_queues_alloc(if_ctx_t ctx, caddr_t *vaddrs, uint64_t *paddrs,
+    int nrxqs, int nrxqsets)
+{
+	struct alx_ifl_softc *sc;
+	struct alx_ifl_rx_queue *rxq;
+
+	sc = iflib_get_softc(ctx);
+
+	MPASS(nrxqs == 2);
+	MPASS(nrxqsets == 1);
+
+	rxq = &sc->rxq;
+	rxq->sc = sc;
+	rxq->qidx = 0;
+	rxq->rrd = (struct rrd_desc *)vaddrs[ALX_IFL_RRD_RING];
+	rxq->rrd_pa = paddrs[ALX_IFL_RRD_RING];
+	rxq->rfd = (struct rfd_desc *)vaddrs[ALX_IFL_RFD_RING];
+	rxq->rfd_pa = paddrs[ALX_IFL_RFD_RING];
+	if ((rxq->rrd_pa >> 32) != (rxq->rfd_pa >> 32)) {
+		device_printf(sc->dev, "RX rings span a 4GB boundary\n");
+		return (ENOMEM);
+	}
+
+	return (0);
+}
+
+static void
+alx_ifl_queues_free(if_ctx_t ctx)
+{
+	struct alx_ifl_softc *sc;
+
+	/* The rings belong to iflib; just forget about them. */
+	sc = iflib_get_softc(ctx);
+	bzero(sc->txq, sizeof(sc->txq));
+	bzero(&sc->rxq, sizeof(sc->rxq));
+	sc->ntxq = 0;
+}
+
+/*
+ * Vector 0 handles PHY and other miscellaneous events, vector 1 the rings.
+ * TX queues other than the first are driven from vector 1's filter.
+ */
+static int
+alx_ifl_msix_intr_assign(if_ctx_t ctx, int msix)
+{
+	struct alx_ifl_softc *sc;
+	char buf[16];
+	int error, q;
+
+	sc = iflib_get_softc(ctx);
+
+	error = iflib_irq_alloc_generic(ctx, &sc->admin_irq, 1,
+	    IFLIB_INTR_ADMIN, alx_ifl_intr_misc, sc, 0, "admin");
+	if (error != 0) {
+		device_printf(sc->dev,
+		    "failed to allocate admin interrupt: %d\n", error);
+		return (error);
+	}
+
+	error = iflib_irq_alloc_generic(ctx, &sc->rxq.irq,
+	    ALX_IFL_RING_VEC + 1, IFLIB_INTR_RXTX, alx_ifl_intr_ring,
+	    &sc->rxq, 0, "rxq0");
+	if (error != 0) {
+		device_printf(sc->dev,
+		    "failed to allocate ring interrupt: %d\n", error);
+		iflib_irq_free(ctx, &sc->admin_irq);
+		return (error);
+	}
+
+	for (q = 0; q < sc->ntxq; q++) {
+		snprintf(buf, sizeof(buf), "txq%d", q);
+		iflib_softirq_alloc_generic(ctx, &sc->rxq.irq, IFLIB_INTR_TX,
+		    &sc->txq[q], q, buf);
+	}
+
+	return (0);
+}
+
+static void
+alx_ifl_intr_enable(if_ctx_t ctx)
+{
+	struct alx_ifl_softc *sc;
+	struct alx_hw *hw;
+
+	sc = iflib_get_softc(ctx);
+	hw = &sc->hw;
+
+	ALX_MEM_W32(hw, ALX_ISR, 0);
+	ALX_MEM_W32(hw, ALX_IMR, hw->imask);
+	ALX_MEM_FLUSH(hw);
+
+	if (sc->scctx->isc_intr == IFLIB_INTR_MSIX) {
+		alx_mask_msix(hw, 0, false);
+		alx_mask_msix(hw, ALX_IFL_RING_VEC, false);
+	}
+}
+
+static void
+alx_ifl_intr_disable(if_ctx_t ctx)
+{
+	struct alx_ifl_softc *sc;
+	struct alx_hw *hw;
+
+	sc = iflib_get_softc(ctx);
+	hw = &sc->hw;
+
+	ALX_MEM_W32(hw, ALX_ISR, ALX_ISR_DIS);
+	ALX_MEM_W32(hw, ALX_IMR, 0);
+	ALX_MEM_FLUSH(hw);
+
+	if (sc->scctx->isc_intr == IFLIB_INTR_MSIX) {
+		alx_mask_msix(hw, 0, true);
+		alx_mask_msix(hw, ALX_IFL_RING_VEC, true);
+	}
+}
+
+/*
+ * All of the rings share one vector (or, without MSI-X, the queue bits in
+ * the IMR), so enabling any queue's interrupt enables them all.
+ */
+static int
+alx_ifl_rx_queue_intr_enable(if_ctx_t ctx, uint16_t qid)
+{
+	struct alx_ifl_softc *sc;
+	struct alx_hw *hw;
+
+	sc = iflib_get_softc(ctx);
+	hw = &sc->hw;
+
+	if (sc->scctx->isc_intr == IFLIB_INTR_MSIX)
+		alx_mask_msix(hw, ALX_IFL_RING_VEC, false);
+	else
+		ALX_MEM_W32(hw, ALX_IMR, hw->imask);
+
+	return (0);
+}
+
+static int
+alx_ifl_tx_queue_intr_enable(if_ctx_t ctx, uint16_t qid)
+{
+
+	return (alx_ifl_rx_queue_intr_enable(ctx, qid));
+}
+
+static u_int
+alx_ifl_hash_maddr(void *arg, struct sockaddr_dl *sdl, u_int cnt)
+{
+	struct alx_hw *hw;
+
+	hw = arg;
+	alx_add_mc_addr(hw, LLADDR(sdl));
+	return (1);
+}
+
+/*
+ * Program the promiscuous and all-multicast bits and the multicast hash
+ * table from the interface's flags and multicast list.
+ */
+static void
+alx_ifl_rxfilter(struct alx_ifl_softc *sc)
+{
+	struct ifnet *ifp;
+	struct alx_hw *hw;
+	int flags;
+
+	ifp = iflib_get_ifp(sc->ctx);
+	hw = &sc->hw;
+	flags = if_getflags(ifp);
+
+	hw->rx_ctrl &= ~(ALX_MAC_CTRL_PROMISC_EN | ALX_MAC_CTRL_MULTIALL_EN);
+	if ((flags & IFF_PROMISC) != 0)
+		hw->rx_ctrl |= ALX_MAC_CTRL_PROMISC_EN;
+	if ((flags & (IFF_PROMISC | IFF_ALLMULTI)) != 0) {
+		hw->rx_ctrl |= ALX_MAC_CTRL_MULTIALL_EN;
+		hw->mc_hash[0] = hw->mc_hash[1] = 0xFFFFFFFF;
+	} else {
+		hw->mc_hash[0] = hw->mc_hash[1] = 0;
+		if_foreach_llmaddr(ifp, alx_ifl_hash_maddr, hw);
+	}
+
+	ALX_MEM_W32(hw, ALX_HASH_TBL0, hw->mc_hash[0]);
+	ALX_MEM_W32(hw, ALX_HASH_TBL1, hw->mc_hash[1]);
+	ALX_MEM_W32(hw, ALX_MAC_CTRL, hw->rx_ctrl);
+}
+
+static void
+alx_ifl_multi_set(if_ctx_t ctx)
+{
+
+	alx_ifl_rxfilter(iflib_get_softc(ctx));
+}
+
+static int
+alx_ifl_promisc_set(if_ctx_t ctx, int flags)
+{
+
+	/* alx_ifl_rxfilter() reads the flags from the ifnet. */
+	alx_ifl_rxfilter(iflib_get_softc(ctx));
+	return (0);
+}
+
+static int
+alx_ifl_mtu_set(if_ctx_t ctx, uint32_t mtu)
+{
+	struct alx_ifl_softc *sc;
+
+	sc = iflib_get_softc(ctx);
+
+	if (mtu < ALX_MIN_MTU || mtu > ALX_MAX_MTU)
+		return (EINVAL);
+	/* iflib reinitializes the interface, which picks up the new MTU. */
+	sc->scctx->isc_max_frame_size = ALX_RAW_MTU(mtu);
+	return (0);
+}
+
+static int
+alx_ifl_media_change(if_ctx_t ctx)
+{
+
+	return (0);
+}
+
+static void
+alx_ifl_media_status(if_ctx_t ctx, struct ifmediareq *ifmr)
+{
+	struct alx_ifl_softc *sc;
+	struct alx_hw *hw;
+
+	sc = iflib_get_softc(ctx);
+	hw = &sc->hw;
+
+	ifmr->ifm_status = IFM_AVALID;
+	ifmr->ifm_active = IFM_ETHER;
+
+	if (!hw->link_up)
+		return;
+	ifmr->ifm_status |= IFM_ACTIVE;
+
+	switch (hw->link_duplex) {
+	case ALX_FULL_DUPLEX:
+		ifmr->ifm_active |= IFM_FDX;
+		break;
+	case ALX_HALF_DUPLEX:
+		ifmr->ifm_active |= IFM_HDX;
+		break;
+	}
+
+	switch (hw->link_speed) {
+	case SPEED_10:
+		ifmr->ifm_active |= IFM_10_T;
+		break;
+	case SPEED_100:
+		ifmr->ifm_active |= IFM_100_TX;
+		break;
+	case SPEED_1000:
+		ifmr->ifm_active |= IFM_1000_T;
+		break;
+	}
+}
+
+/*
+ * Runs from iflib's admin task, which may sleep, so the MDIO accesses here
+ * don't hold up the datapath. Rather than resetting the MAC when the link
+ * goes down, as alx_update_link() does, just stop it: the rings stay
+ * programmed and alx_start_mac() picks up where it left off.
+ */
+static void
+alx_ifl_update_admin_status(if_ctx_t ctx)
+{
+	struct alx_ifl_softc *sc;
+	struct alx_hw *hw;
+	bool link_up;
+	uint16_t speed;
+
+	sc = iflib_get_softc(ctx);
+	hw = &sc->hw;
+
+	/* Acknowledge the PHY interrupt and let the next one in. */
+	alx_clear_phy_intr(hw);
+	if ((if_getdrvflags(iflib_get_ifp(ctx)) & IFF_DRV_RUNNING) == 0)
+		return;
+	if ((hw->imask & ALX_ISR_PHY) == 0) {
+		hw->imask |= ALX_ISR_PHY;
+		ALX_MEM_W32(hw, ALX_IMR, hw->imask);
+	}
+
+	if (alx_get_phy_link(hw, &link_up, &speed) != 0)
+		return;
+
+	if (link_up) {
+		if (hw->link_up && hw->link_speed + hw->link_duplex == speed)
+			return;
+
+		hw->link_up = true;
+		hw->link_duplex = speed % 10;
+		hw->link_speed = speed - hw->link_duplex;
+
+		alx_post_phy_link(hw, hw->link_speed, ALX_PM_CAP(hw, AZ));
+		alx_enable_aspm(hw, ALX_PM_CAP(hw, L0S), ALX_PM_CAP(hw, L1));
+		alx_start_mac(hw);
+
+		iflib_link_state_change(ctx, LINK_STATE_UP,
+		    IF_Mbps(hw->link_speed));
+	} else {
+		if (!hw->link_up)
+			return;
+
+		hw->link_up = false;
+		hw->link_duplex = 0;
+		hw->link_speed = 0;
+
+		__alx_update_hw_stats(hw);
+		if (alx_stop_mac(hw) != 0)
+			device_printf(sc->dev, "failed to stop MAC\n");
+		alx_enable_aspm(hw, false, ALX_PM_CAP(hw, L1));
+		alx_post_phy_link(hw, 0, ALX_PM_CAP(hw, AZ));
+
+		iflib_link_state_change(ctx, LINK_STATE_DOWN, 0);
+	}
+}
+
+/*
+ * Called twice a second for each TX queue. Harvest the MAC counters once per
+ * round, on the first queue, and keep polling the PHY until the link comes
+ * up.
+ */
+static void
+alx_ifl_timer(if_ctx_t ctx, uint16_t qid)
+{
+	struct alx_ifl_softc *sc;
+
+	if (qid != 0)
+		return;
+
+	sc = iflib_get_softc(ctx);
+	__alx_update_hw_stats(&sc->hw);
+	if (!sc->hw.link_up)
+		iflib_admin_intr_deferred(ctx);
+}
+
+/*
+ * iflib counts packets and bytes itself; errors and collisions come from the
+ * MAC.
+ */
+static uint64_t
+alx_ifl_get_counter(if_ctx_t ctx, ift_counter cnt)
+{
+	struct alx_ifl_softc *sc;
+	struct alx_hw_stats *stats;
+	uint64_t val;
+
+	sc = iflib_get_softc(ctx);
+	stats = &sc->hw.stats;
+
+	val = 0;
+	switch (cnt) {
+	case IFCOUNTER_COLLISIONS:
+		val = stats->tx_single_col + stats->tx_multi_col +
+		    stats->tx_late_col + stats->tx_abort_col;
+		break;
+	case IFCOUNTER_IERRORS:
+		val = stats->rx_frag + stats->rx_fcs_err + stats->rx_len_err +
+		    stats->rx_ov_sz + stats->rx_align_err;
+		break;
+	case IFCOUNTER_OERRORS:
+		val = stats->tx_late_col + stats->tx_abort_col +
+		    stats->tx_underrun + stats->tx_trunc;
+		break;
+	case IFCOUNTER_IQDROPS:
+		val = stats->rx_ov_rxf + stats->rx_ov_rrd;
+		break;
+	default:
+		break;
+	}
+
+	return (val + if_get_counter_default(iflib_get_ifp(ctx), cnt));
+}
+
+/*
+ * INTx and MSI: a single filter for everything, as in alx_intr_legacy(). The
+ * queue bits stay masked in the IMR until iflib re-enables the queue.
+ */
+static int
+alx_ifl_intr_legacy(void *arg)
+{
+	struct alx_ifl_softc *sc;
+	struct alx_hw *hw;
+	uint32_t intr;
+	int q;
+
+	sc = arg;
+	hw = &sc->hw;
+
+	ALX_MEM_R32(hw, ALX_ISR, &intr);
+	if (intr & ALX_ISR_DIS || (intr & hw->imask) == 0)
+		return (FILTER_STRAY);
+
+	/* Acknowledge and disable interrupts. */
+	ALX_MEM_W32(hw, ALX_ISR, intr | ALX_ISR_DIS);
+
+	intr &= hw->imask;
+	if (intr & ALX_ISR_PHY) {
+		hw->imask &= ~ALX_ISR_PHY;
+		ALX_MEM_W32(hw, ALX_IMR, hw->imask);
+		iflib_admin_intr_deferred(sc->ctx);
+	}
+
+	if (intr & ALX_ISR_ALL_QUEUES) {
+		ALX_MEM_W32(hw, ALX_IMR, hw->imask & ~ALX_ISR_ALL_QUEUES);
+		/* iflib handles the first TX queue along with the RX queue. */
+		for (q = 1; q < sc->ntxq; q++)
+			if (intr & alx_txq_isr[q])
+				iflib_tx_intr_deferred(sc->ctx, q);
+	}
+
+	ALX_MEM_W32(hw, ALX_ISR, 0);
+
+	return ((intr & ALX_ISR_ALL_QUEUES) != 0 ?
+	    FILTER_SCHEDULE_THREAD : FILTER_HANDLED);
+}
+
+static int
+alx_ifl_intr_misc(void *arg)
+{
+	struct alx_ifl_softc *sc;
+	struct alx_hw *hw;
+	uint32_t intr;
+
+	sc = arg;
+	hw = &sc->hw;
+
+	/* Mask the vector to acknowledge the interrupt. */
+	alx_mask_msix(hw, 0, true);
+
+	ALX_MEM_R32(hw, ALX_ISR, &intr);
+	intr &= hw->imask & ~ALX_ISR_ALL_QUEUES;
+	if (intr & ALX_ISR_PHY) {
+		hw->imask &= ~ALX_ISR_PHY;
+		ALX_MEM_W32(hw, ALX_IMR, hw->imask);
+		iflib_admin_intr_deferred(sc->ctx);
+	}
+
+	ALX_MEM_W32(hw, ALX_ISR, intr);
+	alx_mask_msix(hw, 0, false);
+
+	return (FILTER_HANDLED);
+}
+
+/*
+ * Mask the ring vector and clear its status bits; iflib unmasks it through
+ * the queue interrupt enable methods once it has caught up.
+ */
+static int
+alx_ifl_intr_ring(void *arg)
+{
+	struct alx_ifl_rx_queue *rxq;
+	struct alx_ifl_softc *sc;
+	struct alx_hw *hw;
+	uint32_t intr;
+	int q;
+
+	rxq = arg;
+	sc = rxq->sc;
+	hw = &sc->hw;
+
+	alx_mask_msix(hw, ALX_IFL_RING_VEC, true);
+	ALX_MEM_R32(hw, ALX_ISR, &intr);
+	intr &= ALX_ISR_ALL_QUEUES;
+	ALX_MEM_W32(hw, ALX_ISR, intr);
+
+	/* iflib handles the first TX queue along with the RX queue. */
+	for (q = 1; q < sc->ntxq; q++)
+		if (intr & alx_txq_isr[q])
+			iflib_tx_intr_deferred(sc->ctx, q);
+
+	return (FILTER_SCHEDULE_THREAD);
+}
+
+/*
+ * Work out the offload flags for a frame from the headers iflib has already
+ * parsed. This is alx_tx_offload() without the mbuf surgery.
+ */
+static uint32_t
+alx_ifl_tx_offload(if_pkt_info_t pi)
+{
+	uint32_t cflags;
+	int csum_off, poff;
+
+	if ((pi->ipi_csum_flags & (ALX_CSUM_FEATURES | CSUM_TSO)) == 0)
+		return (0);
+
+	cflags = 0;
+	/* The tag is already in the frame. */
+	if (pi->ipi_ehdrlen == sizeof(struct ether_vlan_header))
+		cflags |= 1 << TPD_VLTAGGED_SHIFT;
+
+	poff = pi->ipi_ehdrlen + pi->ipi_ip_hlen;
+	if ((pi->ipi_csum_flags & CSUM_TSO) != 0) {
+		if (pi->ipi_etype == ETHERTYPE_IP)
+			cflags |= 1 << TPD_IPV4_SHIFT;
+		else
+			/* IPv6 needs LSOv2, see alx_ifl_txd_encap(). */
+			cflags |= 1 << TPD_LSO_V2_SHIFT;
+		cflags |= 1 << TPD_LSO_EN_SHIFT;
+		cflags |= FIELDX(TPD_L4HDROFFSET, poff);
+		cflags |= FIELDX(TPD_MSS, pi->ipi_tso_segsz);
+	} else {
+		if (pi->ipi_ipproto == IPPROTO_TCP)
+			csum_off = offsetof(struct tcphdr, th_sum);
+		else
+			csum_off = offsetof(struct udphdr, uh_sum);
+		cflags |= 1 << TPD_CXSUM_EN_SHIFT;
+		cflags |= FIELDX(TPD_CXSUMSTART, poff >> 1);
+		cflags |= FIELDX(TPD_CXSUMOFFSET, (poff + csum_off) >> 1);
+	}
+
+	return (cflags);
+}
+
+static int
+alx_ifl_txd_encap(void *arg, if_pkt_info_t pi)
+{
+	struct alx_ifl_softc *sc;
+	struct alx_ifl_tx_queue *txq;
+	struct tpd_desc *td;
+	bus_dma_segment_t *segs;
+	uint32_t cflags, vtag;
+	qidx_t pidx, ntxd;
+	int i;
+
+	sc = arg;
+	txq = &sc->txq[pi->ipi_qsidx];
+	segs = pi->ipi_segs;
+	ntxd = sc->scctx->isc_ntxd[0];
+
+	cflags = alx_ifl_tx_offload(pi);
+	vtag = 0;
+	if ((pi->ipi_mflags & M_VLANTAG) != 0) {
+		vtag = FIELDX(TPD_VLTAG, ALX_VLAN_TO_TAG(pi->ipi_vtag));
+		cflags |= 1 << TPD_INS_VLTAG_SHIFT;
+	}
+
+	pidx = pi->ipi_pidx;
+	td = NULL;
+
+	/*
+	 * With LSOv2 the first descriptor carries no data; its address word
+	 * holds the total frame length instead.
+	 */
+	if ((cflags & (1 << TPD_LSO_V2_SHIFT)) != 0) {
+		td = &txq->tpd[pidx];
+		td->addr = htole64(pi->ipi_len);
+		td->len = htole32(vtag);
+		td->flags = htole32(cflags);
+		pidx = (pidx + 1) % ntxd;
+	}
+
+	for (i = 0; i < pi->ipi_nsegs; i++) {
+		td = &txq->tpd[pidx];
+		td->addr = htole64(segs[i].ds_addr);
+		td->len = htole32(FIELDX(TPD_BUFLEN, segs[i].ds_len) | vtag);
+		td->flags = htole32(cflags);
+		pidx = (pidx + 1) % ntxd;
+	}
+
+	/* This is the last descriptor for this packet. */
+	td->flags |= htole32(1 << TPD_EOP_SHIFT);
+	pi->ipi_new_pidx = pidx;
+
+	return (0);
+}
+
+static void
+alx_ifl_txd_flush(void *arg, uint16_t txqid, qidx_t pidx)
+{
+	struct alx_ifl_softc *sc;
+
+	sc = arg;
+	ALX_MEM_W16(&sc->hw, sc->txq[txqid].p_reg, pidx);
+}
+
+/*
+ * Report how many descriptors the hardware has finished with since the last
+ * call that cleared them.
+ */
+static int
+alx_ifl_txd_credits_update(void *arg, uint16_t txqid, bool clear)
+{
+	struct alx_ifl_softc *sc;
+	struct alx_ifl_tx_queue *txq;
+	uint16_t hw_cidx;
+	int count, ntxd;
+
+	sc = arg;
+	txq = &sc->txq[txqid];
+	ntxd = sc->scctx->isc_ntxd[0];
+
+	ALX_MEM_R16(&sc->hw, txq->c_reg, &hw_cidx);
+	if (hw_cidx == txq->cidx)
+		return (0);
+	if (!clear)
+		return (1);
+
+	count = hw_cidx - txq->cidx;
+	if (hw_cidx < txq->cidx)
+		count += ntxd;
+	txq->cidx = hw_cidx;
+
+	return (count);
+}
+
+static int
+alx_ifl_rxd_available(void *arg, uint16_t rxqid, qidx_t idx, qidx_t budget)
+{
+	struct alx_ifl_softc *sc;
+	struct alx_ifl_rx_queue *rxq;
+	int cnt, nrxd;
+
+	sc = arg;
+	rxq = &sc->rxq;
+	nrxd = sc->scctx->isc_nrxd[ALX_IFL_RRD_RING];
+
+	for (cnt = 0; cnt < budget; cnt++) {
+		if ((le32toh(rxq->rrd[idx].word3) &
+		    (1 << RRD_UPDATED_SHIFT)) == 0)
+			break;
+		idx = (idx + 1) % nrxd;
+	}
+
+	return (cnt);
+}
+
+/*
+ * Translate one RRD. Frames never span RFDs since iflib sizes the buffers
+ * for the MTU, so an RRD that says otherwise, or that doesn't match the free
+ * list, means the rings are out of sync: fail and let iflib reset the
+ * interface.
+ */
+static int
+alx_ifl_rxd_pkt_get(void *arg, if_rxd_info_t ri)
+{
+	struct alx_ifl_softc *sc;
+	struct alx_ifl_rx_queue *rxq;
+	struct rrd_desc *rrd;
+	uint32_t word0, word2, word3;
+	int alg, cidx, len;
+
+	sc = arg;
+	rxq = &sc->rxq;
+	cidx = ri->iri_cidx;
+	rrd = &rxq->rrd[cidx];
+
+	word0 = le32toh(rrd->word0);
+	word2 = le32toh(rrd->word2);
+	word3 = le32toh(rrd->word3);
+	rrd->word3 &= ~htole32(1 << RRD_UPDATED_SHIFT);
+
+	if (FIELD_GETX(word0, RRD_SI) != cidx ||
+	    FIELD_GETX(word0, RRD_NOR) != 1) {
+		device_printf(sc->dev,
+		    "RX consumer index mismatch: %d vs. %d, and %d\n",
+		    cidx, FIELD_GETX(word0, RRD_SI),
+		    FIELD_GETX(word0, RRD_NOR));
+		return (EBADMSG);
+	}
+
+	len = FIELD_GETX(word3, RRD_PKTLEN) - ETHER_CRC_LEN;
+	ri->iri_len = len;
+	ri->iri_nfrags = 1;
+	ri->iri_frags[0].irf_flid = 0;
+	ri->iri_frags[0].irf_idx = cidx;
+	ri->iri_frags[0].irf_len = len;
+	ri->iri_cidx = (cidx + 1) % sc->scctx->isc_nrxd[ALX_IFL_RRD_RING];
+
+	/* A zero-length fragment makes iflib recycle the buffer. */
+	if ((word3 & ((1 << RRD_ERR_RES_SHIFT) |
+	    (1 << RRD_ERR_LEN_SHIFT))) != 0) {
+		rxq->rx_errors++;
+		ri->iri_frags[0].irf_len = 0;
+		return (0);
+	}
+
+	if ((if_getcapenable(ri->iri_ifp) & IFCAP_RXCSUM) != 0) {
+		switch (FIELD_GETX(word2, RRD_PID)) {
+		case RRD_PID_IPV4TCP:
+		case RRD_PID_IPV4UDP:
+			ri->iri_csum_flags |= CSUM_IP_CHECKED;
+			if ((word3 & (1 << RRD_ERR_IPV4_SHIFT)) != 0)
+				break;
+			ri->iri_csum_flags |= CSUM_IP_VALID;
+			/* FALLTHROUGH */
+		case RRD_PID_IPV6TCP:
+		case RRD_PID_IPV6UDP:
+			if ((word3 & (1 << RRD_ERR_L4_SHIFT)) == 0) {
+				ri->iri_csum_flags |= CSUM_DATA_VALID |
+				    CSUM_PSEUDO_HDR;
+				ri->iri_csum_data = 0xffff;
+			}
+			break;
+		case RRD_PID_IPV4:
+			ri->iri_csum_flags |= CSUM_IP_CHECKED;
+			if ((word3 & (1 << RRD_ERR_IPV4_SHIFT)) == 0)
+				ri->iri_csum_flags |= CSUM_IP_VALID;
+			break;
+		}
+	}
+
+	if ((if_getcapenable(ri->iri_ifp) & IFCAP_VLAN_HWTAGGING) != 0 &&
+	    (word3 & (1 << RRD_VLTAGGED_SHIFT)) != 0) {
+		ri->iri_vtag = ALX_TAG_TO_VLAN(FIELD_GETX(word2, RRD_VLTAG));
+		ri->iri_flags |= M_VLANTAG;
+	}
+
+	alg = FIELD_GETX(word2, RRD_RSSALG);
+	ri->iri_flowid = le32toh(rrd->rss_hash);
+	if (alg & RRD_RSSALG_TCPV4)
+		ri->iri_rsstype = M_HASHTYPE_RSS_TCP_IPV4;
+	else if (alg & RRD_RSSALG_IPV4)
+		ri->iri_rsstype = M_HASHTYPE_RSS_IPV4;
+	else if (alg & RRD_RSSALG_TCPV6)
+		ri->iri_rsstype = M_HASHTYPE_RSS_TCP_IPV6;
+	else if (alg & RRD_RSSALG_IPV6)
+		ri->iri_rsstype = M_HASHTYPE_RSS_IPV6;
+	else {
+		ri->iri_flowid = 0;
+		ri->iri_rsstype = M_HASHTYPE_NONE;
+	}
+
+	return (0);
+}
+
+static void
+alx_ifl_rxd_refill(void *arg, if_rxd_update_t iru)
+{
+	struct alx_ifl_softc *sc;
+	struct alx_ifl_rx_queue *rxq;
+	qidx_t pidx;
+	int i, nrxd;
+
+	sc = arg;
+	rxq = &sc->rxq;
+	nrxd = sc->scctx->isc_nrxd[ALX_IFL_RFD_RING];
+
+	pidx = iru->iru_pidx;
+	for (i = 0; i < iru->iru_count; i++) {
+		rxq->rfd[pidx].addr = htole64(iru->iru_paddrs[i]);
+		pidx = (pidx + 1) % nrxd;
+	}
+}
+
+static void
+alx_ifl_rxd_flush(void *arg, uint16_t rxqid, uint8_t flid, qidx_t pidx)
+{
+	struct alx_ifl_softc *sc;
+
+	sc = arg;
+	ALX_MEM_W16(&sc->hw, ALX_RFD_PIDX, pidx);
+}
@@ -0,0 +1,311 @@
+/*
+ * Copyright (c) 2012 Qualcomm Atheros, Inc.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * netmap(4) support for alx, included by if_alx.c when DEV_NETMAP is defined.
+ *
+ * Each TX queue maps onto one netmap TX ring. Only the hardware RX ring is
+ * exposed; the RSS software queues are fed by the driver and have no
+ * descriptors of their own. Netmap slots and NIC descriptors share indices,
+ * so a slot's buffer is simply written into the TPD or RFD of the same index.
+ */
+
+#include <net/netmap.h>
+#include <sys/selinfo.h>
+#include <vm/vm.h>
+#include <vm/pmap.h>
+#include <dev/netmap/netmap_kern.h>
+
+/*
+ * Switch the interface in or out of netmap mode. The rings are rebuilt by
+ * alx_init_locked(), which asks netmap_reset() who owns them.
+ */
+static int
+alx_netmap_reg(struct netmap_adapter *na, int onoff)
+{
+	struct ifnet *ifp;
+	struct alx_softc *sc;
+
+	ifp = na->ifp;
+	sc = ifp->if_softc;
+
+	ALX_LOCK(sc);
+	/* The rings are being resized; netmap is reattached afterwards. */
+	if (ALX_FLAG(sc, RESETING)) {
+		ALX_UNLOCK(sc);
+		return (EBUSY);
+	}
+	alx_stop(sc);
+	if (onoff)
+		nm_set_native_flags(na);
+	else
+		nm_clear_native_flags(na);
+	alx_init_locked(sc);
+	ALX_UNLOCK(sc);
+
+	return ((ifp->if_drv_flags & IFF_DRV_RUNNING) != 0 ? 0 : 1);
+}
+
+/*
+ * Post the slots the application has filled since the last call as TPDs, then
+ * report how far the hardware has got.
+ */
+static int
+alx_netmap_txsync(struct netmap_kring *kring, int flags)
+{
+	struct netmap_adapter *na;
+	struct netmap_ring *ring;
+	struct netmap_slot *slot;
+	struct alx_softc *sc;
+	struct alx_tx_queue *txq;
+	struct alx_buffer *tx_buf;
+	struct tpd_desc *td;
+	uint64_t paddr;
+	void *addr;
+	u_int const lim = kring->nkr_num_slots - 1;
+	u_int const head = kring->rhead;
+	u_int len, nic_i, nm_i;
+	uint16_t hw_cidx;
+
+	na = kring->na;
+	ring = kring->ring;
+	sc = na->ifp->if_softc;
+	txq = &sc->alx_tx_queue[kring->ring_id];
+
+	nm_i = kring->nr_hwcur;
+	if (nm_i != head) {
+		nic_i = netmap_idx_k2n(kring, nm_i);
+		while (nm_i != head) {
+			slot = &ring->slot[nm_i];
+			len = slot->len;
+			addr = PNMB(na, slot, &paddr);
+			td = &txq->tpd_hdr[nic_i];
+			tx_buf = &txq->bf_info[nic_i];
+
+			NM_CHECK_ADDR_LEN(na, addr, len);
+
+			if ((slot->flags & NS_BUF_CHANGED) != 0)
+				netmap_reload_map(na, sc->alx_tx_buf_tag,
+				    tx_buf->dmamap, addr);
+			slot->flags &= ~(NS_REPORT | NS_BUF_CHANGED);
+
+			td->addr = htole64(paddr);
+			td->len = htole32(FIELDX(TPD_BUFLEN, len));
+			td->flags = htole32(1 << TPD_EOP_SHIFT);
+			bus_dmamap_sync(sc->alx_tx_buf_tag, tx_buf->dmamap,
+			    BUS_DMASYNC_PREWRITE);
+
+			nm_i = nm_next(nm_i, lim);
+			nic_i = nm_next(nic_i, lim);
+		}
+		kring->nr_hwcur = head;
+
+		bus_dmamap_sync(sc->ring_header.tag, sc->ring_header.map,
+		    BUS_DMASYNC_PREREAD | BUS_DMASYNC_PREWRITE);
+		txq->pidx = nic_i;
+		ALX_MEM_W16(&sc->hw, txq->p_reg, nic_i);
+	}
+
+	if ((flags & NAF_FORCE_RECLAIM) != 0 || nm_kr_txempty(kring)) {
+		ALX_MEM_R16(&sc->hw, txq->c_reg, &hw_cidx);
+		if (hw_cidx > lim) {
+			D("TX consumer index %d too large", hw_cidx);
+			hw_cidx -= kring->nkr_num_slots;
+		}
+		txq->cidx = hw_cidx;
+		kring->nr_hwtail = nm_prev(netmap_idx_n2k(kring, hw_cidx), lim);
+	}
+
+	return (0);
+}
+
+/*
+ * Hand newly completed RRDs to the application and give the RFDs for the slots
+ * it has released back to the hardware.
+ */
+static int
+alx_netmap_rxsync(struct netmap_kring *kring, int flags)
+{
+	struct netmap_adapter *na;
+	struct netmap_ring *ring;
+	struct netmap_slot *slot;
+	struct alx_softc *sc;
+	struct alx_rx_queue *rxq;
+	struct alx_buffer *rx_buf;
+	struct rrd_desc *rrd;
+	uint64_t paddr;
+	void *addr;
+	u_int const lim = kring->nkr_num_slots - 1;
+	u_int const head = kring->rhead;
+	u_int n, nic_i, nm_i;
+	uint32_t word3;
+	int force_update;
+
+	na = kring->na;
+	ring = kring->ring;
+	sc = na->ifp->if_softc;
+	rxq = &sc->alx_rx_queue[kring->ring_id];
+	force_update = (flags & NAF_FORCE_READ) != 0 ||
+	    (kring->nr_kflags & NKR_PENDINTR) != 0;
+
+	if (head > lim)
+		return (netmap_ring_reinit(kring));
+
+	bus_dmamap_sync(sc->ring_header.tag, sc->ring_header.map,
+	    BUS_DMASYNC_POSTREAD | BUS_DMASYNC_POSTWRITE);
+
+	if (netmap_no_pendintr || force_update) {
+		nic_i = rxq->cidx;
+		nm_i = netmap_idx_n2k(kring, nic_i);
+		for (n = 0; ; n++) {
+			rrd = &rxq->rrd_hdr[nic_i];
+			word3 = le32toh(rrd->word3);
+			if ((word3 & (1 << RRD_UPDATED_SHIFT)) == 0)
+				break;
+			rrd->word3 &= ~htole32(1 << RRD_UPDATED_SHIFT);
+
+			slot = &ring->slot[nm_i];
+			slot->len = FIELD_GETX(word3, RRD_PKTLEN) -
+			    ETHER_CRC_LEN;
+			slot->flags = 0;
+			bus_dmamap_sync(sc->alx_rx_buf_tag,
+			    rxq->bf_info[nic_i].dmamap, BUS_DMASYNC_POSTREAD);
+
+			nm_i = nm_next(nm_i, lim);
+			nic_i = nm_next(nic_i, lim);
+		}
+		if (n != 0) {
+			rxq->cidx = nic_i;
+			kring->nr_hwtail = nm_i;
+			bus_dmamap_sync(sc->ring_header.tag,
+			    sc->ring_header.map,
+			    BUS_DMASYNC_PREREAD | BUS_DMASYNC_PREWRITE);
+		}
+		kring->nr_kflags &= ~NKR_PENDINTR;
+	}
+
+	nm_i = kring->nr_hwcur;
+	if (nm_i != head) {
+		nic_i = netmap_idx_k2n(kring, nm_i);
+		while (nm_i != head) {
+			slot = &ring->slot[nm_i];
+			addr = PNMB(na, slot, &paddr);
+			rx_buf = &rxq->bf_info[nic_i];
+
+			if (addr == NETMAP_BUF_BASE(na))
+				return (netmap_ring_reinit(kring));
+
+			if ((slot->flags & NS_BUF_CHANGED) != 0) {
+				netmap_reload_map(na, sc->alx_rx_buf_tag,
+				    rx_buf->dmamap, addr);
+				slot->flags &= ~NS_BUF_CHANGED;
+			}
+			rxq->rfd_hdr[nic_i].addr = htole64(paddr);
+			bus_dmamap_sync(sc->alx_rx_buf_tag, rx_buf->dmamap,
+			    BUS_DMASYNC_PREREAD);
+
+			nm_i = nm_next(nm_i, lim);
+			nic_i = nm_next(nic_i, lim);
+		}
+		kring->nr_hwcur = head;
+
+		bus_dmamap_sync(sc->ring_header.tag, sc->ring_header.map,
+		    BUS_DMASYNC_PREREAD | BUS_DMASYNC_PREWRITE);
+		/* As in alx_rx_refill(), one slot always stays empty. */
+		rxq->pidx = nm_prev(nic_i, lim);
+		ALX_MEM_W16(&sc->hw, rxq->p_reg, rxq->pidx);
+	}
+
+	return (0);
+}
+
+/*
+ * Load the netmap buffers into the TX buffer maps if the ring is in netmap
+ * mode. The descriptors themselves are only written by txsync.
+ */
+static void
+alx_netmap_init_tx(struct alx_softc *sc, struct alx_tx_queue *txq)
+{
+	struct netmap_adapter *na;
+	struct netmap_slot *slot;
+	uint64_t paddr;
+	int i, si;
+
+	na = NA(sc->alx_ifp);
+	slot = netmap_reset(na, NR_TX, txq->qidx, 0);
+	if (slot == NULL)
+		return;
+
+	for (i = 0; i < sc->tx_ringsz; i++) {
+		si = netmap_idx_n2k(&na->tx_rings[txq->qidx], i);
+		netmap_load_map(na, sc->alx_tx_buf_tag,
+		    txq->bf_info[i].dmamap, PNMB(na, slot + si, &paddr));
+	}
+}
+
+/*
+ * Give netmap ownership of the hardware RX ring if it is in netmap mode: all
+ * but one RFD are filled with netmap buffers and handed to the chip. Returns
+ * true if so, in which case the driver must not refill the ring itself.
+ */
+static bool
+alx_netmap_init_rx(struct alx_softc *sc, struct alx_rx_queue *rxq)
+{
+	struct netmap_adapter *na;
+	struct netmap_slot *slot;
+	uint64_t paddr;
+	void *addr;
+	int i, si;
+
+	na = NA(sc->alx_ifp);
+	slot = netmap_reset(na, NR_RX, rxq->qidx, 0);
+	if (slot == NULL)
+		return (false);
+
+	for (i = 0; i < sc->rx_ringsz; i++) {
+		si = netmap_idx_n2k(&na->rx_rings[rxq->qidx], i);
+		addr = PNMB(na, slot + si, &paddr);
+		netmap_load_map(na, sc->alx_rx_buf_tag,
+		    rxq->bf_info[i].dmamap, addr);
+		rxq->rfd_hdr[i].addr = htole64(paddr);
+	}
+
+	bus_dmamap_sync(sc->ring_header.tag, sc->ring_header.map,
+	    BUS_DMASYNC_PREREAD | BUS_DMASYNC_PREWRITE);
+	rxq->pidx = sc->rx_ringsz - 1 -
+	    nm_kr_rxspace(&na->rx_rings[rxq->qidx]);
+	ALX_MEM_W16(&sc->hw, rxq->p_reg, rxq->pidx);
+	return (true);
+}
+
+static void
+alx_netmap_attach(struct alx_softc *sc)
+{
+	struct netmap_adapter na;
+
+	bzero(&na, sizeof(na));
+
+	na.ifp = sc->alx_ifp;
+	na.na_flags = NAF_BDG_MAYSLEEP;
+	na.num_tx_desc = sc->tx_ringsz;
+	na.num_rx_desc = sc->rx_ringsz;
+	na.nm_txsync = alx_netmap_txsync;
+	na.nm_rxsync = alx_netmap_rxsync;
+	na.nm_register = alx_netmap_reg;
+	na.num_tx_rings = sc->nr_txq;
+	na.num_rx_rings = sc->nr_hwrxq;
+	netmap_attach(&na);
+}
@@ -17,28 +17,63 @@
 #ifndef _IF_ALXVAR_H_
 #define	_IF_ALXVAR_H_
 
-#define ALX_WATCHDOG_TIME   (5 * HZ)
+/* seconds, counted down by alx_tick() */
+#define ALX_WATCHDOG_TIME	5
+/* a second ring reset within this many seconds resets the whole chip */
+#define ALX_RECOVER_INTERVAL	10
 
 /*
  * alx_ring_header is a single, contiguous block of memory space
- * used by the three descriptor rings (tpd, rfd, rrd)
+ * used by the three descriptor rings (tpd, rfd, rrd) of every queue
  */
 struct alx_ring_header {
 	/* virt addr */
 	void		*desc;
 	/* phy addr */
-	bus_dmamap_t	 dma;
+	bus_addr_t	 dma;
 	uint32_t	 size;
+	bus_dma_tag_t	 tag;
+	bus_dmamap_t	 map;
 };
+/* each ring starts on its own cache line */
+#define ALX_RING_ALIGN	CACHE_LINE_SIZE
 
 struct alx_buffer {
 	struct mbuf	*m;
 	bus_dmamap_t	 dmamap;
+	/* when the frame was queued, if histograms are enabled */
+	sbintime_t	 tstamp;
+	int		 flags;
+};
+
+/*
+ * The rings together with their buffer arrays and DMA maps, which are sized
+ * by tx_ringsz and rx_ringsz. Resizing builds a new set and swaps it in.
+ */
+struct alx_rings {
+	struct alx_ring_header	 rh;
+	struct alx_buffer	*tx_bf[ALX_MAX_TX_QUEUES];
+	struct alx_buffer	*rx_bf[ALX_MAX_RX_QUEUES];
+	int			 tx_ringsz;
+	int			 rx_ringsz;
+};
+
+/*
+ * Histograms kept while dev.alx.N.histograms is set. Bucket 0 counts zeros,
+ * bucket i values in [2^(i-1), 2^i) and the last bucket everything above.
+ */
+#define ALX_HIST_BUCKETS	20
+struct alx_hist {
+	uint64_t	 bucket[ALX_HIST_BUCKETS];
 };
 #define ALX_BUF_TX_FIRSTFRAG	0x1
+/* the descriptor points into the queue's bounce pool */
+#define ALX_BUF_TX_BOUNCE	0x2
 
 /* rx queue */
 struct alx_rx_queue {
+	struct alx_softc *sc;
+
 	struct rrd_desc *rrd_hdr;
 	bus_addr_t rrd_dma;
 
@@ -46,6 +81,8 @@ struct alx_rx_queue {
 	bus_addr_t rfd_dma;
 
 	struct alx_buffer *bf_info;
+	/* loaded with a fresh buffer before it replaces a slot's map */
+	bus_dmamap_t spare_map;
 
 	/* number of ring elements */
 	uint16_t count;
@@ -61,12 +98,47 @@ struct alx_rx_queue {
 	/* queue index */
 	uint16_t qidx;
 	unsigned long flag;
+
+	/*
+	 * Frames steered to this queue by RSS. Only the hardware queues own
+	 * RRD/RFD rings; the others are fed from the RSS queue number in each
+	 * RRD and drained by swq_task.
+	 */
+	struct mbuf		*swq_head;
+	struct mbuf		*swq_tail;
+	struct task		 swq_task;
+	struct taskqueue	*swq_tq;
+
+	/*
+	 * Used by whoever delivers this queue's frames: swq_task for software
+	 * queues, alx_rxintr() with rx_mtx held for the hardware queue.
+	 */
+	struct lro_ctrl		 lro;
+
+	/* frames and bytes passed up the stack from this queue */
+	counter_u64_t		 rx_packets;
+	counter_u64_t		 rx_bytes;
+	/* no replacement buffer, so the frame was dropped */
+	counter_u64_t		 rx_mbuf_fail;
+	/* RRDs that didn't match the RFD ring, each followed by a reset */
+	counter_u64_t		 rx_desync;
+	/* frames processed per alx_rxintr() call, hardware queues only */
+	struct alx_hist		 rx_poll_pkts;
+
+	/* protects the ring, or only the swq_* fields for software queues */
+	struct mtx		 rx_mtx;
+	char			 rx_mtx_name[16];
 };
 #define ALX_RQ_USING		1
 #define ALX_RX_ALLOC_THRESH	32
+/* frames up to this size are copied out and their buffer reused */
+#define ALX_RX_COPYBREAK_DEF	128
+#define ALX_RX_COPYBREAK_MAX	(MHLEN - ETHER_ALIGN)
 
 /* tx queue */
 struct alx_tx_queue {
+	struct alx_softc *sc;
+
 	struct tpd_desc *tpd_hdr;
 	bus_addr_t tpd_dma;
 
@@ -84,10 +156,175 @@ struct alx_tx_queue {
 	uint16_t c_reg;
 	/* queue index */
 	u16 qidx;
+	/* free descriptors */
+	int avail;
+	/* descriptors queued since the last producer index write */
+	int pending;
+	/* ring full, waiting for ALX_TX_WAKEUP_THRESH free descriptors */
+	bool oactive;
+	/* seconds left for the hardware to make progress, 0 when idle */
+	int watchdog;
+
+	/*
+	 * Pre-mapped buffers for frames that are cheaper to copy than to map.
+	 * Slots are taken and given back in ring order.
+	 */
+	caddr_t			 bounce;
+	bus_addr_t		 bounce_dma;
+	bus_dmamap_t		 bounce_map;
+	int			 bounce_next;
+	int			 bounce_used;
+
+	struct mtx		 tx_mtx;
+	char			 tx_mtx_name[16];
+	/* frames queued by if_transmit */
+	struct buf_ring		*br;
+	/* deferred transmit, used when the queue lock is contended */
+	struct task		 start_task;
+	struct taskqueue	*tq;
+
+	counter_u64_t		 tx_packets;
+	counter_u64_t		 tx_bytes;
+	/* frames dropped because they couldn't be collapsed or mapped */
+	counter_u64_t		 tx_mbuf_fail;
+	counter_u64_t		 tx_drops;
+	/* frames that needed m_collapse() to fit in ALX_MAXTXSEGS */
+	counter_u64_t		 tx_collapse;
+	/* frames copied into the bounce pool */
+	counter_u64_t		 tx_bounce;
+	/* times a frame had to wait for free descriptors */
+	counter_u64_t		 tx_ring_full;
+	counter_u64_t		 tx_watchdog;
+	/* alx_xmit() to completion (us) */
+	struct alx_hist		 tx_compl_lat;
 };
+#define ALX_TX_BUFRING_SIZE	4096
+
+#define ALX_MAXTXSEGS		35
+#define ALX_TSO_MAXSEGSIZE	4096
+#define ALX_TSO_MAXSIZE		(65535 + sizeof(struct ether_vlan_header))
+
+/*
+ * TCP and UDP checksums are offloaded in the descriptor's custom checksum mode,
+ * which works the same way for IPv4 and IPv6. The IPv4 header checksum is
+ * left to the stack.
+ */
+#define ALX_CSUM_FEATURES_IPV4	(CSUM_TCP | CSUM_UDP)
+#define ALX_CSUM_FEATURES_IPV6	(CSUM_TCP_IPV6 | CSUM_UDP_IPV6)
+#define ALX_CSUM_FEATURES	(ALX_CSUM_FEATURES_IPV4 | ALX_CSUM_FEATURES_IPV6)
+
+/* The smallest MTU IPv4 must be able to use (RFC 791). */
+#define ALX_MIN_MTU		68
+#define ALX_MAX_MTU		(ALX_MAX_FRAME_SIZE - ALX_RAW_MTU(0))
 
 #define ALX_TX_WAKEUP_THRESH(_tq) ((_tq)->count / 4)
+/* bounce slots per TX queue, and the size of each */
+#define ALX_TX_BOUNCE_SLOTS	128
+#define ALX_TX_BOUNCE_SIZE	MCLBYTES
+/* frames up to this size are copied into a bounce slot rather than mapped */
+#define ALX_TX_BOUNCE_DEF	256
+/* reclaim inline below this many free descriptors: one maximal frame */
+#define ALX_TX_RECLAIM_THRESH	(ALX_MAXTXSEGS + 1)
 #define ALX_DEFAULT_TX_WORK		128
+#define ALX_DEFAULT_RX_WORK		64
+#define ALX_DEFAULT_TX_DOORBELL		32
+
+/* descriptors per ring; the RRD ring size register is only 12 bits wide */
+#define ALX_TX_RING_DEF		256
+#define ALX_RX_RING_DEF		512
+#define ALX_RING_MIN		64
+#define ALX_TX_RING_MAX		4096
+#define ALX_RX_RING_MAX		ALX_RRD_RING_SZ_MASK
+
+/*
+ * Interrupt moderation profiles. In adaptive mode the moderation timer (in
+ * usecs) and the TX completion threshold are retuned every ALX_IMOD_INTERVAL
+ * ticks from the packets and bytes seen per interrupt.
+ */
+#define ALX_IMOD_FIXED		0
+#define ALX_IMOD_ADAPTIVE	1
+#define ALX_IMOD_LOWLAT		2
+#define ALX_IMOD_BULK		3
+#define ALX_IMOD_INTERVAL	(hz / 10)
+
+#define ALX_IMT_LOWLAT		20
+#define ALX_IMT_MID		100
+#define ALX_IMT_BULK		200
+#define ALX_IMT_MAX		0xFFFF
+
+/* thresholds for moving between the adaptive classes */
+#define ALX_IMOD_LOWLAT_PKTS	4	/* packets per interrupt */
+#define ALX_IMOD_BULK_BYTES	1024	/* average frame length */
+
+/*
+ * Power profiles. Low latency keeps ASPM L0s/L1, EEE and MAC clock gating
+ * off so that the link and the MAC never have to wake up for a frame.
+ */
+#define ALX_PM_POWERSAVE	0
+#define ALX_PM_LOWLAT		1
+
+/*
+ * Loopback benchmark. Frames are built by the driver, looped back by the MAC
+ * or the PHY and recognised by their ethertype and magic number on receipt.
+ */
+#define ALX_BENCH_NONE		0
+#define ALX_BENCH_MAC		1
+#define ALX_BENCH_PHY		2
+#define ALX_BENCH_MAX_SIZES	8
+#define ALX_BENCH_FRAMES_DEF	10000
+#define ALX_BENCH_FRAMES_MAX	(1 << 20)
+#define ALX_BENCH_SIZES_DEF	"60,512,1514"
+#define ALX_BENCH_ETHERTYPE	0x88B5	/* IEEE 802 local experimental */
+#define ALX_BENCH_MAGIC		0x616C7862
+/* give up on a run once nothing has come back for this long */
+#define ALX_BENCH_TIMEOUT	SBT_1S
+
+struct alx_bench_hdr {
+	struct ether_header	eh;
+	uint32_t		magic;
+	uint16_t		txq;
+	uint16_t		size;
+	uint32_t		seq;
+	sbintime_t		stamp;
+} __packed;
+
+/* One queue and frame size; latencies are in nanoseconds. */
+struct alx_bench_result {
+	int			size;
+	u_int			sent;
+	u_int			received;
+	uint64_t		pps;
+	uint64_t		bps;
+	uint32_t		lat_min;
+	uint32_t		lat_avg;
+	uint32_t		lat_p99;
+};
+
+struct alx_bench {
+	/* settings */
+	int			frames;
+	char			sizes[64];
+
+	/* the last run */
+	int			mode;
+	struct alx_bench_result	res[ALX_MAX_TX_QUEUES][ALX_BENCH_MAX_SIZES];
+
+	/* the queue and size being measured, read by alx_bench_input() */
+	volatile int		txq;
+	int			size;
+	u_int			nframes;
+	uint32_t		*lat;
+	volatile u_int		received;
+	volatile sbintime_t	last_rx;
+};
+
+/*
+ * Link states, see alx_link_task(). In ALX_LSTATE_ANEG the PHY has just been
+ * (re)configured and is polled once a second besides its interrupt.
+ */
+#define ALX_LSTATE_DOWN		0
+#define ALX_LSTATE_ANEG		1
+#define ALX_LSTATE_UP		2
 
 enum ALX_FLAGS {
 	ALX_FLAG_USING_MSIX = 0,
@@ -104,6 +341,34 @@ enum ALX_FLAGS {
 	ALX_FLAG_NUMBER_OF_FLAGS,
 };
 
+/*
+ * An MSI-X vector. Vector 0 handles PHY and other miscellaneous events; each
+ * of the remaining vectors services an RX/TX queue pair.
+ */
+struct alx_vec {
+	struct alx_softc	*sc;
+	/* the RSS queue whose software queue task runs here */
+	struct alx_rx_queue	*rxq;
+	/* the hardware RX ring, on the vector its interrupts go to */
+	struct alx_rx_queue	*hwrxq;
+	struct alx_tx_queue	*txq;
+	int			 vec_idx;
+	/* ISR bits serviced by this vector */
+	uint32_t		 vec_mask;
+
+	struct resource		*irq;
+	void			*cookie;
+	struct task		 task;
+	struct taskqueue	*tq;
+
+	/*
+	 * Interrupt to task delay (us). Without MSI-X vector 0 stands for the
+	 * single interrupt and alx_int_task.
+	 */
+	sbintime_t		 intr_time;
+	struct alx_hist		 intr_delay;
+};
+
 struct alx_hw;
 /*
  *board specific private data structure
@@ -115,13 +380,15 @@ struct alx_softc {
 
 	/* totally msix vectors */
 	int			nr_vec;
-	struct msix_entry	*msix_ent;
+	struct alx_vec		alx_vec[ALX_MAX_MSIX_INTRS];
 
 	/* all descriptor memory */
 	struct alx_ring_header	ring_header;
 	int			tx_ringsz;
 	int			rx_ringsz;
 	int			rxbuf_size;
+	/* size of the mbuf clusters backing the RX buffers */
+	int			rxbuf_clsize;
 
 #ifdef notyet
 	struct alx_napi		*qnapi[8];
@@ -146,8 +413,6 @@ struct alx_softc {
 
 	/* ethtool private flags */
 	u32			eth_pflags;
-	int			eth_diag_vect;
-	int			eth_diag_cnt;
 
 	/* FreeBSD stuff is below. */
         device_t		 alx_dev;
@@ -159,33 +424,88 @@ struct alx_softc {
         struct ifnet		*alx_ifp;
 	int			 alx_if_flags;
 
+	int			 alx_rx_process_limit;
+	int			 alx_tx_process_limit;
+	int			 alx_tx_doorbell_thresh;
+	int			 alx_rx_copybreak;
+	int			 alx_tx_bounce;
+	/* software RX stamps taken by the driver, not the MAC; alx_rxintr() */
+	int			 alx_rx_sw_tstmp;
+
+	/* interrupt moderation, see ALX_IMOD_* */
+	int			 alx_imod_profile;
+	int			 alx_imod_fixed;
+	u_int			 alx_imod_ticks;
+	volatile u_int		 alx_imod_pkts;
+	volatile u_int		 alx_imod_bytes;
+	volatile u_int		 alx_imod_intrs;
+
+	/* ALX_PM_*, mirrored in hw.low_latency */
+	int			 alx_pm_profile;
+	/* keep the struct alx_hist histograms */
+	int			 alx_hist_enable;
+	/* loopback benchmark; ALX_FLAG_TESTING is set while it runs */
+	struct alx_bench	 alx_bench;
+
+	/* once a second: MIB harvest, link poll during autonegotiation */
+	struct callout		 alx_tick_ch;
+
+	/* error recovery, see alx_recover() */
+	struct task		 alx_reset_task;
+	int			 alx_recover_time;
+	u_long			 alx_ring_resets;
+	u_long			 alx_chip_resets;
+
+	/* ALX_LSTATE_*, and the PHY state as last read by alx_link_task() */
+	int			 alx_link_state;
+	bool			 alx_phy_link;
+	uint16_t		 alx_phy_speed;
+
 	struct taskqueue	*alx_tq;
 	struct task		 alx_int_task;
         struct task              alx_link_task;
 
 	bus_dma_tag_t		 alx_parent_tag;
 
-	bus_dma_tag_t		 alx_tx_tag;
-	bus_dmamap_t		 alx_tx_dmamap;
-
         bus_dma_tag_t            alx_tx_buf_tag;
 	bus_dma_tag_t		 alx_rx_buf_tag;
+	bus_dma_tag_t		 alx_tx_bounce_tag;
 
-	bus_dma_tag_t		 alx_rx_tag;
-	bus_dmamap_t		 alx_rx_dmamap;
-
-	bus_dma_tag_t		 alx_rr_tag;
-	bus_dmamap_t		 alx_rr_dmamap;
-
-	struct alx_tx_queue	 alx_tx_queue;
-	struct alx_rx_queue	 alx_rx_queue;
+	struct alx_tx_queue	 alx_tx_queue[ALX_MAX_TX_QUEUES];
+	struct alx_rx_queue	 alx_rx_queue[ALX_MAX_RX_QUEUES];
 
 	struct mtx		 alx_mtx;
+	/* hw->imask, alx_int_masked and the IMR register */
+	struct mtx		 alx_imr_mtx;
+	/* the queue bits are masked until alx_int_task() has caught up */
+	bool			 alx_int_masked;
 };
 
+/*
+ * alx_mtx covers configuration and link state. The data path only takes the
+ * per-queue locks, which are ordered after alx_mtx; the RX lock for a
+ * hardware ring may be held while taking a software queue's RX lock.
+ */
 #define	ALX_LOCK(sc)		mtx_lock(&(sc)->alx_mtx)
 #define	ALX_UNLOCK(sc)		mtx_unlock(&(sc)->alx_mtx)
 #define	ALX_LOCK_ASSERT(sc)	mtx_assert(&(sc)->alx_mtx, MA_OWNED)
+#define	ALX_UNLOCK_ASSERT(sc)	mtx_assert(&(sc)->alx_mtx, MA_NOTOWNED)
+
+/*
+ * IMR is written from the interrupt filters as well as from tasks, so it is
+ * kept under a spin lock of its own.
+ */
+#define	ALX_IMR_LOCK(sc)	mtx_lock_spin(&(sc)->alx_imr_mtx)
+#define	ALX_IMR_UNLOCK(sc)	mtx_unlock_spin(&(sc)->alx_imr_mtx)
+
+#define	ALX_RX_LOCK(rxq)	mtx_lock(&(rxq)->rx_mtx)
+#define	ALX_RX_UNLOCK(rxq)	mtx_unlock(&(rxq)->rx_mtx)
+#define	ALX_RX_LOCK_ASSERT(rxq)	mtx_assert(&(rxq)->rx_mtx, MA_OWNED)
+
+#define	ALX_TX_LOCK(txq)	mtx_lock(&(txq)->tx_mtx)
+#define	ALX_TX_TRYLOCK(txq)	mtx_trylock(&(txq)->tx_mtx)
+#define	ALX_TX_UNLOCK(txq)	mtx_unlock(&(txq)->tx_mtx)
+#define	ALX_TX_LOCK_ASSERT(txq)	mtx_assert(&(txq)->tx_mtx, MA_OWNED)
 
 #define ALX_FLAG(_adpt, _FLAG) (\
 	test_bit(ALX_FLAG_##_FLAG, &(_adpt)->flags))
@@ -194,6 +514,10 @@ struct alx_softc {
 #define ALX_FLAG_CLEAR(_adpt, _FLAG) (\
 	clear_bit(ALX_FLAG_##_FLAG, &(_adpt)->flags))
 
+/* The descriptors hold VLAN tags in network byte order. */
+#define ALX_VLAN_TO_TAG(_vlan)	bswap16(_vlan)
+#define ALX_TAG_TO_VLAN(_tag)	bswap16(_tag)
+
 #define ALX_TX_INC(i, s)	(((i) + 1) % (s)->tx_ringsz)
 #define ALX_TX_DEC(i, s)	(((i) + (s)->tx_ringsz - 1) % (s)->tx_ringsz)
 